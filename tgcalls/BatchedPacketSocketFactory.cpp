@@ -0,0 +1,480 @@
+#include "BatchedPacketSocketFactory.h"
+
+#include "rtc_base/thread.h"
+
+#ifdef WEBRTC_LINUX
+
+#include "UdpBatch.h"
+
+#include "rtc_base/async_packet_socket.h"
+#include "rtc_base/physical_socket_server.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <array>
+#include <memory>
+
+namespace tgcalls {
+namespace {
+
+// Read batches per read event, so that a flood doesn't starve the thread.
+constexpr auto kMaxReadBatches = 4;
+
+class BatchedUdpSocket final : public rtc::AsyncPacketSocket, public rtc::Dispatcher {
+public:
+	static BatchedUdpSocket *Create(
+		rtc::Thread *thread,
+		rtc::PhysicalSocketServer *server,
+		const rtc::SocketAddress &address,
+		uint16_t minPort,
+		uint16_t maxPort);
+	~BatchedUdpSocket() override;
+
+	rtc::SocketAddress GetLocalAddress() const override;
+	rtc::SocketAddress GetRemoteAddress() const override;
+	int Send(const void *data, size_t size, const rtc::PacketOptions &options) override;
+	int SendTo(
+		const void *data,
+		size_t size,
+		const rtc::SocketAddress &address,
+		const rtc::PacketOptions &options) override;
+	int Close() override;
+	State GetState() const override;
+	int GetOption(rtc::Socket::Option option, int *value) override;
+	int SetOption(rtc::Socket::Option option, int value) override;
+	int GetError() const override;
+	void SetError(int error) override;
+
+	uint32_t GetRequestedEvents() override;
+	void OnPreEvent(uint32_t events) override;
+	void OnEvent(uint32_t events, int error) override;
+	int GetDescriptor() override;
+	bool IsDescriptorClosed() override;
+
+private:
+	struct Outgoing {
+		int64_t packetId = 0;
+		rtc::PacketInfo info;
+	};
+
+	BatchedUdpSocket(rtc::Thread *thread, rtc::PhysicalSocketServer *server, int descriptor);
+
+	bool bind(const rtc::SocketAddress &address, uint16_t minPort, uint16_t maxPort);
+	int sendNow(
+		const void *data,
+		size_t size,
+		const sockaddr_storage &address,
+		socklen_t addressLength,
+		const rtc::PacketOptions &options);
+	void scheduleFlush();
+	void flush();
+	void setWriteBlocked(bool blocked);
+	void readAll();
+	bool translateOption(rtc::Socket::Option option, int *level, int *name) const;
+
+	rtc::Thread *_thread = nullptr;
+	rtc::PhysicalSocketServer *_server = nullptr;
+	int _descriptor = -1;
+	int _error = 0;
+	rtc::SocketAddress _localAddress;
+	UdpSendBatch _sendBatch;
+	std::array<Outgoing, kUdpBatchSize> _outgoing;
+	bool _flushScheduled = false;
+	bool _writeBlocked = false;
+	std::shared_ptr<bool> _alive;
+	UdpReceiveBatch _receiveBatch;
+
+};
+
+BatchedUdpSocket *BatchedUdpSocket::Create(
+		rtc::Thread *thread,
+		rtc::PhysicalSocketServer *server,
+		const rtc::SocketAddress &address,
+		uint16_t minPort,
+		uint16_t maxPort) {
+	const auto descriptor = ::socket(
+		address.family(),
+		SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		0);
+	if (descriptor < 0) {
+		return nullptr;
+	}
+	auto result = std::unique_ptr<BatchedUdpSocket>(
+		new BatchedUdpSocket(thread, server, descriptor));
+	if (!result->bind(address, minPort, maxPort)) {
+		return nullptr;
+	}
+	result->_server->Add(result.get());
+	return result.release();
+}
+
+BatchedUdpSocket::BatchedUdpSocket(
+	rtc::Thread *thread,
+	rtc::PhysicalSocketServer *server,
+	int descriptor) :
+_thread(thread),
+_server(server),
+_descriptor(descriptor),
+_alive(std::make_shared<bool>(true)) {
+}
+
+BatchedUdpSocket::~BatchedUdpSocket() {
+	Close();
+}
+
+bool BatchedUdpSocket::bind(
+		const rtc::SocketAddress &address,
+		uint16_t minPort,
+		uint16_t maxPort) {
+	const auto tryBind = [&](const rtc::SocketAddress &address) {
+		sockaddr_storage storage = { 0 };
+		const auto length = address.ToSockAddrStorage(&storage);
+		return ::bind(_descriptor, reinterpret_cast<sockaddr*>(&storage), socklen_t(length)) == 0;
+	};
+	auto bound = false;
+	if (!minPort && !maxPort) {
+		bound = tryBind(address);
+	} else {
+		for (auto port = int(minPort); !bound && port <= int(maxPort); ++port) {
+			bound = tryBind(rtc::SocketAddress(address.ipaddr(), port));
+		}
+	}
+	if (!bound) {
+		RTC_LOG(LS_WARNING) << "Batched UDP bind failed: " << errno;
+		return false;
+	}
+	sockaddr_storage storage = { 0 };
+	auto length = socklen_t(sizeof(storage));
+	if (::getsockname(_descriptor, reinterpret_cast<sockaddr*>(&storage), &length) != 0
+		|| !rtc::SocketAddressFromSockAddrStorage(storage, &_localAddress)) {
+		return false;
+	}
+	return true;
+}
+
+rtc::SocketAddress BatchedUdpSocket::GetLocalAddress() const {
+	return _localAddress;
+}
+
+rtc::SocketAddress BatchedUdpSocket::GetRemoteAddress() const {
+	return rtc::SocketAddress();
+}
+
+int BatchedUdpSocket::Send(const void *data, size_t size, const rtc::PacketOptions &options) {
+	_error = ENOTCONN;
+	return -1;
+}
+
+int BatchedUdpSocket::SendTo(
+		const void *data,
+		size_t size,
+		const rtc::SocketAddress &address,
+		const rtc::PacketOptions &options) {
+	if (_descriptor < 0) {
+		_error = EBADF;
+		return -1;
+	} else if (size > kUdpMaxDatagramSize) {
+		// Larger datagrams couldn't be read by the other side either.
+		_error = EMSGSIZE;
+		return -1;
+	} else if (_sendBatch.full()) {
+		// Make room right away, so that a full socket buffer is
+		// reported to the caller instead of losing the datagram later.
+		flush();
+		if (_sendBatch.full()) {
+			_error = EWOULDBLOCK;
+			return -1;
+		}
+	}
+	sockaddr_storage storage = { 0 };
+	const auto length = address.ToSockAddrStorage(&storage);
+	if (_sendBatch.empty() && !_flushScheduled && !_writeBlocked) {
+		// The first datagram in a loop turn goes right away, the ones
+		// following it in the same turn are batched.
+		return sendNow(data, size, storage, socklen_t(length), options);
+	}
+	const auto slot = _sendBatch.push(data, size, storage, socklen_t(length));
+	auto &outgoing = _outgoing[slot];
+	outgoing.packetId = options.packet_id;
+	outgoing.info = options.info_signaled_after_sent;
+	if (_sendBatch.full()) {
+		flush();
+	} else {
+		scheduleFlush();
+	}
+	return int(size);
+}
+
+int BatchedUdpSocket::sendNow(
+		const void *data,
+		size_t size,
+		const sockaddr_storage &address,
+		socklen_t addressLength,
+		const rtc::PacketOptions &options) {
+	auto sent = ssize_t(0);
+	do {
+		sent = ::sendto(
+			_descriptor,
+			data,
+			size,
+			0,
+			reinterpret_cast<const sockaddr*>(&address),
+			addressLength);
+	} while (sent < 0 && errno == EINTR);
+	if (sent < 0) {
+		_error = errno;
+		if (_error == EAGAIN || _error == EWOULDBLOCK) {
+			setWriteBlocked(true);
+		}
+		return -1;
+	}
+
+	// Marks the end of the loop turn for the datagrams following.
+	scheduleFlush();
+	SignalSentPacket(this, rtc::SentPacket(
+		options.packet_id,
+		rtc::TimeMillis(),
+		options.info_signaled_after_sent));
+	return int(size);
+}
+
+void BatchedUdpSocket::scheduleFlush() {
+	if (_flushScheduled) {
+		return;
+	}
+	_flushScheduled = true;
+	_thread->PostTask(RTC_FROM_HERE, [this, alive = std::weak_ptr<bool>(_alive)] {
+		if (alive.lock()) {
+			_flushScheduled = false;
+			flush();
+		}
+	});
+}
+
+void BatchedUdpSocket::flush() {
+	if (_sendBatch.empty() || _descriptor < 0 || _writeBlocked) {
+		return;
+	}
+	const auto result = _sendBatch.flush(_descriptor);
+	if (result.failedCount) {
+		RTC_LOG(LS_WARNING)
+			<< "Batched UDP send failed: " << result.lastError
+			<< ", datagrams: " << result.failedCount;
+	}
+	if (result.blocked) {
+		setWriteBlocked(true);
+	}
+	const auto now = rtc::TimeMillis();
+	rtc::SentPacket sentPackets[kUdpBatchSize];
+	for (auto i = 0; i != result.deliveredCount; ++i) {
+		const auto &outgoing = _outgoing[result.delivered[i]];
+		sentPackets[i] = rtc::SentPacket(outgoing.packetId, now, outgoing.info);
+	}
+
+	// Handlers may send more packets, so the batch is removed first.
+	if (!_sendBatch.empty() && !_writeBlocked) {
+		scheduleFlush();
+	}
+	for (auto i = 0; i != result.deliveredCount && _descriptor >= 0; ++i) {
+		SignalSentPacket(this, sentPackets[i]);
+	}
+}
+
+void BatchedUdpSocket::setWriteBlocked(bool blocked) {
+	if (_writeBlocked != blocked) {
+		_writeBlocked = blocked;
+		_server->Update(this);
+	}
+}
+
+void BatchedUdpSocket::readAll() {
+	for (auto batch = 0; batch != kMaxReadBatches && _descriptor >= 0; ++batch) {
+		const auto received = _receiveBatch.receive(_descriptor);
+		if (received <= 0) {
+			if (received < 0) {
+				RTC_LOG(LS_WARNING) << "Batched UDP receive failed: " << errno;
+			}
+			return;
+		}
+		const auto timestamp = rtc::TimeMicros();
+		for (auto i = 0; i != received && _descriptor >= 0; ++i) {
+			if (_receiveBatch.truncated(i)) {
+				continue;
+			}
+			auto from = rtc::SocketAddress();
+			rtc::SocketAddressFromSockAddrStorage(_receiveBatch.address(i), &from);
+			SignalReadPacket(
+				this,
+				reinterpret_cast<const char*>(_receiveBatch.data(i)),
+				_receiveBatch.size(i),
+				from,
+				timestamp);
+		}
+		if (received < kUdpBatchSize) {
+			return;
+		}
+	}
+}
+
+int BatchedUdpSocket::Close() {
+	if (_descriptor < 0) {
+		return 0;
+	}
+	// The owner may be going away, so queued packets are dropped
+	// rather than sent with signals nobody should receive.
+	_sendBatch.clear();
+	_server->Remove(this);
+	::close(_descriptor);
+	_descriptor = -1;
+	_alive = nullptr;
+	return 0;
+}
+
+rtc::AsyncPacketSocket::State BatchedUdpSocket::GetState() const {
+	return (_descriptor >= 0) ? STATE_BOUND : STATE_CLOSED;
+}
+
+bool BatchedUdpSocket::translateOption(rtc::Socket::Option option, int *level, int *name) const {
+	switch (option) {
+		case rtc::Socket::OPT_RCVBUF:
+			*level = SOL_SOCKET;
+			*name = SO_RCVBUF;
+			return true;
+		case rtc::Socket::OPT_SNDBUF:
+			*level = SOL_SOCKET;
+			*name = SO_SNDBUF;
+			return true;
+		case rtc::Socket::OPT_DSCP:
+			*level = (_localAddress.family() == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+			*name = (_localAddress.family() == AF_INET6) ? IPV6_TCLASS : IP_TOS;
+			return true;
+		case rtc::Socket::OPT_DONTFRAGMENT:
+			*level = (_localAddress.family() == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+			*name = (_localAddress.family() == AF_INET6) ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER;
+			return true;
+		default:
+			return false;
+	}
+}
+
+int BatchedUdpSocket::GetOption(rtc::Socket::Option option, int *value) {
+	auto level = 0;
+	auto name = 0;
+	if (!translateOption(option, &level, &name)) {
+		return -1;
+	}
+	auto length = socklen_t(sizeof(*value));
+	const auto result = ::getsockopt(_descriptor, level, name, value, &length);
+	if (result == 0) {
+		if (option == rtc::Socket::OPT_DSCP) {
+			*value >>= 2;
+		} else if (option == rtc::Socket::OPT_DONTFRAGMENT) {
+			*value = (*value != IP_PMTUDISC_DONT) ? 1 : 0;
+		}
+	}
+	return result;
+}
+
+int BatchedUdpSocket::SetOption(rtc::Socket::Option option, int value) {
+	auto level = 0;
+	auto name = 0;
+	if (!translateOption(option, &level, &name)) {
+		return -1;
+	}
+	if (option == rtc::Socket::OPT_DSCP) {
+		value <<= 2;
+	} else if (option == rtc::Socket::OPT_DONTFRAGMENT) {
+		value = value ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+	}
+	return ::setsockopt(_descriptor, level, name, &value, sizeof(value));
+}
+
+int BatchedUdpSocket::GetError() const {
+	return _error;
+}
+
+void BatchedUdpSocket::SetError(int error) {
+	_error = error;
+}
+
+uint32_t BatchedUdpSocket::GetRequestedEvents() {
+	return rtc::DE_READ | (_writeBlocked ? rtc::DE_WRITE : 0);
+}
+
+void BatchedUdpSocket::OnPreEvent(uint32_t events) {
+}
+
+void BatchedUdpSocket::OnEvent(uint32_t events, int error) {
+	if (events & rtc::DE_READ) {
+		readAll();
+	}
+	if ((events & rtc::DE_WRITE) && _descriptor >= 0) {
+		setWriteBlocked(false);
+		flush();
+		if (!_writeBlocked && _descriptor >= 0) {
+			SignalReadyToSend(this);
+		}
+	}
+}
+
+int BatchedUdpSocket::GetDescriptor() {
+	return _descriptor;
+}
+
+bool BatchedUdpSocket::IsDescriptorClosed() {
+	return false;
+}
+
+} // namespace
+
+BatchedPacketSocketFactory::BatchedPacketSocketFactory(
+	rtc::Thread *thread,
+	rtc::PhysicalSocketServer *server) :
+rtc::BasicPacketSocketFactory(thread),
+_thread(thread),
+_server(server) {
+}
+
+rtc::AsyncPacketSocket *BatchedPacketSocketFactory::CreateUdpSocket(
+		const rtc::SocketAddress &address,
+		uint16_t minPort,
+		uint16_t maxPort) {
+	if (_server) {
+		const auto result = BatchedUdpSocket::Create(_thread, _server, address, minPort, maxPort);
+		if (result) {
+			return result;
+		}
+	}
+	return rtc::BasicPacketSocketFactory::CreateUdpSocket(address, minPort, maxPort);
+}
+
+} // namespace tgcalls
+
+#else // WEBRTC_LINUX
+
+namespace tgcalls {
+
+BatchedPacketSocketFactory::BatchedPacketSocketFactory(
+	rtc::Thread *thread,
+	rtc::PhysicalSocketServer *server) :
+rtc::BasicPacketSocketFactory(thread),
+_thread(thread),
+_server(server) {
+}
+
+rtc::AsyncPacketSocket *BatchedPacketSocketFactory::CreateUdpSocket(
+		const rtc::SocketAddress &address,
+		uint16_t minPort,
+		uint16_t maxPort) {
+	return rtc::BasicPacketSocketFactory::CreateUdpSocket(address, minPort, maxPort);
+}
+
+} // namespace tgcalls
+
+#endif // WEBRTC_LINUX
@@ -0,0 +1,36 @@
+#ifndef TGCALLS_BATCHED_PACKET_SOCKET_FACTORY_H
+#define TGCALLS_BATCHED_PACKET_SOCKET_FACTORY_H
+
+#include "p2p/base/basic_packet_socket_factory.h"
+
+namespace rtc {
+class Thread;
+class PhysicalSocketServer;
+} // namespace rtc
+
+namespace tgcalls {
+
+// On Linux UDP sockets read with recvmmsg. The first datagram of a
+// thread loop turn is sent right away, the rest queued during the turn
+// go with a single sendmmsg, segmented by the kernel where it can.
+// The sockets are added to the socket server of the thread, which has
+// to be passed here. Elsewhere, without it, or if that fails, the basic
+// WebRTC sockets are used.
+class BatchedPacketSocketFactory final : public rtc::BasicPacketSocketFactory {
+public:
+	BatchedPacketSocketFactory(rtc::Thread *thread, rtc::PhysicalSocketServer *server);
+
+	rtc::AsyncPacketSocket *CreateUdpSocket(
+		const rtc::SocketAddress &address,
+		uint16_t minPort,
+		uint16_t maxPort) override;
+
+private:
+	rtc::Thread *_thread = nullptr;
+	rtc::PhysicalSocketServer *_server = nullptr;
+
+};
+
+} // namespace tgcalls
+
+#endif
@@ -1,6 +1,72 @@
 #include "CryptoHelper.h"
 
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <memory>
+
 namespace tgcalls {
+namespace {
+
+struct CipherContextDeleter {
+	void operator()(EVP_CIPHER_CTX *context) const {
+		EVP_CIPHER_CTX_free(context);
+	}
+};
+
+EVP_CIPHER_CTX *ThreadCipherContext() {
+	thread_local const auto context = std::unique_ptr<
+		EVP_CIPHER_CTX,
+		CipherContextDeleter>(EVP_CIPHER_CTX_new());
+	return context.get();
+}
+
+} // namespace
+
+// EVP picks AES-NI / ARMv8 CE kernels at runtime and pipelines
+// several counter blocks at once.
+bool AesProcessCtrEvp(MemorySpan from, void *to, const AesKeyIv &aesKeyIv) {
+	const auto context = ThreadCipherContext();
+	if (!context || from.size > size_t(INT_MAX)) {
+		return false;
+	} else if (!EVP_EncryptInit_ex(
+			context,
+			EVP_aes_256_ctr(),
+			nullptr,
+			aesKeyIv.key.data(),
+			aesKeyIv.iv.data())) {
+		return false;
+	}
+	auto written = 0;
+	const auto success = EVP_EncryptUpdate(
+		context,
+		reinterpret_cast<unsigned char*>(to),
+		&written,
+		reinterpret_cast<const unsigned char*>(from.data),
+		int(from.size));
+	return success && (written == int(from.size));
+}
+
+void AesProcessCtrLegacy(MemorySpan from, void *to, AesKeyIv &&aesKeyIv) {
+	auto aes = AES_KEY();
+	AES_set_encrypt_key(
+		reinterpret_cast<const unsigned char*>(aesKeyIv.key.data()),
+		aesKeyIv.key.size() * CHAR_BIT,
+		&aes);
+
+	unsigned char ecountBuf[16] = { 0 };
+	unsigned int offsetInBlock = 0;
+
+	CRYPTO_ctr128_encrypt(
+		reinterpret_cast<const unsigned char*>(from.data),
+		reinterpret_cast<unsigned char*>(to),
+		from.size,
+		&aes,
+		reinterpret_cast<unsigned char*>(aesKeyIv.iv.data()),
+		ecountBuf,
+		&offsetInBlock,
+		block128_f(AES_encrypt));
+}
 
 AesKeyIv PrepareAesKeyIv(const uint8_t *key, const uint8_t *msgKey, int x) {
 	auto result = AesKeyIv();
@@ -23,25 +89,115 @@ AesKeyIv PrepareAesKeyIv(const uint8_t *key, const uint8_t *msgKey, int x) {
 	return result;
 }
 
-void AesProcessCtr(MemorySpan from, void *to, AesKeyIv &&aesKeyIv) {
-	auto aes = AES_KEY();
-	AES_set_encrypt_key(
-		reinterpret_cast<const unsigned char*>(aesKeyIv.key.data()),
-		aesKeyIv.key.size() * CHAR_BIT,
-		&aes);
+bool AesProcessCtr(MemorySpan from, void *to, AesKeyIv &&aesKeyIv) {
+	if (AesProcessCtrEvp(from, to, aesKeyIv)) {
+		return true;
+	} else if (from.data == to) {
+		// 'to' may be partly written, in place the input is gone.
+		return false;
+	}
+	AesProcessCtrLegacy(from, to, std::move(aesKeyIv));
+	return true;
+}
 
-	unsigned char ecountBuf[16] = { 0 };
-	unsigned int offsetInBlock = 0;
+AesGcmKeyNonce PrepareAesGcmKeyNonce(const uint8_t *key, int x) {
+	auto result = AesGcmKeyNonce();
 
-	CRYPTO_ctr128_encrypt(
-		reinterpret_cast<const unsigned char*>(from.data),
-		reinterpret_cast<unsigned char*>(to),
-		from.size,
-		&aes,
-		reinterpret_cast<unsigned char*>(aesKeyIv.iv.data()),
-		ecountBuf,
-		&offsetInBlock,
-		block128_f(AES_encrypt));
+	static const char kKeyLabel[] = "tgcalls aes-gcm key";
+	static const char kNonceLabel[] = "tgcalls aes-gcm nonce";
+	const auto sha256key = ConcatSHA256(
+		MemorySpan{ kKeyLabel, sizeof(kKeyLabel) - 1 },
+		MemorySpan{ key + x, 120 });
+	const auto sha256nonce = ConcatSHA256(
+		MemorySpan{ kNonceLabel, sizeof(kNonceLabel) - 1 },
+		MemorySpan{ key + x, 120 });
+	memcpy(result.key.data(), sha256key.data(), result.key.size());
+	memcpy(result.nonce.data(), sha256nonce.data(), result.nonce.size());
+
+	return result;
+}
+
+AesGcmContext::AesGcmContext(const AesGcmKeyNonce &keyNonce, bool encrypt) :
+_context(EVP_CIPHER_CTX_new()),
+_nonce(keyNonce.nonce),
+_encrypt(encrypt) {
+	const auto success = _context && EVP_CipherInit_ex(
+		_context,
+		EVP_aes_256_gcm(),
+		nullptr,
+		keyNonce.key.data(),
+		nullptr,
+		_encrypt ? 1 : 0);
+	if (!success) {
+		EVP_CIPHER_CTX_free(_context);
+		_context = nullptr;
+	}
+}
+
+AesGcmContext::~AesGcmContext() {
+	EVP_CIPHER_CTX_free(_context);
+}
+
+bool AesGcmContext::start(uint32_t seq, MemorySpan aad) {
+	if (!_context || aad.size > size_t(INT_MAX)) {
+		return false;
+	}
+	auto nonce = _nonce;
+	const auto tail = nonce.data() + kAesGcmNonceSize - sizeof(seq);
+	tail[0] ^= uint8_t(seq >> 24);
+	tail[1] ^= uint8_t(seq >> 16);
+	tail[2] ^= uint8_t(seq >> 8);
+	tail[3] ^= uint8_t(seq);
+
+	// Only the nonce changes, the key schedule is kept.
+	auto written = 0;
+	return EVP_CipherInit_ex(_context, nullptr, nullptr, nullptr, nonce.data(), _encrypt ? 1 : 0)
+		&& EVP_CipherUpdate(
+			_context,
+			nullptr,
+			&written,
+			reinterpret_cast<const unsigned char*>(aad.data),
+			int(aad.size));
+}
+
+bool AesGcmContext::encrypt(uint32_t seq, MemorySpan aad, MemorySpan from, void *to, void *tag) {
+	assert(_encrypt);
+
+	if (from.size > size_t(INT_MAX) || !start(seq, aad)) {
+		return false;
+	}
+	auto written = 0;
+	auto finalized = 0;
+	const auto out = reinterpret_cast<unsigned char*>(to);
+	return EVP_EncryptUpdate(
+			_context,
+			out,
+			&written,
+			reinterpret_cast<const unsigned char*>(from.data),
+			int(from.size))
+		&& EVP_EncryptFinal_ex(_context, out + written, &finalized)
+		&& (written + finalized == int(from.size))
+		&& EVP_CIPHER_CTX_ctrl(_context, EVP_CTRL_GCM_GET_TAG, int(kAesGcmTagSize), tag);
+}
+
+bool AesGcmContext::decrypt(uint32_t seq, MemorySpan aad, MemorySpan from, void *to, const void *tag) {
+	assert(!_encrypt);
+
+	if (from.size > size_t(INT_MAX) || !start(seq, aad)) {
+		return false;
+	}
+	auto written = 0;
+	auto finalized = 0;
+	const auto out = reinterpret_cast<unsigned char*>(to);
+	return EVP_DecryptUpdate(
+			_context,
+			out,
+			&written,
+			reinterpret_cast<const unsigned char*>(from.data),
+			int(from.size))
+		&& EVP_CIPHER_CTX_ctrl(_context, EVP_CTRL_GCM_SET_TAG, int(kAesGcmTagSize), const_cast<void*>(tag))
+		&& (EVP_DecryptFinal_ex(_context, out + written, &finalized) > 0)
+		&& (written + finalized == int(from.size));
 }
 
 } // namespace tgcalls
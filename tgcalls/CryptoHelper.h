@@ -5,11 +5,16 @@ extern "C" {
 #include <openssl/sha.h>
 #include <openssl/aes.h>
 #include <openssl/modes.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/crypto.h>
 } // extern "C"
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
 
 namespace tgcalls {
 
@@ -59,7 +64,48 @@ inline std::array<uint8_t, kSha256Size> ConcatSHA256(Parts &&... parts) {
 }
 
 AesKeyIv PrepareAesKeyIv(const uint8_t *key, const uint8_t *msgKey, int x);
-void AesProcessCtr(MemorySpan from, void *to, AesKeyIv &&aesKeyIv);
+
+// Returns false only if it failed in place, the data is lost then.
+bool AesProcessCtr(MemorySpan from, void *to, AesKeyIv &&aesKeyIv);
+
+// The two ways AesProcessCtr may take, exposed to compare them in tests.
+// If the first fails, 'to' may be partly written.
+bool AesProcessCtrEvp(MemorySpan from, void *to, const AesKeyIv &aesKeyIv);
+void AesProcessCtrLegacy(MemorySpan from, void *to, AesKeyIv &&aesKeyIv);
+
+constexpr auto kAesGcmNonceSize = size_t(12);
+constexpr auto kAesGcmTagSize = size_t(16);
+
+struct AesGcmKeyNonce {
+	std::array<uint8_t, 32> key;
+
+	// Per-packet nonce is this one with the packet seq xored in.
+	std::array<uint8_t, kAesGcmNonceSize> nonce;
+};
+
+// Session key for one direction, derived once from the shared key.
+AesGcmKeyNonce PrepareAesGcmKeyNonce(const uint8_t *key, int x);
+
+class AesGcmContext final {
+public:
+	AesGcmContext(const AesGcmKeyNonce &keyNonce, bool encrypt);
+	~AesGcmContext();
+
+	AesGcmContext(const AesGcmContext &other) = delete;
+	AesGcmContext &operator=(const AesGcmContext &other) = delete;
+
+	// Both may work in place, 'tag' has kAesGcmTagSize bytes.
+	bool encrypt(uint32_t seq, MemorySpan aad, MemorySpan from, void *to, void *tag);
+	bool decrypt(uint32_t seq, MemorySpan aad, MemorySpan from, void *to, const void *tag);
+
+private:
+	bool start(uint32_t seq, MemorySpan aad);
+
+	EVP_CIPHER_CTX *_context = nullptr;
+	std::array<uint8_t, kAesGcmNonceSize> _nonce;
+	bool _encrypt = false;
+
+};
 
 } // namespace tgcalls
 
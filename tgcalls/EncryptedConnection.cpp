@@ -1,6 +1,8 @@
 #include "EncryptedConnection.h"
 
 #include "CryptoHelper.h"
+#include "Trace.h"
+#include "TransportCounters.h"
 #include "rtc_base/logging.h"
 #include "rtc_base/byte_buffer.h"
 #include "rtc_base/time_utils.h"
@@ -8,8 +10,6 @@
 namespace tgcalls {
 namespace {
 
-constexpr auto kSingleMessagePacketSeqBit = (uint32_t(1) << 31);
-constexpr auto kMessageRequiresAckSeqBit = (uint32_t(1) << 30);
 constexpr auto kMaxAllowedCounter = std::numeric_limits<uint32_t>::max()
 	& ~kSingleMessagePacketSeqBit
 	& ~kMessageRequiresAckSeqBit;
@@ -17,10 +17,28 @@ constexpr auto kMaxAllowedCounter = std::numeric_limits<uint32_t>::max()
 static_assert(kMaxAllowedCounter < kSingleMessagePacketSeqBit, "bad");
 static_assert(kMaxAllowedCounter < kMessageRequiresAckSeqBit, "bad");
 
+constexpr auto kMsgKeySize = 16;
+constexpr auto kMinLegacyPacketSize = kMsgKeySize + 5;
+
+// Session key packets: marker, seq in clear (both authenticated),
+// encrypted rest of the messages, GCM tag.
+constexpr auto kAeadPacketMarker = uint8_t(0xAE);
+constexpr auto kAeadHeaderSize = 1;
+constexpr auto kMinAeadPacketSize = kAeadHeaderSize + 5 + kAesGcmTagSize;
+
+// Most we add around a single data message payload: encryption,
+// seq, type and length.
+constexpr auto kMaxPacketOverhead = std::max(
+	size_t(kMsgKeySize),
+	size_t(kAeadHeaderSize + kAesGcmTagSize)) + 4 + 1 + 2;
 constexpr auto kAckSerializedSize = sizeof(uint32_t) + sizeof(uint8_t);
+
+// Ack ranges record: base seq, type, bitmap length, bitmap where bit i
+// (LSB first) acks counter base + 1 + i.
+constexpr auto kAckRangesHeaderSize = kAckSerializedSize + sizeof(uint8_t);
+constexpr auto kMaxAckRangesBitmapSize = size_t(255);
 constexpr auto kNotAckedMessagesLimit = 64 * 1024;
 constexpr auto kMaxIncomingPacketSize = 128 * 1024; // don't try decrypting more
-constexpr auto kKeepIncomingCountersCount = 64;
 constexpr auto kMaxFullPacketSize = 1500; // IP_PACKET_SIZE from webrtc.
 
 // Max seen turn_overhead is around 36.
@@ -28,21 +46,22 @@ constexpr auto kMaxOuterPacketSize = kMaxFullPacketSize - 48;
 
 constexpr auto kMaxSignalingPacketSize = 16 * 1024;
 
+// RFC 6298 constants.
+constexpr auto kRttClockGranularity = int64_t(10);
+constexpr auto kMaxRtoBackoff = 16;
+
 constexpr auto kServiceCauseAcks = 1;
 constexpr auto kServiceCauseResend = 2;
 
 static constexpr uint8_t kAckId = uint8_t(-1);
 static constexpr uint8_t kEmptyId = uint8_t(-2);
+static constexpr uint8_t kAckRangesId = uint8_t(-3);
 
 void AppendSeq(rtc::CopyOnWriteBuffer &buffer, uint32_t seq) {
 	const auto bytes = rtc::HostToNetwork32(seq);
 	buffer.AppendData(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
 }
 
-void WriteSeq(void *bytes, uint32_t seq) {
-	*reinterpret_cast<uint32_t*>(bytes) = rtc::HostToNetwork32(seq);
-}
-
 uint32_t ReadSeq(const void *bytes) {
 	return rtc::NetworkToHost32(*reinterpret_cast<const uint32_t*>(bytes));
 }
@@ -67,8 +86,46 @@ EncryptedConnection::EncryptedConnection(
 _type(type),
 _key(key),
 _delayIntervals(DelayIntervalsByType(type)),
+_delayBounds(DelayBoundsByType(type)),
+_maxPacketSize(kMaxOuterPacketSize),
 _requestSendService(std::move(requestSendService)) {
 	assert(_key.value != nullptr);
+
+	if (_type == Type::Transport) {
+		// We always accept session key packets, we advertise this capability.
+		const auto x = (_key.isOutgoing ? 8 : 0);
+		_aeadDecrypt = std::make_unique<AesGcmContext>(
+			PrepareAesGcmKeyNonce(_key.value->data(), x),
+			false);
+	}
+}
+
+EncryptedConnection::~EncryptedConnection() = default;
+
+void EncryptedConnection::setPeerCapabilities(uint32_t capabilities) {
+	if (capabilities & kCapabilityTransportAead) {
+		enableAead();
+	}
+	_ackRangesEnabled = (capabilities & kCapabilityAckRanges) != 0;
+}
+
+void EncryptedConnection::setCounters(std::shared_ptr<TransportCounters> counters) {
+	_counters = std::move(counters);
+}
+
+void EncryptedConnection::setTrace(std::shared_ptr<TraceRecorder> trace) {
+	_trace = std::move(trace);
+}
+
+void EncryptedConnection::enableAead() {
+	if (_type != Type::Transport || _aeadEnabled) {
+		return;
+	}
+	const auto x = (_key.isOutgoing ? 0 : 8);
+	_aeadEncrypt = std::make_unique<AesGcmContext>(
+		PrepareAesGcmKeyNonce(_key.value->data(), x),
+		true);
+	_aeadEnabled = true;
 }
 
 auto EncryptedConnection::prepareForSending(const Message &message)
@@ -85,17 +142,22 @@ auto EncryptedConnection::prepareForSending(const Message &message)
 		return absl::nullopt;
 	}
 	const auto seq = *maybeSeq;
-	auto serialized = SerializeMessageWithSeq(message, seq, singleMessagePacket);
-	if (!enoughSpaceInPacket(serialized, 0)) {
-		return LogError("Too large packet: ", std::to_string(serialized.size()));
+	auto packet = preparePacketBuffer();
+	SerializeMessageWithSeq(packet, message, seq, singleMessagePacket);
+
+	// Resends put an empty message with its own seq in front.
+	const auto resendOverhead = messageRequiresAck ? kAckSerializedSize : 0;
+	if (!enoughSpaceInPacket(packet, resendOverhead)) {
+		return LogError("Too large packet: ", std::to_string(packet.size()));
 	}
-	const auto notYetAckedCopy = messageRequiresAck
-		? serialized
-		: rtc::CopyOnWriteBuffer();
 	if (!messageRequiresAck) {
-		appendAdditionalMessages(serialized);
-		return encryptPrepared(serialized);
+		appendAdditionalMessages(packet);
+		return encryptPrepared(std::move(packet));
 	}
+	const auto headroom = packetHeadroom();
+	auto serialized = rtc::CopyOnWriteBuffer(
+		packet.cdata() + headroom,
+		packet.size() - headroom);
 	const auto type = uint8_t(serialized.cdata()[4]);
 	const auto sendEnqueued = !_myNotYetAckedMessages.empty();
 	if (sendEnqueued) {
@@ -103,20 +165,28 @@ auto EncryptedConnection::prepareForSending(const Message &message)
 		// one packet, starting with the least not-yet-acked one.
 		// So if we still have those, we send an empty message with all
 		// requiring ack messages that will fit in correct order.
-		RTC_LOG(LS_INFO) << logHeader()
-			<< "Enqueue SEND:type" << type << "#" << CounterFromSeq(seq);
+		trace(TraceEvent::SendEnqueue, type, CounterFromSeq(seq));
 	} else {
-		RTC_LOG(LS_INFO) << logHeader()
-			<< "Add SEND:type" << type << "#" << CounterFromSeq(seq);
-		appendAdditionalMessages(serialized);
+		trace(TraceEvent::SendAdd, type, CounterFromSeq(seq));
+		appendAdditionalMessages(packet);
 	}
-	_myNotYetAckedMessages.push_back({ notYetAckedCopy, rtc::TimeMillis() });
+	auto resend = MessageForResend();
+	resend.counter = CounterFromSeq(seq);
+	resend.data = std::move(serialized);
+	resend.packetLimit = packetLimit();
 	if (!sendEnqueued) {
-		return encryptPrepared(serialized);
+		markSent(resend, rtc::TimeMillis());
 	}
-	for (auto &queued : _myNotYetAckedMessages) {
-		queued.lastSent = 0;
+	_myNotYetAckedLength += resend.data.size();
+	++_myNotYetAckedCount;
+	_myNotYetAckedMessages.push_back(std::move(resend));
+	notAckedChanged();
+	if (!sendEnqueued) {
+		return encryptPrepared(std::move(packet));
 	}
+
+	// Mark all queued messages as never sent.
+	++_resendResetGeneration;
 	return prepareForSendingService(0);
 }
 
@@ -126,6 +196,10 @@ auto EncryptedConnection::prepareForSendingService(int cause)
 		_sendAcksTimerActive = false;
 	} else if (cause == kServiceCauseResend) {
 		_resendTimerActive = false;
+		if (_myNotYetAckedCount > 0) {
+			// Resend timer fired before we got acks.
+			backoffDelayIntervals();
+		}
 	}
 	if (!haveAdditionalMessages()) {
 		return absl::nullopt;
@@ -136,14 +210,86 @@ auto EncryptedConnection::prepareForSendingService(int cause)
 	if (!seq) {
 		return absl::nullopt;
 	}
-	auto serialized = SerializeEmptyMessageWithSeq(*seq);
-	assert(enoughSpaceInPacket(serialized, 0));
+	auto packet = preparePacketBuffer();
+	AppendEmptyMessageWithSeq(packet, *seq);
+	assert(enoughSpaceInPacket(packet, 0));
+
+	trace(TraceEvent::SendEmpty, kEmptyId, CounterFromSeq(*seq));
+
+	appendAdditionalMessages(packet);
+	return encryptPrepared(std::move(packet));
+}
+
+auto EncryptedConnection::prepareForSendingBundle(std::vector<Message> &messages)
+-> absl::optional<EncryptedPacket> {
+	assert(!messages.empty());
+
+	auto packet = preparePacketBuffer();
+	auto taken = size_t(0);
+	for (const auto &message : messages) {
+		assert(!absl::visit([](const auto &data) {
+			return std::decay_t<decltype(data)>::kRequiresAck;
+		}, message.data));
+
+		const auto seq = computeNextSeq(false, false);
+		if (!seq) {
+			break;
+		}
+		const auto was = packet.size();
+		SerializeMessageWithSeq(packet, message, *seq, false);
+		if (!enoughSpaceInPacket(packet, 0)) {
+			packet.SetSize(was);
+			--_counter;
+			break;
+		}
+		++taken;
+	}
+	if (!taken) {
+		// Drop it, so that the caller doesn't try the same again.
+		messages.erase(messages.begin());
+		return LogError("Too large bundled message.");
+	}
+	messages.erase(messages.begin(), messages.begin() + taken);
+	appendAdditionalMessages(packet);
+	return encryptPrepared(std::move(packet));
+}
+
+auto EncryptedConnection::prepareForSendingMtuProbe(uint16_t size)
+-> absl::optional<EncryptedPacket> {
+	assert(_type == Type::Transport);
+
+	const auto seq = computeNextSeq(false, true);
+	if (!seq) {
+		return absl::nullopt;
+	}
+	auto probe = PathMtuProbeMessage();
+	probe.size = size;
+
+	auto packet = rtc::CopyOnWriteBuffer(packetHeadroom(), size);
+	SerializeMessageWithSeq(packet, Message{ probe }, *seq, true);
+	const auto used = packet.size() + packetTailroom();
+	if (used > size) {
+		return LogError("Too small path MTU probe: ", std::to_string(size));
+	}
+	const auto serialized = packet.size();
+	packet.SetSize(size - packetTailroom());
+	memset(packet.data() + serialized, 0, packet.size() - serialized);
+	return encryptPrepared(std::move(packet));
+}
+
+void EncryptedConnection::setMaxPacketSize(size_t size) {
+	assert(_type == Type::Transport);
+	assert(size > kMaxPacketOverhead);
 
-	RTC_LOG(LS_INFO) << logHeader()
-		<< "SEND:empty#" << CounterFromSeq(*seq);
+	_maxPacketSize = size;
+}
 
-	appendAdditionalMessages(serialized);
-	return encryptPrepared(serialized);
+size_t EncryptedConnection::maxDataPayloadSize() const {
+	return packetLimit() - kMaxPacketOverhead;
+}
+
+size_t EncryptedConnection::MaxPacketOverhead() {
+	return kMaxPacketOverhead;
 }
 
 bool EncryptedConnection::haveAdditionalMessages() const {
@@ -153,7 +299,7 @@ bool EncryptedConnection::haveAdditionalMessages() const {
 absl::optional<uint32_t> EncryptedConnection::computeNextSeq(
 		bool messageRequiresAck,
 		bool singleMessagePacket) {
-	if (messageRequiresAck && _myNotYetAckedMessages.size() >= kNotAckedMessagesLimit) {
+	if (messageRequiresAck && _myNotYetAckedCount >= kNotAckedMessagesLimit) {
 		return LogError("Too many not ACKed messages.");
 	} else if (_counter == kMaxAllowedCounter) {
 		return LogError("Outgoing packet limit reached.");
@@ -169,46 +315,147 @@ size_t EncryptedConnection::packetLimit() const {
         case Type::Signaling:
             return kMaxSignalingPacketSize;
         default:
-            return kMaxOuterPacketSize;
+            return _maxPacketSize;
     }
 }
 
 bool EncryptedConnection::enoughSpaceInPacket(const rtc::CopyOnWriteBuffer &buffer, size_t amount) const {
-	const auto limit = packetLimit();
+	return enoughSpaceInPacket(buffer, amount, packetLimit());
+}
+
+bool EncryptedConnection::enoughSpaceInPacket(
+		const rtc::CopyOnWriteBuffer &buffer,
+		size_t amount,
+		size_t limit) const {
+	// The buffer already holds the headroom in front.
 	return (amount < limit)
-		&& (16 + buffer.size() + amount <= limit);
+		&& (buffer.size() + amount + packetTailroom() <= limit);
+}
+
+size_t EncryptedConnection::packetHeadroom() const {
+	return _aeadEnabled ? kAeadHeaderSize : kMsgKeySize;
+}
+
+size_t EncryptedConnection::packetTailroom() const {
+	return _aeadEnabled ? kAesGcmTagSize : 0;
+}
+
+rtc::CopyOnWriteBuffer EncryptedConnection::preparePacketBuffer() const {
+	// Reserve the whole packet once, with header headroom in front,
+	// so that the packet is assembled and encrypted in place.
+	return rtc::CopyOnWriteBuffer(packetHeadroom(), packetLimit());
 }
 
 void EncryptedConnection::appendAcksToSend(rtc::CopyOnWriteBuffer &buffer) {
+	if (_ackRangesEnabled) {
+		appendAckRangesToSend(buffer);
+		return;
+	}
 	auto i = _acksToSendSeqs.begin();
 	while ((i != _acksToSendSeqs.end())
 		&& enoughSpaceInPacket(
 			buffer,
 			kAckSerializedSize)) {
 
-		RTC_LOG(LS_INFO) << logHeader()
-			<< "Add ACK#" << CounterFromSeq(*i);
-
+		trace(TraceEvent::AckAdd, kAckId, CounterFromSeq(*i));
 		AppendSeq(buffer, *i);
 		buffer.AppendData(&kAckId, 1);
 		++i;
 	}
 	_acksToSendSeqs.erase(_acksToSendSeqs.begin(), i);
-	for (const auto seq : _acksToSendSeqs) {
-		RTC_LOG(LS_INFO) << logHeader()
-			<< "Skip ACK#" << CounterFromSeq(seq)
-			<< " (no space, length: " << kAckSerializedSize << ", already: " << buffer.size() << ")";
+	if (!_acksToSendSeqs.empty()) {
+		trace(
+			TraceEvent::AckSkip,
+			kAckId,
+			CounterFromSeq(_acksToSendSeqs.front()),
+			uint32_t(_acksToSendSeqs.size()));
+	}
+}
+
+void EncryptedConnection::appendAckRangesToSend(rtc::CopyOnWriteBuffer &buffer) {
+	// Acks to send are sorted by counter, see sendAckPostponed.
+	auto &list = _acksToSendSeqs;
+	auto i = list.begin();
+	while ((i != list.end())
+		&& enoughSpaceInPacket(buffer, kAckRangesHeaderSize)) {
+		const auto available = packetLimit()
+			- packetTailroom()
+			- buffer.size()
+			- kAckRangesHeaderSize;
+		const auto maxBitmapSize = std::min(available, kMaxAckRangesBitmapSize);
+
+		uint8_t bitmap[kMaxAckRangesBitmapSize] = { 0 };
+		auto bitmapSize = size_t(0);
+		const auto base = CounterFromSeq(*i);
+		auto j = i + 1;
+		for (; j != list.end(); ++j) {
+			const auto offset = CounterFromSeq(*j) - base - 1;
+			if (offset >= maxBitmapSize * 8) {
+				break;
+			}
+			bitmap[offset / 8] |= uint8_t(1) << (offset % 8);
+			bitmapSize = offset / 8 + 1;
+		}
+
+		trace(TraceEvent::AckAdd, kAckRangesId, base, uint32_t(j - i - 1));
+		const auto length = uint8_t(bitmapSize);
+		AppendSeq(buffer, *i);
+		buffer.AppendData(&kAckRangesId, 1);
+		buffer.AppendData(&length, 1);
+		buffer.AppendData(bitmap, bitmapSize);
+		i = j;
+	}
+	list.erase(list.begin(), i);
+	if (!list.empty()) {
+		trace(
+			TraceEvent::AckSkip,
+			kAckRangesId,
+			CounterFromSeq(list.front()),
+			uint32_t(list.size()));
 	}
 }
 
+bool EncryptedConnection::handleAckRanges(uint32_t baseSeq, rtc::ByteBufferReader &reader) {
+	auto length = uint8_t();
+	uint8_t bitmap[kMaxAckRangesBitmapSize] = { 0 };
+	if (!reader.ReadUInt8(&length)
+		|| !reader.ReadBytes(reinterpret_cast<char*>(bitmap), length)) {
+		return false;
+	}
+	ackMyMessage(baseSeq);
+
+	// Only messages requiring ack are acked, so their seq is known.
+	const auto base = CounterFromSeq(baseSeq);
+	for (auto offset = uint32_t(0); offset != uint32_t(length) * 8; ++offset) {
+		if (bitmap[offset / 8] & (uint8_t(1) << (offset % 8))) {
+			const auto counter = base + 1 + offset;
+			if (counter > kMaxAllowedCounter) {
+				return false;
+			}
+			ackMyMessage(counter | kMessageRequiresAckSeqBit);
+		}
+	}
+	return true;
+}
+
 size_t EncryptedConnection::fullNotAckedLength() const {
-	assert(_myNotYetAckedMessages.size() < kNotAckedMessagesLimit);
+	assert(_myNotYetAckedCount < kNotAckedMessagesLimit);
 
-	auto result = size_t();
-	for (const auto &message : _myNotYetAckedMessages) {
-		result += message.data.size();
+	return _myNotYetAckedLength;
+}
+
+void EncryptedConnection::markSent(MessageForResend &message, int64_t now) {
+	if (!message.sentCount++) {
+		message.firstSent = now;
 	}
-	return result;
+	message.lastSent = now;
+	message.resetGeneration = _resendResetGeneration;
+}
+
+int64_t EncryptedConnection::lastSentTime(const MessageForResend &message) const {
+	return (message.resetGeneration == _resendResetGeneration)
+		? message.lastSent
+		: 0;
 }
 
 void EncryptedConnection::appendAdditionalMessages(rtc::CopyOnWriteBuffer &buffer) {
@@ -219,30 +466,51 @@ void EncryptedConnection::appendAdditionalMessages(rtc::CopyOnWriteBuffer &buffe
 	}
 
 	const auto now = rtc::TimeMillis();
-	auto someWereNotAdded = false;
+	auto someWereAdded = false;
 	for (auto &resending : _myNotYetAckedMessages) {
-		const auto sent = resending.lastSent;
+		if (resending.acked) {
+			continue;
+		}
+		const auto sent = lastSentTime(resending);
 		const auto when = sent
 			? (sent + _delayIntervals.minDelayBeforeMessageResend)
 			: 0;
 
 		assert(resending.data.size() >= 5);
-		const auto counter = CounterFromSeq(ReadSeq(resending.data.data()));
+		const auto counter = resending.counter;
 		const auto type = uint8_t(resending.data.data()[4]);
 		if (when > now) {
-			RTC_LOG(LS_INFO) << logHeader()
-				<< "Skip RESEND:type" << type << "#" << counter
-				<< " (wait " << (when - now) << "ms).";
+			trace(TraceEvent::ResendWait, type, counter, uint32_t(when - now));
 			break;
-		} else if (enoughSpaceInPacket(buffer, resending.data.size())) {
-			RTC_LOG(LS_INFO) << logHeader()
-				<< "Add RESEND:type" << type << "#" << counter;
+		}
+		const auto fits = enoughSpaceInPacket(buffer, resending.data.size());
+
+		// Queued before the packet limit went down, so it would never
+		// fit again. It goes alone in a packet of the size it was
+		// queued for, so that reliable delivery is kept.
+		const auto oversize = !fits
+			&& !someWereAdded
+			&& resending.packetLimit > packetLimit()
+			&& enoughSpaceInPacket(buffer, resending.data.size(), resending.packetLimit);
+		if (fits || oversize) {
+			trace(TraceEvent::ResendAdd, type, counter);
+			if (_counters && resending.sentCount > 0) {
+				_counters->messageResent();
+			}
 			buffer.AppendData(resending.data);
-			resending.lastSent = now;
+			markSent(resending, now);
+			someWereAdded = true;
+			if (oversize) {
+				RTC_LOG(LS_WARNING)
+					<< logHeader()
+					<< "Resending message above the packet limit: "
+					<< int(type)
+					<< ", size: "
+					<< resending.data.size();
+				break;
+			}
 		} else {
-			RTC_LOG(LS_INFO) << logHeader()
-				<< "Skip RESEND:type" << type << "#" << counter
-				<< " (no space, length: " << resending.data.size() << ", already: " << buffer.size() << ")";
+			trace(TraceEvent::ResendNoSpace, type, counter, uint32_t(resending.data.size()));
 			break;
 		}
 	}
@@ -254,93 +522,206 @@ void EncryptedConnection::appendAdditionalMessages(rtc::CopyOnWriteBuffer &buffe
 	}
 }
 
-auto EncryptedConnection::encryptPrepared(const rtc::CopyOnWriteBuffer &buffer)
--> EncryptedPacket {
+auto EncryptedConnection::encryptPrepared(rtc::CopyOnWriteBuffer &&buffer)
+-> absl::optional<EncryptedPacket> {
+	if (_aeadEnabled) {
+		assert(buffer.size() >= kAeadHeaderSize + 5);
+
+		const auto header = buffer.data();
+		const auto data = header + kAeadHeaderSize + 4;
+		const auto dataSize = buffer.size() - kAeadHeaderSize - 4;
+		const auto seq = ReadSeq(header + kAeadHeaderSize);
+		header[0] = kAeadPacketMarker;
+
+		uint8_t tag[kAesGcmTagSize] = { 0 };
+		const auto success = _aeadEncrypt->encrypt(
+			seq,
+			MemorySpan{ header, kAeadHeaderSize + 4 },
+			MemorySpan{ data, dataSize },
+			data,
+			tag);
+		if (success) {
+			// Fits in capacity, enoughSpaceInPacket accounts for the tag.
+			buffer.AppendData(tag, kAesGcmTagSize);
+
+			auto result = EncryptedPacket();
+			result.counter = CounterFromSeq(seq);
+			result.bytes = std::move(buffer);
+			return result;
+		}
+		// The buffer was partly encrypted in place, drop the packet.
+		// Messages requiring ack keep their own copy for the resend.
+		return LogError("AES-GCM encryption failed.");
+	}
+	assert(buffer.size() >= kMsgKeySize + 5);
+
+	const auto msgKey = buffer.data();
+	const auto data = msgKey + kMsgKeySize;
+	const auto dataSize = buffer.size() - kMsgKeySize;
+
 	auto result = EncryptedPacket();
-	result.counter = CounterFromSeq(ReadSeq(buffer.data()));
-	result.bytes.resize(16 + buffer.size());
+	result.counter = CounterFromSeq(ReadSeq(data));
 
 	const auto x = (_key.isOutgoing ? 0 : 8) + (_type == Type::Signaling ? 128 : 0);
 	const auto key = _key.value->data();
 
 	const auto msgKeyLarge = ConcatSHA256(
 		MemorySpan{ key + 88 + x, 32 },
-		MemorySpan{ buffer.data(), buffer.size() });
-	const auto msgKey = result.bytes.data();
-	memcpy(msgKey, msgKeyLarge.data() + 8, 16);
+		MemorySpan{ data, dataSize });
+	memcpy(msgKey, msgKeyLarge.data() + 8, kMsgKeySize);
 
 	auto aesKeyIv = PrepareAesKeyIv(key, msgKey, x);
 
-	AesProcessCtr(
-		MemorySpan{ buffer.data(), buffer.size() },
-		result.bytes.data() + 16,
+	const auto success = AesProcessCtr(
+		MemorySpan{ data, dataSize },
+		data,
 		std::move(aesKeyIv));
-
+	if (!success) {
+		// Same as with AES-GCM, the packet is dropped.
+		return LogError("AES-CTR encryption failed.");
+	}
+	result.bytes = std::move(buffer);
 	return result;
 }
 
 bool EncryptedConnection::registerIncomingCounter(uint32_t incomingCounter) {
-	auto &list = _largestIncomingCounters;
+	return _incomingCounters.registerCounter(incomingCounter);
+}
 
-	const auto position = std::lower_bound(list.begin(), list.end(), incomingCounter);
-	const auto largest = list.empty() ? 0 : list.back();
-	if (position != list.end() && *position == incomingCounter) {
-		// The packet is in the list already.
-		return false;
-	} else if (incomingCounter + kKeepIncomingCountersCount <= largest) {
+bool IncomingCountersWindow::registerCounter(uint32_t counter) {
+	static_assert(kSize > 0 && kSize % 64 == 0, "Bad window size.");
+
+	if (counter > _largest) {
+		// Clear the blocks we move the window over, at most all of them.
+		const auto largestBlock = _largest / 64;
+		const auto clear = std::min(counter / 64 - largestBlock, uint32_t(kBlocks));
+		for (auto i = uint32_t(1); i <= clear; ++i) {
+			_blocks[(largestBlock + i) % kBlocks] = 0;
+		}
+		_largest = counter;
+	} else if (uint64_t(counter) + kSize <= _largest) {
 		// The packet is too old.
 		return false;
 	}
-	const auto eraseTill = std::find_if(list.begin(), list.end(), [&](uint32_t counter) {
-		return (counter + kKeepIncomingCountersCount > incomingCounter);
-	});
-	const auto eraseCount = eraseTill - list.begin();
-	const auto positionIndex = (position - list.begin()) - eraseCount;
-	list.erase(list.begin(), eraseTill);
-
-	assert(positionIndex >= 0 && positionIndex <= list.size());
-	list.insert(list.begin() + positionIndex, incomingCounter);
+	auto &block = _blocks[(counter / 64) % kBlocks];
+	const auto bit = uint64_t(1) << (counter % 64);
+	if (block & bit) {
+		// The packet is in the window already.
+		return false;
+	}
+	block |= bit;
 	return true;
 }
 
 auto EncryptedConnection::handleIncomingPacket(const char *bytes, size_t size)
 -> absl::optional<DecryptedPacket> {
-	if (size < 21 || size > kMaxIncomingPacketSize) {
+	if (size > kMaxIncomingPacketSize) {
+		return LogError("Bad incoming packet size: ", std::to_string(size));
+	}
+
+	// A legacy packet may start with the marker byte by chance,
+	// so if the tag doesn't match we try it the legacy way as well.
+	const auto maybeAead = _aeadDecrypt
+		&& (size >= kMinAeadPacketSize)
+		&& (uint8_t(bytes[0]) == kAeadPacketMarker);
+	auto decrypted = maybeAead
+		? decryptAead(bytes, size)
+		: absl::nullopt;
+	if (!decrypted) {
+		decrypted = decryptLegacy(bytes, size);
+		if (!decrypted) {
+			if (_counters) {
+				_counters->packetRejected();
+			}
+			return absl::nullopt;
+		}
+	}
+
+	const auto incomingSeq = ReadSeq(decrypted->cdata());
+	const auto incomingCounter = CounterFromSeq(incomingSeq);
+	if (!registerIncomingCounter(incomingCounter)) {
+		if (_counters) {
+			_counters->packetRepeated();
+		}
+		// We've received that packet already.
+		return LogError("Already handled packet received.", std::to_string(incomingCounter));
+	}
+	return processPacket(*decrypted, incomingSeq);
+}
+
+rtc::CopyOnWriteBuffer &EncryptedConnection::acquireReceiveBuffer(size_t size) {
+	auto &result = _receiveBuffers[_receiveBufferIndex];
+	_receiveBufferIndex = (_receiveBufferIndex + 1) % _receiveBuffers.size();
+
+	// Growing from zero size keeps the memory if nothing else references
+	// it and gets a fresh buffer otherwise, without copying the old data.
+	// The caller writes through this reference, the only one held.
+	result.SetSize(0);
+	result.EnsureCapacity(std::max(size, size_t(kMaxFullPacketSize)));
+	result.SetSize(size);
+	return result;
+}
+
+auto EncryptedConnection::decryptAead(const char *bytes, size_t size)
+-> absl::optional<rtc::CopyOnWriteBuffer> {
+	assert(size >= kMinAeadPacketSize);
+
+	const auto header = reinterpret_cast<const uint8_t*>(bytes);
+	const auto seq = ReadSeq(header + kAeadHeaderSize);
+	const auto encryptedData = header + kAeadHeaderSize + 4;
+	const auto dataSize = size - kAeadHeaderSize - 4 - kAesGcmTagSize;
+
+	// Keep the seq in front, as in legacy packets.
+	auto &decryptionBuffer = acquireReceiveBuffer(4 + dataSize);
+	memcpy(decryptionBuffer.data(), header + kAeadHeaderSize, 4);
+	const auto success = _aeadDecrypt->decrypt(
+		seq,
+		MemorySpan{ header, kAeadHeaderSize + 4 },
+		MemorySpan{ encryptedData, dataSize },
+		decryptionBuffer.data() + 4,
+		encryptedData + dataSize);
+	if (!success) {
+		return absl::nullopt;
+	}
+	return decryptionBuffer;
+}
+
+auto EncryptedConnection::decryptLegacy(const char *bytes, size_t size)
+-> absl::optional<rtc::CopyOnWriteBuffer> {
+	if (size < kMinLegacyPacketSize) {
 		return LogError("Bad incoming packet size: ", std::to_string(size));
 	}
 
 	const auto x = (_key.isOutgoing ? 8 : 0) + (_type == Type::Signaling ? 128 : 0);
 	const auto key = _key.value->data();
 	const auto msgKey = reinterpret_cast<const uint8_t*>(bytes);
-	const auto encryptedData = msgKey + 16;
-	const auto dataSize = size - 16;
+	const auto encryptedData = msgKey + kMsgKeySize;
+	const auto dataSize = size - kMsgKeySize;
 
 	auto aesKeyIv = PrepareAesKeyIv(key, msgKey, x);
 
-	auto decryptionBuffer = rtc::Buffer(dataSize);
-	AesProcessCtr(
+	// Decrypt into a ref-counted buffer, so that message payloads
+	// can be passed further as slices of it.
+	auto &decryptionBuffer = acquireReceiveBuffer(dataSize);
+	const auto success = AesProcessCtr(
 		MemorySpan{ encryptedData, dataSize },
 		decryptionBuffer.data(),
 		std::move(aesKeyIv));
+	if (!success) {
+		return LogError("AES-CTR decryption failed.");
+	}
 
 	const auto msgKeyLarge = ConcatSHA256(
 		MemorySpan{ key + 88 + x, 32 },
-		MemorySpan{ decryptionBuffer.data(), decryptionBuffer.size() });
-	if (memcmp(msgKeyLarge.data() + 8, msgKey, 16)) {
+		MemorySpan{ decryptionBuffer.cdata(), decryptionBuffer.size() });
+	if (memcmp(msgKeyLarge.data() + 8, msgKey, kMsgKeySize)) {
 		return LogError("Bad incoming data hash.");
 	}
-
-	const auto incomingSeq = ReadSeq(decryptionBuffer.data());
-	const auto incomingCounter = CounterFromSeq(incomingSeq);
-	if (!registerIncomingCounter(incomingCounter)) {
-		// We've received that packet already.
-		return LogError("Already handled packet received.", std::to_string(incomingCounter));
-	}
-	return processPacket(decryptionBuffer, incomingSeq);
+	return decryptionBuffer;
 }
 
 auto EncryptedConnection::processPacket(
-	const rtc::Buffer &fullBuffer,
+	const rtc::CopyOnWriteBuffer &fullBuffer,
 	uint32_t packetSeq)
 -> absl::optional<DecryptedPacket> {
 	assert(fullBuffer.size() >= 5);
@@ -352,7 +733,7 @@ auto EncryptedConnection::processPacket(
 	auto currentSeq = packetSeq;
 	auto currentCounter = CounterFromSeq(currentSeq);
 	rtc::ByteBufferReader reader(
-		reinterpret_cast<const char*>(fullBuffer.data() + 4), // Skip seq.
+		fullBuffer.cdata<char>() + 4, // Skip seq.
 		fullBuffer.size() - 4);
 
 	auto result = absl::optional<DecryptedPacket>();
@@ -364,13 +745,17 @@ auto EncryptedConnection::processPacket(
 		}
 
 		if (type == kEmptyId) {
-			RTC_LOG(LS_INFO) << logHeader()
-				<< "Got RECV:empty" << "#" << currentCounter;
+			trace(TraceEvent::ReceiveEmpty, kEmptyId, currentCounter);
 			reader.Consume(1);
 		} else if (type == kAckId) {
 			ackMyMessage(currentSeq);
 			reader.Consume(1);
-		} else if (auto message = DeserializeMessage(reader, singleMessagePacket)) {
+		} else if (type == kAckRangesId) {
+			reader.Consume(1);
+			if (!handleAckRanges(currentSeq, reader)) {
+				return LogError("Bad ack ranges record.");
+			}
+		} else if (auto message = DeserializeMessage(reader, singleMessagePacket, &fullBuffer)) {
 			const auto messageRequiresAck = ((currentSeq & kMessageRequiresAckSeqBit) != 0);
 			const auto skipMessage = messageRequiresAck
 				? !registerSentAck(currentCounter, firstMessageRequiringAck)
@@ -381,11 +766,15 @@ auto EncryptedConnection::processPacket(
 					newRequiringAckReceived = true;
 				}
 				sendAckPostponed(currentSeq);
-				RTC_LOG(LS_INFO) << logHeader()
-					<< (skipMessage ? "Repeated RECV:type" : "Got RECV:type") << type << "#" << currentCounter;
+				trace(
+					skipMessage ? TraceEvent::ReceiveRepeated : TraceEvent::Receive,
+					type,
+					currentCounter);
 			}
 			if (!skipMessage) {
 				appendReceivedMessage(result, std::move(*message), currentSeq);
+			} else if (_counters) {
+				_counters->messageRepeated();
 			}
 		} else {
 			return LogError("Could not parse message from packet, type: ", std::to_string(type));
@@ -433,6 +822,24 @@ void EncryptedConnection::appendReceivedMessage(
 	}
 }
 
+void EncryptedConnection::notAckedChanged() {
+	if (_counters) {
+		_counters->setNotAcked(
+			int(_myNotYetAckedCount),
+			int(_myNotYetAckedLength));
+	}
+}
+
+void EncryptedConnection::trace(
+		TraceEvent event,
+		uint8_t type,
+		uint32_t counter,
+		uint32_t value) const {
+	if (_trace) {
+		_trace->add(event, (_type == Type::Transport), type, counter, value);
+	}
+}
+
 const char *EncryptedConnection::logHeader() const {
 	return (_type == Type::Signaling) ? "(signaling) " : "(transport) ";
 }
@@ -443,7 +850,6 @@ bool EncryptedConnection::registerSentAck(uint32_t counter, bool firstInPacket)
 	const auto position = std::lower_bound(list.begin(), list.end(), counter);
 	const auto already = (position != list.end()) && (*position == counter);
 
-	const auto was = list;
 	if (firstInPacket) {
 		list.erase(list.begin(), position);
 		if (!already) {
@@ -456,27 +862,107 @@ bool EncryptedConnection::registerSentAck(uint32_t counter, bool firstInPacket)
 }
 
 void EncryptedConnection::sendAckPostponed(uint32_t incomingSeq) {
+	// Kept sorted by counter, usually we just append.
 	auto &list = _acksToSendSeqs;
-	const auto already = std::find(list.begin(), list.end(), incomingSeq);
-	if (already == list.end()) {
-		list.push_back(incomingSeq);
+	const auto counter = CounterFromSeq(incomingSeq);
+	const auto position = std::lower_bound(list.begin(), list.end(), counter, [](uint32_t seq, uint32_t counter) {
+		return CounterFromSeq(seq) < counter;
+	});
+	if (position == list.end() || CounterFromSeq(*position) != counter) {
+		list.insert(position, incomingSeq);
 	}
 }
 
 void EncryptedConnection::ackMyMessage(uint32_t seq) {
 	auto type = uint8_t(0);
 	auto &list = _myNotYetAckedMessages;
-	for (auto i = list.begin(), e = list.end(); i != e; ++i) {
+	const auto counter = CounterFromSeq(seq);
+	const auto i = std::lower_bound(list.begin(), list.end(), counter, [](const MessageForResend &message, uint32_t counter) {
+		return message.counter < counter;
+	});
+	if (i != list.end() && i->counter == counter && !i->acked) {
 		assert(i->data.size() >= 5);
 		if (ReadSeq(i->data.cdata()) == seq) {
 			type = uint8_t(i->data.cdata()[4]);
-			list.erase(i);
-			break;
+			if (i->sentCount == 1) {
+				addRttSample(rtc::TimeMillis() - i->firstSent);
+			}
+			forgetMyMessage(*i);
+			while (!list.empty() && list.front().acked) {
+				list.pop_front();
+			}
+			notAckedChanged();
 		}
 	}
-	RTC_LOG(LS_INFO) << logHeader()
-		<< (type ? "Got ACK:type" + std::to_string(type) + "#" : "Repeated ACK#")
-		<< CounterFromSeq(seq);
+	trace(
+		type ? TraceEvent::AckReceived : TraceEvent::AckRepeated,
+		type,
+		CounterFromSeq(seq));
+}
+
+void EncryptedConnection::forgetMyMessage(MessageForResend &message) {
+	_myNotYetAckedLength -= message.data.size();
+	--_myNotYetAckedCount;
+	message.acked = true;
+	message.data = rtc::CopyOnWriteBuffer();
+}
+
+absl::optional<int> EncryptedConnection::rttEstimate() const {
+	return _hasRttSample
+		? absl::make_optional(int(_smoothedRtt))
+		: absl::nullopt;
+}
+
+void EncryptedConnection::addRttSample(int64_t rtt) {
+	rtt = std::max(rtt, int64_t(0));
+	if (!_hasRttSample) {
+		_hasRttSample = true;
+		_smoothedRtt = rtt;
+		_rttVariation = rtt / 2;
+	} else {
+		// RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R.
+		const auto delta = (_smoothedRtt > rtt)
+			? (_smoothedRtt - rtt)
+			: (rtt - _smoothedRtt);
+		_rttVariation = (3 * _rttVariation + delta) / 4;
+		_smoothedRtt = (7 * _smoothedRtt + rtt) / 8;
+	}
+	_rtoBackoff = 1;
+	updateDelayIntervals();
+	if (_counters) {
+		_counters->setRtt(int(_smoothedRtt));
+	}
+}
+
+void EncryptedConnection::backoffDelayIntervals() {
+	if (_rtoBackoff >= kMaxRtoBackoff) {
+		return;
+	}
+	_rtoBackoff *= 2;
+	updateDelayIntervals();
+}
+
+void EncryptedConnection::updateDelayIntervals() {
+	const auto clamp = [&](int64_t value) {
+		return int(std::min(
+			std::max(value, int64_t(_delayBounds.minDelay)),
+			int64_t(_delayBounds.maxDelay)));
+	};
+	const auto defaults = DelayIntervalsByType(_type);
+	const auto rto = _hasRttSample
+		? (_smoothedRtt + std::max(kRttClockGranularity, 4 * _rttVariation))
+		: int64_t(defaults.maxDelayBeforeMessageResend);
+
+	// Attach resends to other packets once the ack is late.
+	const auto lateAck = _hasRttSample
+		? (_smoothedRtt + 2 * _rttVariation)
+		: int64_t(defaults.minDelayBeforeMessageResend);
+
+	_delayIntervals.maxDelayBeforeMessageResend = clamp(rto * _rtoBackoff);
+	_delayIntervals.maxDelayBeforeAckResend = clamp(rto * _rtoBackoff);
+	_delayIntervals.minDelayBeforeMessageResend = std::min(
+		clamp(lateAck * _rtoBackoff),
+		_delayIntervals.maxDelayBeforeMessageResend);
 }
 
 auto EncryptedConnection::DelayIntervalsByType(Type type) -> DelayIntervals {
@@ -493,12 +979,20 @@ auto EncryptedConnection::DelayIntervalsByType(Type type) -> DelayIntervals {
 	return result;
 }
 
-rtc::CopyOnWriteBuffer EncryptedConnection::SerializeEmptyMessageWithSeq(uint32_t seq) {
-	auto result = rtc::CopyOnWriteBuffer(5);
-	const auto bytes = result.data();
-	WriteSeq(bytes, seq);
-	bytes[4] = kEmptyId;
+auto EncryptedConnection::DelayBoundsByType(Type type) -> DelayBounds {
+	auto result = DelayBounds();
+	const auto signaling = (type == Type::Signaling);
+
+	// Signaling goes through the server, so don't trust it to be fast.
+	result.minDelay = signaling ? 500 : 40;
+	result.maxDelay = signaling ? 15000 : 3000;
+
 	return result;
 }
 
+void EncryptedConnection::AppendEmptyMessageWithSeq(rtc::CopyOnWriteBuffer &buffer, uint32_t seq) {
+	AppendSeq(buffer, seq);
+	buffer.AppendData(&kEmptyId, 1);
+}
+
 } // namespace tgcalls
@@ -4,12 +4,42 @@
 #include "Instance.h"
 #include "Message.h"
 
+#include "absl/container/inlined_vector.h"
+
+#include <array>
+#include <deque>
+
 namespace rtc {
 class ByteBufferReader;
 } // namespace rtc
 
 namespace tgcalls {
 
+class AesGcmContext;
+class TransportCounters;
+class TraceRecorder;
+enum class TraceEvent : uint8_t;
+
+// Flags in the high bits of each message seq, the rest is the counter.
+constexpr auto kSingleMessagePacketSeqBit = (uint32_t(1) << 31);
+constexpr auto kMessageRequiresAckSeqBit = (uint32_t(1) << 30);
+
+// Anti-replay bitmap over the last kSize counters, as in RFC 6479.
+class IncomingCountersWindow final {
+public:
+	// Should be a multiple of 64.
+	static constexpr uint32_t kSize = 64;
+	static constexpr uint32_t kBlocks = kSize / 64 + 1;
+
+	// False if the counter was registered already or is too old.
+	bool registerCounter(uint32_t counter);
+
+private:
+	std::array<uint64_t, kBlocks> _blocks = { { 0 } };
+	uint32_t _largest = 0;
+
+};
+
 class EncryptedConnection final {
 public:
 	enum class Type : uint8_t {
@@ -20,20 +50,50 @@ public:
 		Type type,
 		const EncryptionKey &key,
 		std::function<void(int delayMs, int cause)> requestSendService);
+	~EncryptedConnection();
+
+	// Enables optional packet formats the peer has advertised.
+	void setPeerCapabilities(uint32_t capabilities);
+
+	// Statistics to update, may be shared with other threads.
+	void setCounters(std::shared_ptr<TransportCounters> counters);
+
+	// Hot path events of the call, shared with its other connection.
+	void setTrace(std::shared_ptr<TraceRecorder> trace);
 
 	struct EncryptedPacket {
-		std::vector<uint8_t> bytes;
+		rtc::CopyOnWriteBuffer bytes;
 		uint32_t counter = 0;
 	};
 	absl::optional<EncryptedPacket> prepareForSending(const Message &message);
 	absl::optional<EncryptedPacket> prepareForSendingService(int cause);
 
+	// Packs messages not requiring ack in one packet, as many as fit,
+	// and removes them from the front of the list.
+	absl::optional<EncryptedPacket> prepareForSendingBundle(std::vector<Message> &messages);
+
+	// Single message packet padded to exactly 'size' bytes.
+	absl::optional<EncryptedPacket> prepareForSendingMtuProbe(uint16_t size);
+
+	// Transport packets limit, follows the discovered path MTU.
+	void setMaxPacketSize(size_t size);
+
+	// Largest data message payload that fits in one packet.
+	size_t maxDataPayloadSize() const;
+
+	// Most bytes a packet adds around a single data message payload.
+	static size_t MaxPacketOverhead();
+
 	struct DecryptedPacket {
 		DecryptedMessage main;
-		std::vector<DecryptedMessage> additional;
+		absl::InlinedVector<DecryptedMessage, 3> additional;
 	};
 	absl::optional<DecryptedPacket> handleIncomingPacket(const char *bytes, size_t size);
 
+	// Smoothed round trip time in milliseconds, measured on
+	// messages requiring ack, nullopt until the first sample.
+	absl::optional<int> rttEstimate() const;
+
 private:
 	struct DelayIntervals {
 		// In milliseconds.
@@ -41,21 +101,59 @@ private:
 		int maxDelayBeforeMessageResend = 0;
 		int maxDelayBeforeAckResend = 0;
 	};
+	struct DelayBounds {
+		// In milliseconds, RTT-derived intervals are clamped to those.
+		int minDelay = 0;
+		int maxDelay = 0;
+	};
 	struct MessageForResend {
 		rtc::CopyOnWriteBuffer data;
+		uint32_t counter = 0;
 		int64_t lastSent = 0;
+
+		// lastSent counts only if it was set after the last resend reset.
+		uint32_t resetGeneration = 0;
+
+		// RTT is sampled only from messages sent exactly once (Karn).
+		int64_t firstSent = 0;
+		int sentCount = 0;
+
+		// The limit it was queued under, it always fits alone in that.
+		size_t packetLimit = 0;
+
+		// Acked messages are left in place until they reach the front.
+		bool acked = false;
 	};
 
 	bool enoughSpaceInPacket(const rtc::CopyOnWriteBuffer &buffer, size_t amount) const;
+	bool enoughSpaceInPacket(
+		const rtc::CopyOnWriteBuffer &buffer,
+		size_t amount,
+		size_t limit) const;
 	size_t packetLimit() const;
 	size_t fullNotAckedLength() const;
 	void appendAcksToSend(rtc::CopyOnWriteBuffer &buffer);
+	void appendAckRangesToSend(rtc::CopyOnWriteBuffer &buffer);
+	bool handleAckRanges(uint32_t baseSeq, rtc::ByteBufferReader &reader);
+	void enableAead();
 	void appendAdditionalMessages(rtc::CopyOnWriteBuffer &buffer);
-	EncryptedPacket encryptPrepared(const rtc::CopyOnWriteBuffer &buffer);
+	size_t packetHeadroom() const;
+	size_t packetTailroom() const;
+	rtc::CopyOnWriteBuffer preparePacketBuffer() const;
+	absl::optional<EncryptedPacket> encryptPrepared(rtc::CopyOnWriteBuffer &&buffer);
+	rtc::CopyOnWriteBuffer &acquireReceiveBuffer(size_t size);
+	absl::optional<rtc::CopyOnWriteBuffer> decryptLegacy(const char *bytes, size_t size);
+	absl::optional<rtc::CopyOnWriteBuffer> decryptAead(const char *bytes, size_t size);
 	bool registerIncomingCounter(uint32_t incomingCounter);
-	absl::optional<DecryptedPacket> processPacket(const rtc::Buffer &fullBuffer, uint32_t packetSeq);
+	absl::optional<DecryptedPacket> processPacket(const rtc::CopyOnWriteBuffer &fullBuffer, uint32_t packetSeq);
 	bool registerSentAck(uint32_t counter, bool firstInPacket);
 	void ackMyMessage(uint32_t counter);
+	void forgetMyMessage(MessageForResend &message);
+	int64_t lastSentTime(const MessageForResend &message) const;
+	void markSent(MessageForResend &message, int64_t now);
+	void addRttSample(int64_t rtt);
+	void backoffDelayIntervals();
+	void updateDelayIntervals();
 	void sendAckPostponed(uint32_t incomingSeq);
 	bool haveAdditionalMessages() const;
 	absl::optional<uint32_t> computeNextSeq(bool messageRequiresAck, bool singleMessagePacket);
@@ -64,23 +162,50 @@ private:
 		Message &&message,
 		uint32_t incomingSeq);
 
+	void notAckedChanged();
+	void trace(
+		TraceEvent event,
+		uint8_t type,
+		uint32_t counter,
+		uint32_t value = 0) const;
 	const char *logHeader() const;
 
 	static DelayIntervals DelayIntervalsByType(Type type);
-	static rtc::CopyOnWriteBuffer SerializeEmptyMessageWithSeq(uint32_t seq);
+	static DelayBounds DelayBoundsByType(Type type);
+	static void AppendEmptyMessageWithSeq(rtc::CopyOnWriteBuffer &buffer, uint32_t seq);
 
 	Type _type = Type();
 	EncryptionKey _key;
 	uint32_t _counter = 0;
 	DelayIntervals _delayIntervals;
-	std::vector<uint32_t> _largestIncomingCounters;
+	DelayBounds _delayBounds;
+	size_t _maxPacketSize = 0;
+	int64_t _smoothedRtt = 0;
+	int64_t _rttVariation = 0;
+	bool _hasRttSample = false;
+	int _rtoBackoff = 1;
+	IncomingCountersWindow _incomingCounters;
 	std::vector<uint32_t> _ackedIncomingCounters;
 	std::vector<uint32_t> _acksToSendSeqs;
 	std::vector<uint32_t> _acksSentCounters;
-	std::vector<MessageForResend> _myNotYetAckedMessages;
+	std::deque<MessageForResend> _myNotYetAckedMessages;
+	size_t _myNotYetAckedCount = 0;
+	size_t _myNotYetAckedLength = 0;
+	uint32_t _resendResetGeneration = 0;
 	std::function<void(int delayMs, int cause)> _requestSendService;
+	std::unique_ptr<AesGcmContext> _aeadEncrypt;
+	std::unique_ptr<AesGcmContext> _aeadDecrypt;
+	bool _aeadEnabled = false;
+	bool _ackRangesEnabled = false;
 	bool _resendTimerActive = false;
 	bool _sendAcksTimerActive = false;
+	std::shared_ptr<TransportCounters> _counters;
+	std::shared_ptr<TraceRecorder> _trace;
+
+	// Decrypted packets are reused once all message payloads
+	// sliced from them are released.
+	std::array<rtc::CopyOnWriteBuffer, 16> _receiveBuffers;
+	size_t _receiveBufferIndex = 0;
 
 };
 
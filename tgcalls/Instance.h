@@ -83,6 +83,7 @@ struct PersistentState {
 struct Config {
 	double initializationTimeout = 0.;
 	double receiveTimeout = 0.;
+	double candidatesCoalesceTimeout = 0.05;
 	DataSaving dataSaving = DataSaving::Never;
 	bool enableP2P = false;
 	bool enableAEC = false;
@@ -95,6 +96,8 @@ struct Config {
 #else
 	std::wstring logPath;
 #endif
+	// Most recent log kept for FinalState::debugLog when logPath is empty.
+	size_t logMemoryLimit = 4 * 1024 * 1024;
 	int maxApiLayer = 0;
 };
 
@@ -235,6 +238,11 @@ bool Meta::RegisterOne() {
 
 void SetLoggingFunction(std::function<void(std::string const &)> loggingFunction);
 
+// Calls are spread over 'count' sets of manager, network and media
+// threads, optionally with each network thread pinned to a CPU core.
+// Must be called before the first call or video capture is created.
+void SetThreadShardsCount(int count, bool pinToCores = false);
+
 } // namespace tgcalls
 
 #endif
@@ -2,6 +2,9 @@
 
 #include "LogSinkImpl.h"
 #include "Manager.h"
+#include "ThreadShards.h"
+#include "Trace.h"
+#include "TransportCounters.h"
 #include "MediaManager.h"
 #include "VideoCaptureInterfaceImpl.h"
 #include "VideoCapturerInterface.h"
@@ -9,23 +12,24 @@
 namespace tgcalls {
 namespace {
 
-rtc::Thread *makeManagerThread() {
-	static std::unique_ptr<rtc::Thread> value = rtc::Thread::Create();
-	value->SetName("WebRTC-Manager", nullptr);
-	value->Start();
-	return value.get();
-}
-
-
-rtc::Thread *getManagerThread() {
-	static rtc::Thread *value = makeManagerThread();
-	return value;
+bool IsMobileNetwork(NetworkType type) {
+	switch (type) {
+		case NetworkType::WiFi:
+		case NetworkType::Ethernet:
+		case NetworkType::OtherHighSpeed:
+			return false;
+		default:
+			return true;
+	}
 }
 
 } // namespace
 
 InstanceImpl::InstanceImpl(Descriptor &&descriptor)
-: _logSink(std::make_unique<LogSinkImpl>(descriptor.config)) {
+: _logSink(std::make_unique<LogSinkImpl>(descriptor.config))
+, _trace(std::make_shared<TraceRecorder>())
+, _counters(std::make_shared<TransportCounters>())
+, _threads(AcquireThreadShard()) {
 	static const auto onceToken = [] {
 		rtc::LogMessage::LogToDebug(rtc::LS_INFO);
 		rtc::LogMessage::SetLogToStderr(true);
@@ -33,16 +37,20 @@ InstanceImpl::InstanceImpl(Descriptor &&descriptor)
 	}();
 	rtc::LogMessage::AddLogToStream(_logSink.get(), rtc::LS_INFO);
 
-	_manager.reset(new ThreadLocalObject<Manager>(getManagerThread(), [descriptor = std::move(descriptor)]() mutable {
-		return new Manager(getManagerThread(), std::move(descriptor));
+	const auto isMobileNetwork = IsMobileNetwork(descriptor.initialNetworkType);
+	_counters->setNetworkIsMobile(isMobileNetwork);
+	_manager.reset(new ThreadLocalObject<Manager>(_threads.manager, [threads = _threads, descriptor = std::move(descriptor), counters = _counters, trace = _trace]() mutable {
+		return new Manager(threads, std::move(descriptor), counters, trace);
 	}));
-	_manager->perform([](Manager *manager) {
+	_manager->perform([isMobileNetwork](Manager *manager) {
 		manager->start();
+		manager->setIsMobileNetwork(isMobileNetwork);
 	});
 }
 
 InstanceImpl::~InstanceImpl() {
 	rtc::LogMessage::RemoveLogToStream(_logSink.get());
+	ReleaseThreadShard(_threads);
 }
 
 void InstanceImpl::receiveSignalingData(const std::vector<uint8_t> &data) {
@@ -58,6 +66,12 @@ void InstanceImpl::requestVideo(std::shared_ptr<VideoCaptureInterface> videoCapt
 }
 
 void InstanceImpl::setNetworkType(NetworkType networkType) {
+	const auto isMobileNetwork = IsMobileNetwork(networkType);
+	_counters->setNetworkIsMobile(isMobileNetwork);
+	_manager->perform([isMobileNetwork](Manager *manager) {
+		manager->setIsMobileNetwork(isMobileNetwork);
+	});
+
 	/*message::NetworkType mappedType;
 
 	switch (networkType) {
@@ -148,7 +162,7 @@ std::string InstanceImpl::getLastError() {
 }
 
 std::string InstanceImpl::getDebugInfo() {
-	return "";  // TODO: not implemented
+	return _counters->debugInfo();
 }
 
 int64_t InstanceImpl::getPreferredRelayId() {
@@ -156,7 +170,7 @@ int64_t InstanceImpl::getPreferredRelayId() {
 }
 
 TrafficStats InstanceImpl::getTrafficStats() {
-	return TrafficStats{};  // TODO: not implemented
+	return _counters->trafficStats();
 }
 
 PersistentState InstanceImpl::getPersistentState() {
@@ -164,8 +178,15 @@ PersistentState InstanceImpl::getPersistentState() {
 }
 
 FinalState InstanceImpl::stop() {
+	// Hot path events are kept in binary form until now.
+	const auto trace = _trace->toString();
+	if (!trace.empty()) {
+		_logSink->OnLogMessage(trace);
+	}
+
 	FinalState finalState;
 	finalState.debugLog = _logSink->result();
+	finalState.trafficStats = _counters->trafficStats();
 	finalState.isRatingSuggested = false;
 
 	return finalState;
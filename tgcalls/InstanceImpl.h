@@ -2,10 +2,13 @@
 #define TGCALLS_INSTANCE_IMPL_H
 
 #include "Instance.h"
+#include "ThreadShards.h"
 
 namespace tgcalls {
 
 class LogSinkImpl;
+class TransportCounters;
+class TraceRecorder;
 
 class Manager;
 template <typename T>
@@ -42,6 +45,9 @@ public:
 private:
 	std::unique_ptr<ThreadLocalObject<Manager>> _manager;
 	std::unique_ptr<LogSinkImpl> _logSink;
+	std::shared_ptr<TraceRecorder> _trace;
+	std::shared_ptr<TransportCounters> _counters;
+	ThreadShard _threads;
 
 };
 
@@ -2,19 +2,88 @@
 
 #include "Instance.h"
 
-#ifdef WEBRTC_WIN
-#include "windows.h"
+#include <algorithm>
+#include <condition_variable>
 #include <ctime>
-#elif defined(WEBRTC_IOS) || defined(WEBRTC_MAC)
-#include <sys/time.h>
-#endif //WEBRTC_IOS || WEBRTC_MAC
+#include <sstream>
+#include <thread>
+#include <vector>
 
 namespace tgcalls {
 
-LogSinkImpl::LogSinkImpl(const Config &config) {
+// Sleeps until a message is pushed to an empty queue of some sink.
+class LogSinkImpl::Writer final {
+public:
+	static Writer &Get() {
+		// Never destroyed, so that sinks may outlive static destructors.
+		static const auto result = new Writer();
+		return *result;
+	}
+
+	void add(LogSinkImpl *sink) {
+		std::lock_guard<std::mutex> lock(_sinksMutex);
+		_sinks.push_back(sink);
+	}
+
+	// Returns after the writer has finished with the sink.
+	void remove(LogSinkImpl *sink) {
+		std::lock_guard<std::mutex> lock(_sinksMutex);
+		_sinks.erase(std::remove(_sinks.begin(), _sinks.end(), sink), _sinks.end());
+	}
+
+	void wake() {
+		{
+			std::lock_guard<std::mutex> lock(_wakeMutex);
+			_pending = true;
+		}
+		_wake.notify_one();
+	}
+
+private:
+	Writer() {
+		std::thread([this] {
+			loop();
+		}).detach();
+	}
+
+	void loop() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(_wakeMutex);
+				_wake.wait(lock, [&] {
+					return _pending;
+				});
+				_pending = false;
+			}
+			std::lock_guard<std::mutex> lock(_sinksMutex);
+			for (const auto sink : _sinks) {
+				std::lock_guard<std::mutex> consumerLock(sink->_consumerMutex);
+				sink->drain();
+			}
+		}
+	}
+
+	std::mutex _sinksMutex;
+	std::vector<LogSinkImpl*> _sinks;
+	std::mutex _wakeMutex;
+	std::condition_variable _wake;
+	bool _pending = false;
+
+};
+
+LogSinkImpl::LogSinkImpl(const Config &config)
+: _dataLimit(config.logMemoryLimit) {
 	if (!config.logPath.empty()) {
 		_file.open(config.logPath);
 	}
+	Writer::Get().add(this);
+}
+
+LogSinkImpl::~LogSinkImpl() {
+	Writer::Get().remove(this);
+
+	std::lock_guard<std::mutex> lock(_consumerMutex);
+	drain();
 }
 
 void LogSinkImpl::OnLogMessage(const std::string &msg, rtc::LoggingSeverity severity, const char *tag) {
@@ -26,44 +95,105 @@ void LogSinkImpl::OnLogMessage(const std::string &message, rtc::LoggingSeverity
 }
 
 void LogSinkImpl::OnLogMessage(const std::string &message) {
-	time_t rawTime;
-	time(&rawTime);
-	struct tm timeinfo;
-	timeval curTime = { 0 };
+	// Called from any thread, so only push to a lock-free list here.
+	const auto entry = new Entry();
+	entry->time = std::chrono::system_clock::now();
+	entry->message = message;
+	auto head = _queued.load(std::memory_order_relaxed);
+	do {
+		entry->next = head;
+	} while (!_queued.compare_exchange_weak(
+		head,
+		entry,
+		std::memory_order_release,
+		std::memory_order_relaxed));
 
-#ifdef WEBRTC_WIN
-	localtime_s(&timeinfo, &rawTime);
+	// A non-empty queue was already announced to the writer.
+	if (!head) {
+		Writer::Get().wake();
+	}
+}
 
-	FILETIME ft;
-	unsigned __int64 full = 0;
-	GetSystemTimeAsFileTime(&ft);
+std::string LogSinkImpl::result() {
+	std::lock_guard<std::mutex> lock(_consumerMutex);
+	drain();
 
-	full |= ft.dwHighDateTime;
-	full <<= 32;
-	full |= ft.dwLowDateTime;
+	auto result = std::string();
+	if (_dataDropped) {
+		result = "... " + std::to_string(_dataDropped) + " earlier log lines dropped.\n";
+	}
+	result.reserve(result.size() + _dataSize);
+	for (const auto &line : _data) {
+		result.append(line);
+	}
+	return result;
+}
+
+LogSinkImpl::Entry *LogSinkImpl::takeQueued() {
+	// The list is pushed to the front, reverse to get the arrival order.
+	auto entry = _queued.exchange(nullptr, std::memory_order_acquire);
+	auto result = (Entry*)nullptr;
+	while (entry) {
+		const auto next = entry->next;
+		entry->next = result;
+		result = entry;
+		entry = next;
+	}
+	return result;
+}
 
-	const auto deltaEpochInMicrosecs = 11644473600000000Ui64;
-	full -= deltaEpochInMicrosecs;
-	full /= 10;
-	curTime.tv_sec = (long)(full / 1000000UL);
-	curTime.tv_usec = (long)(full % 1000000UL);
+void LogSinkImpl::drain() {
+	auto entry = takeQueued();
+	if (!entry) {
+		return;
+	}
+	auto batch = std::string();
+	std::ostringstream stream;
+	while (entry) {
+		const auto rawTime = std::chrono::system_clock::to_time_t(entry->time);
+		const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
+			entry->time.time_since_epoch()).count() % 1000;
+		struct tm timeinfo;
+#ifdef WEBRTC_WIN
+		localtime_s(&timeinfo, &rawTime);
 #else
-	localtime_r(&rawTime, &timeinfo);
-	gettimeofday(&curTime, nullptr);
+		localtime_r(&rawTime, &timeinfo);
 #endif
 
-	int32_t milliseconds = curTime.tv_usec / 1000;
-
-	auto &stream = _file.is_open() ? (std::ostream&)_file : _data;
-	stream
-		<< (timeinfo.tm_year + 1900)
-		<< "-" << (timeinfo.tm_mon + 1)
-		<< "-" << (timeinfo.tm_mday)
-		<< " " << timeinfo.tm_hour
-		<< ":" << timeinfo.tm_min
-		<< ":" << timeinfo.tm_sec
-		<< ":" << milliseconds
-		<< " " << message;
+		stream.str(std::string());
+		stream
+			<< (timeinfo.tm_year + 1900)
+			<< "-" << (timeinfo.tm_mon + 1)
+			<< "-" << (timeinfo.tm_mday)
+			<< " " << timeinfo.tm_hour
+			<< ":" << timeinfo.tm_min
+			<< ":" << timeinfo.tm_sec
+			<< ":" << milliseconds
+			<< " " << entry->message;
+		if (_file.is_open()) {
+			batch.append(stream.str());
+		} else {
+			storeInMemory(stream.str());
+		}
+
+		const auto next = entry->next;
+		delete entry;
+		entry = next;
+	}
+	if (!batch.empty()) {
+		_file.write(batch.data(), batch.size());
+		_file.flush();
+	}
+}
+
+void LogSinkImpl::storeInMemory(std::string &&line) {
+	_dataSize += line.size();
+	_data.push_back(std::move(line));
+	while (_dataSize > _dataLimit && !_data.empty()) {
+		_dataSize -= _data.front().size();
+		_data.pop_front();
+		++_dataDropped;
+	}
 }
 
 } // namespace tgcalls
@@ -3,26 +3,49 @@
 
 #include "rtc_base/logging.h"
 #include <fstream>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
 
 namespace tgcalls {
 
 struct Config;
 
+// Messages are only queued on the calling thread, a background writer
+// shared by all sinks formats them and appends them to the file in batches.
 class LogSinkImpl final : public rtc::LogSink {
 public:
 	LogSinkImpl(const Config &config);
+	~LogSinkImpl() override;
 
 	void OnLogMessage(const std::string &msg, rtc::LoggingSeverity severity, const char *tag) override;
 	void OnLogMessage(const std::string &message, rtc::LoggingSeverity severity) override;
 	void OnLogMessage(const std::string &message) override;
 
-	std::string result() const {
-		return _data.str();
-	}
+	std::string result();
 
 private:
+	class Writer;
+
+	struct Entry {
+		std::chrono::system_clock::time_point time;
+		std::string message;
+		Entry *next = nullptr;
+	};
+
+	void drain();
+	Entry *takeQueued();
+	void storeInMemory(std::string &&line);
+
 	std::ofstream _file;
-	std::ostringstream _data;
+	std::deque<std::string> _data;
+	size_t _dataSize = 0;
+	size_t _dataLimit = 0;
+	size_t _dataDropped = 0;
+
+	std::atomic<Entry*> _queued{ nullptr };
+	std::mutex _consumerMutex;
 
 };
 
@@ -1,44 +1,33 @@
 #include "Manager.h"
 
 #include "rtc_base/byte_buffer.h"
+#include "rtc_base/logging.h"
 
 namespace tgcalls {
-namespace {
-
-rtc::Thread *makeNetworkThread() {
-	static std::unique_ptr<rtc::Thread> value = rtc::Thread::CreateWithSocketServer();
-	value->SetName("WebRTC-Network", nullptr);
-	value->Start();
-	return value.get();
-}
-
-rtc::Thread *getNetworkThread() {
-	static rtc::Thread *value = makeNetworkThread();
-	return value;
-}
-
-rtc::Thread *makeMediaThread() {
-	static std::unique_ptr<rtc::Thread> value = rtc::Thread::Create();
-	value->SetName("WebRTC-Media", nullptr);
-	value->Start();
-	return value.get();
-}
-
-} // namespace
 
 rtc::Thread *Manager::getMediaThread() {
-	static rtc::Thread *value = makeMediaThread();
-	return value;
+	return DefaultThreadShard().media;
 }
 
-Manager::Manager(rtc::Thread *thread, Descriptor &&descriptor) :
-_thread(thread),
+Manager::Manager(
+	const ThreadShard &threads,
+	Descriptor &&descriptor,
+	std::shared_ptr<TransportCounters> counters,
+	std::shared_ptr<TraceRecorder> trace) :
+_thread(threads.manager),
+_networkThread(threads.network),
+_networkSocketServer(threads.networkSocketServer),
+_mediaThread(threads.media),
 _encryptionKey(descriptor.encryptionKey),
 _signaling(
 	EncryptedConnection::Type::Signaling,
 	_encryptionKey,
 	[=](int delayMs, int cause) { sendSignalingAsync(delayMs, cause); }),
 _enableP2P(descriptor.config.enableP2P),
+_candidatesCoalesceMs(int(descriptor.config.candidatesCoalesceTimeout * 1000)),
+_dataSaving(descriptor.config.dataSaving),
+_counters(std::move(counters)),
+_trace(std::move(trace)),
 _rtcServers(std::move(descriptor.rtcServers)),
 _videoCapture(std::move(descriptor.videoCapture)),
 _stateUpdated(std::move(descriptor.stateUpdated)),
@@ -46,9 +35,14 @@ _remoteVideoIsActiveUpdated(std::move(descriptor.remoteVideoIsActiveUpdated)),
 _signalingDataEmitted(std::move(descriptor.signalingDataEmitted)) {
 	assert(_thread->IsCurrent());
 
-	_sendSignalingMessage = [=](const Message &message) {
+	_signaling.setTrace(_trace);
+
+	_sendSignalingMessage = [=](Message &&message) {
+		if (const auto candidates = absl::get_if<CandidatesListMessage>(&message.data)) {
+			candidates->compact = (_peerCapabilities & kCapabilityCompactCandidates) != 0;
+		}
 		if (const auto prepared = _signaling.prepareForSending(message)) {
-			_signalingDataEmitted(prepared->bytes);
+			_signalingDataEmitted(ToBytes(prepared->bytes));
 			return prepared->counter;
 		}
 		return uint32_t(0);
@@ -75,7 +69,7 @@ void Manager::sendSignalingAsync(int delayMs, int cause) {
 			return;
 		}
 		if (const auto prepared = strong->_signaling.prepareForSendingService(cause)) {
-			strong->_signalingDataEmitted(prepared->bytes);
+			strong->_signalingDataEmitted(ToBytes(prepared->bytes));
 		}
 	};
 	if (delayMs) {
@@ -86,8 +80,14 @@ void Manager::sendSignalingAsync(int delayMs, int cause) {
 }
 
 void Manager::start() {
+	// Sent before anything else, so that it goes as a single message packet.
+	_sendSignalingMessage({ CapabilitiesMessage{ kSupportedCapabilities } });
+
 	const auto weak = std::weak_ptr<Manager>(shared_from_this());
 	const auto thread = _thread;
+	const auto networkThread = _networkThread;
+	const auto networkSocketServer = _networkSocketServer;
+	const auto mediaThread = _mediaThread;
 	const auto sendSignalingMessage = [=](Message &&message) {
 		thread->PostTask(RTC_FROM_HERE, [=, message = std::move(message)]() mutable {
 			const auto strong = weak.lock();
@@ -97,12 +97,16 @@ void Manager::start() {
 			strong->_sendSignalingMessage(std::move(message));
 		});
 	};
-	_networkManager.reset(new ThreadLocalObject<NetworkManager>(getNetworkThread(), [weak, thread, sendSignalingMessage, encryptionKey = _encryptionKey, enableP2P = _enableP2P, rtcServers = _rtcServers] {
+	_networkManager.reset(new ThreadLocalObject<NetworkManager>(networkThread, [weak, thread, networkThread, networkSocketServer, sendSignalingMessage, encryptionKey = _encryptionKey, enableP2P = _enableP2P, rtcServers = _rtcServers, candidatesCoalesceMs = _candidatesCoalesceMs, counters = _counters, trace = _trace] {
 		return new NetworkManager(
-			getNetworkThread(),
+			networkThread,
+			networkSocketServer,
 			encryptionKey,
 			enableP2P,
 			rtcServers,
+			candidatesCoalesceMs,
+			counters,
+			trace,
 			[=](const NetworkManager::State &state) {
 				thread->PostTask(RTC_FROM_HERE, [=] {
 					const auto strong = weak.lock();
@@ -125,6 +129,9 @@ void Manager::start() {
 
 					strong->_mediaManager->perform([=](MediaManager *mediaManager) {
 						mediaManager->setIsConnected(state.isReadyToSendData);
+						mediaManager->setTransportPacketSize(
+							state.maxDataPayloadSize,
+							state.packetOverhead);
 						});
 					});
 			},
@@ -151,23 +158,64 @@ void Manager::start() {
 				}
 			});
 	}));
+	if (computeAudioBundling()) {
+		_networkManager->perform([](NetworkManager *networkManager) {
+			networkManager->setAudioBundling(true);
+		});
+	}
 	bool isOutgoing = _encryptionKey.isOutgoing;
-	_mediaManager.reset(new ThreadLocalObject<MediaManager>(getMediaThread(), [weak, isOutgoing, thread, sendSignalingMessage, videoCapture = _videoCapture]() {
+
+	// Media and transport messages go between the media and network
+	// threads directly, without a hop through the manager thread.
+	const auto weakNetworkManager = std::weak_ptr<ThreadLocalObject<NetworkManager>>(_networkManager);
+	_mediaManager.reset(new ThreadLocalObject<MediaManager>(mediaThread, [mediaThread, isOutgoing, sendSignalingMessage, weakNetworkManager]() {
 		return new MediaManager(
-			getMediaThread(),
+			mediaThread,
 			isOutgoing,
-			videoCapture,
 			sendSignalingMessage,
 			[=](Message &&message) {
-				thread->PostTask(RTC_FROM_HERE, [=, message = std::move(message)]() mutable {
-					const auto strong = weak.lock();
-					if (!strong) {
-						return;
-					}
-					strong->_sendTransportMessage(std::move(message));
-				});
+				if (const auto strong = weakNetworkManager.lock()) {
+					strong->perform([message = std::move(message)](NetworkManager *networkManager) {
+						networkManager->sendMessage(message);
+					});
+				}
+			},
+			[=](Message &&message, const rtc::SentPacket &sentPacket) {
+				if (const auto strong = weakNetworkManager.lock()) {
+					strong->perform([message = std::move(message), sentPacket](NetworkManager *networkManager) {
+						networkManager->sendMessage(message, sentPacket);
+					});
+				}
+			},
+			[=](int bandwidth) {
+				if (const auto strong = weakNetworkManager.lock()) {
+					strong->perform([bandwidth](NetworkManager *networkManager) {
+						networkManager->setSendBandwidth(bandwidth);
+					});
+				}
 			});
 	}));
+	if (_videoCapture) {
+		_mediaManager->perform([videoCapture = _videoCapture](MediaManager *mediaManager) {
+			mediaManager->setSendVideo(videoCapture);
+		});
+	}
+	_networkManager->perform([weakMediaManager = std::weak_ptr<ThreadLocalObject<MediaManager>>(_mediaManager)](NetworkManager *networkManager) {
+		networkManager->setMediaMessageReceived([=](DecryptedMessage &&message) {
+			if (const auto strong = weakMediaManager.lock()) {
+				strong->perform([message = std::move(message)](MediaManager *mediaManager) mutable {
+					mediaManager->receiveMessage(std::move(message));
+				});
+			}
+		});
+		networkManager->setMediaPacketsSent([=](std::vector<rtc::SentPacket> &&sentPackets) {
+			if (const auto strong = weakMediaManager.lock()) {
+				strong->perform([sentPackets = std::move(sentPackets)](MediaManager *mediaManager) {
+					mediaManager->notifyPacketsSent(sentPackets);
+				});
+			}
+		});
+	});
 }
 
 void Manager::receiveSignalingData(const std::vector<uint8_t> &data) {
@@ -181,32 +229,44 @@ void Manager::receiveSignalingData(const std::vector<uint8_t> &data) {
 
 void Manager::receiveMessage(DecryptedMessage &&message) {
 	const auto data = &message.message.data;
-	if (const auto candidatesList = absl::get_if<CandidatesListMessage>(data)) {
-		_networkManager->perform([message = std::move(message)](NetworkManager *networkManager) mutable {
-			networkManager->receiveSignalingMessage(std::move(message));
-		});
-	} else if (const auto videoFormats = absl::get_if<VideoFormatsMessage>(data)) {
-		_mediaManager->perform([message = std::move(message)](MediaManager *mediaManager) mutable {
-			mediaManager->receiveMessage(std::move(message));
-		});
-	} else if (absl::get_if<RequestVideoMessage>(data)) {
-		if (_videoState == VideoState::Possible) {
-            _videoState = VideoState::IncomingRequested;
-            _stateUpdated(_state, _videoState);
-		} else if (_videoState == VideoState::OutgoingRequested) {
-            _videoState = VideoState::Active;
-            _stateUpdated(_state, _videoState);
-
-            _mediaManager->perform([videoCapture = _videoCapture](MediaManager *mediaManager) {
-                mediaManager->setSendVideo(videoCapture);
-            });
-        }
-    } else if (const auto remoteVideoIsActive = absl::get_if<RemoteVideoIsActiveMessage>(data)) {
-		_remoteVideoIsActiveUpdated(remoteVideoIsActive->active);
-	} else {
-		_mediaManager->perform([=, message = std::move(message)](MediaManager *mediaManager) mutable {
-			mediaManager->receiveMessage(std::move(message));
-		});
+	switch (MessageTypeId(message.message)) {
+		case CandidatesListMessage::kId:
+			_networkManager->perform([message = std::move(message)](NetworkManager *networkManager) mutable {
+				networkManager->receiveSignalingMessage(std::move(message));
+			});
+			break;
+		case RequestVideoMessage::kId:
+			if (_videoState == VideoState::Possible) {
+				_videoState = VideoState::IncomingRequested;
+				_stateUpdated(_state, _videoState);
+			} else if (_videoState == VideoState::OutgoingRequested) {
+				_videoState = VideoState::Active;
+				_stateUpdated(_state, _videoState);
+
+				_mediaManager->perform([videoCapture = _videoCapture](MediaManager *mediaManager) {
+					mediaManager->setSendVideo(videoCapture);
+				});
+			}
+			break;
+		case CapabilitiesMessage::kId:
+			_peerCapabilities = absl::get<CapabilitiesMessage>(*data).capabilities
+				& kSupportedCapabilities;
+			_signaling.setPeerCapabilities(_peerCapabilities);
+			_networkManager->perform([capabilities = _peerCapabilities](NetworkManager *networkManager) {
+				networkManager->setPeerCapabilities(capabilities);
+			});
+			_mediaManager->perform([capabilities = _peerCapabilities](MediaManager *mediaManager) {
+				mediaManager->setPeerCapabilities(capabilities);
+			});
+			break;
+		case RemoteVideoIsActiveMessage::kId:
+			_remoteVideoIsActiveUpdated(absl::get<RemoteVideoIsActiveMessage>(*data).active);
+			break;
+		default:
+			_mediaManager->perform([=, message = std::move(message)](MediaManager *mediaManager) mutable {
+				mediaManager->receiveMessage(std::move(message));
+			});
+			break;
 	}
 }
 
@@ -244,6 +304,28 @@ void Manager::setMuteOutgoingAudio(bool mute) {
 	});
 }
 
+void Manager::setIsMobileNetwork(bool isMobileNetwork) {
+	const auto wasBundling = computeAudioBundling();
+	_isMobileNetwork = isMobileNetwork;
+	const auto bundling = computeAudioBundling();
+	if (bundling != wasBundling) {
+		_networkManager->perform([bundling](NetworkManager *networkManager) {
+			networkManager->setAudioBundling(bundling);
+		});
+	}
+}
+
+bool Manager::computeAudioBundling() const {
+	switch (_dataSaving) {
+		case DataSaving::Always:
+			return true;
+		case DataSaving::Mobile:
+			return _isMobileNetwork;
+		default:
+			return false;
+	}
+}
+
 void Manager::setIncomingVideoOutput(std::shared_ptr<rtc::VideoSinkInterface<webrtc::VideoFrame>> sink) {
 	_mediaManager->perform([sink](MediaManager *mediaManager) {
 		mediaManager->setIncomingVideoOutput(sink);
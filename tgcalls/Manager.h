@@ -5,6 +5,7 @@
 #include "EncryptedConnection.h"
 #include "NetworkManager.h"
 #include "MediaManager.h"
+#include "ThreadShards.h"
 #include "Instance.h"
 
 namespace tgcalls {
@@ -13,35 +14,50 @@ class Manager final : public std::enable_shared_from_this<Manager> {
 public:
 	static rtc::Thread *getMediaThread();
 
-	Manager(rtc::Thread *thread, Descriptor &&descriptor);
+	Manager(
+		const ThreadShard &threads,
+		Descriptor &&descriptor,
+		std::shared_ptr<TransportCounters> counters,
+		std::shared_ptr<TraceRecorder> trace);
 	~Manager();
 
 	void start();
 	void receiveSignalingData(const std::vector<uint8_t> &data);
 	void requestVideo(std::shared_ptr<VideoCaptureInterface> videoCapture);
     void setMuteOutgoingAudio(bool mute);
+	void setIsMobileNetwork(bool isMobileNetwork);
 	void setIncomingVideoOutput(std::shared_ptr<rtc::VideoSinkInterface<webrtc::VideoFrame>> sink);
 
 private:
 	void sendSignalingAsync(int delayMs, int cause);
 	void receiveMessage(DecryptedMessage &&message);
+	bool computeAudioBundling() const;
 
 	rtc::Thread *_thread;
+	rtc::Thread *_networkThread;
+	rtc::PhysicalSocketServer *_networkSocketServer;
+	rtc::Thread *_mediaThread;
 	EncryptionKey _encryptionKey;
 	EncryptedConnection _signaling;
 	bool _enableP2P = false;
+	int _candidatesCoalesceMs = 0;
+	DataSaving _dataSaving = DataSaving::Never;
+	bool _isMobileNetwork = false;
+	std::shared_ptr<TransportCounters> _counters;
+	std::shared_ptr<TraceRecorder> _trace;
 	std::vector<RtcServer> _rtcServers;
 	std::shared_ptr<VideoCaptureInterface> _videoCapture;
 	std::function<void(const State &, VideoState)> _stateUpdated;
 	std::function<void(bool)> _remoteVideoIsActiveUpdated;
 	std::function<void(const std::vector<uint8_t> &)> _signalingDataEmitted;
-	std::function<uint32_t(const Message &)> _sendSignalingMessage;
+	std::function<uint32_t(Message&&)> _sendSignalingMessage;
 	std::function<void(Message&&)> _sendTransportMessage;
-	std::unique_ptr<ThreadLocalObject<NetworkManager>> _networkManager;
-	std::unique_ptr<ThreadLocalObject<MediaManager>> _mediaManager;
+	std::shared_ptr<ThreadLocalObject<NetworkManager>> _networkManager;
+	std::shared_ptr<ThreadLocalObject<MediaManager>> _mediaManager;
 	State _state = State::Reconnecting;
     VideoState _videoState = VideoState::Possible;
     bool _didConnectOnce = false;
+	uint32_t _peerCapabilities = 0;
 
 };
 
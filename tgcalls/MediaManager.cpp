@@ -5,6 +5,7 @@
 #include "VideoCapturerInterface.h"
 #include "CodecSelectHelper.h"
 #include "Message.h"
+#include "RtpHeaderCompression.h"
 #include "platform/PlatformInterface.h"
 
 #include "api/audio_codecs/audio_decoder_factory_template.h"
@@ -16,18 +17,12 @@
 #include "system_wrappers/include/field_trial.h"
 #include "api/video/builtin_video_bitrate_allocator_factory.h"
 #include "call/call.h"
+#include "call/rtp_transport_controller_send_interface.h"
 
 namespace tgcalls {
 namespace {
 
-constexpr uint32_t ssrcAudioIncoming = 1;
-constexpr uint32_t ssrcAudioOutgoing = 2;
-constexpr uint32_t ssrcAudioFecIncoming = 5;
-constexpr uint32_t ssrcAudioFecOutgoing = 6;
-constexpr uint32_t ssrcVideoIncoming = 3;
-constexpr uint32_t ssrcVideoOutgoing = 4;
-constexpr uint32_t ssrcVideoFecIncoming = 7;
-constexpr uint32_t ssrcVideoFecOutgoing = 8;
+constexpr auto kSendBandwidthUpdateIntervalMs = 500;
 
 rtc::Thread *makeWorkerThread() {
 	static std::unique_ptr<rtc::Thread> value = rtc::Thread::Create();
@@ -36,14 +31,102 @@ rtc::Thread *makeWorkerThread() {
 	return value.get();
 }
 
-VideoCaptureInterfaceObject *GetVideoCaptureAssumingSameThread(VideoCaptureInterface *videoCapture) {
-	return videoCapture
-		? static_cast<VideoCaptureInterfaceImpl*>(videoCapture)->object()->getSyncAssumingSameThread()
-		: nullptr;
+ThreadLocalObject<VideoCaptureInterfaceObject> *GetVideoCaptureObject(VideoCaptureInterface *videoCapture) {
+	return static_cast<VideoCaptureInterfaceImpl*>(videoCapture)->object();
 }
 
 } // namespace
 
+// Passes everything to the call, setting the largest RTP packet of the
+// video send streams it creates. The video channel caps it at 1200
+// bytes and offers no way to change it, while one data message fits
+// more when the path MTU allows.
+class MediaManager::PacketSizeCall final : public webrtc::Call {
+public:
+	explicit PacketSizeCall(webrtc::Call *call) : _call(call) {
+	}
+
+	size_t maxVideoPacketSize() const {
+		return _maxVideoPacketSize;
+	}
+	void setMaxVideoPacketSize(size_t size) {
+		_maxVideoPacketSize = size;
+	}
+
+	webrtc::AudioSendStream *CreateAudioSendStream(const webrtc::AudioSendStream::Config &config) override {
+		return _call->CreateAudioSendStream(config);
+	}
+	void DestroyAudioSendStream(webrtc::AudioSendStream *stream) override {
+		_call->DestroyAudioSendStream(stream);
+	}
+	webrtc::AudioReceiveStream *CreateAudioReceiveStream(const webrtc::AudioReceiveStream::Config &config) override {
+		return _call->CreateAudioReceiveStream(config);
+	}
+	void DestroyAudioReceiveStream(webrtc::AudioReceiveStream *stream) override {
+		_call->DestroyAudioReceiveStream(stream);
+	}
+	webrtc::VideoSendStream *CreateVideoSendStream(
+			webrtc::VideoSendStream::Config config,
+			webrtc::VideoEncoderConfig encoderConfig) override {
+		applyMaxVideoPacketSize(config);
+		return _call->CreateVideoSendStream(std::move(config), std::move(encoderConfig));
+	}
+	webrtc::VideoSendStream *CreateVideoSendStream(
+			webrtc::VideoSendStream::Config config,
+			webrtc::VideoEncoderConfig encoderConfig,
+			std::unique_ptr<webrtc::FecController> fecController) override {
+		applyMaxVideoPacketSize(config);
+		return _call->CreateVideoSendStream(std::move(config), std::move(encoderConfig), std::move(fecController));
+	}
+	void DestroyVideoSendStream(webrtc::VideoSendStream *stream) override {
+		_call->DestroyVideoSendStream(stream);
+	}
+	webrtc::VideoReceiveStream *CreateVideoReceiveStream(webrtc::VideoReceiveStream::Config config) override {
+		return _call->CreateVideoReceiveStream(std::move(config));
+	}
+	void DestroyVideoReceiveStream(webrtc::VideoReceiveStream *stream) override {
+		_call->DestroyVideoReceiveStream(stream);
+	}
+	webrtc::FlexfecReceiveStream *CreateFlexfecReceiveStream(const webrtc::FlexfecReceiveStream::Config &config) override {
+		return _call->CreateFlexfecReceiveStream(config);
+	}
+	void DestroyFlexfecReceiveStream(webrtc::FlexfecReceiveStream *stream) override {
+		_call->DestroyFlexfecReceiveStream(stream);
+	}
+	webrtc::PacketReceiver *Receiver() override {
+		return _call->Receiver();
+	}
+	webrtc::RtpTransportControllerSendInterface *GetTransportControllerSend() override {
+		return _call->GetTransportControllerSend();
+	}
+	Stats GetStats() const override {
+		return _call->GetStats();
+	}
+	void SignalChannelNetworkState(webrtc::MediaType media, webrtc::NetworkState state) override {
+		_call->SignalChannelNetworkState(media, state);
+	}
+	void OnAudioTransportOverheadChanged(int overhead) override {
+		_call->OnAudioTransportOverheadChanged(overhead);
+	}
+	void OnSentPacket(const rtc::SentPacket &packet) override {
+		_call->OnSentPacket(packet);
+	}
+	void SetClientBitratePreferences(const webrtc::BitrateSettings &preferences) override {
+		_call->SetClientBitratePreferences(preferences);
+	}
+
+private:
+	void applyMaxVideoPacketSize(webrtc::VideoSendStream::Config &config) const {
+		if (_maxVideoPacketSize > 0) {
+			config.rtp.max_packet_size = _maxVideoPacketSize;
+		}
+	}
+
+	std::unique_ptr<webrtc::Call> _call;
+	size_t _maxVideoPacketSize = 0;
+
+};
+
 rtc::Thread *MediaManager::getWorkerThread() {
 	static rtc::Thread *value = makeWorkerThread();
 	return value;
@@ -52,15 +135,17 @@ rtc::Thread *MediaManager::getWorkerThread() {
 MediaManager::MediaManager(
 	rtc::Thread *thread,
 	bool isOutgoing,
-	std::shared_ptr<VideoCaptureInterface> videoCapture,
 	std::function<void(Message &&)> sendSignalingMessage,
-	std::function<void(Message &&)> sendTransportMessage) :
+	std::function<void(Message &&)> sendTransportMessage,
+	std::function<void(Message &&, const rtc::SentPacket &)> sendMediaMessage,
+	std::function<void(int)> sendBandwidthUpdated) :
 _thread(thread),
 _eventLog(std::make_unique<webrtc::RtcEventLogNull>()),
 _taskQueueFactory(webrtc::CreateDefaultTaskQueueFactory()),
 _sendSignalingMessage(std::move(sendSignalingMessage)),
 _sendTransportMessage(std::move(sendTransportMessage)),
-_videoCapture(std::move(videoCapture)) {
+_sendMediaMessage(std::move(sendMediaMessage)),
+_sendBandwidthUpdated(std::move(sendBandwidthUpdated)) {
 	_ssrcAudio.incoming = isOutgoing ? ssrcAudioIncoming : ssrcAudioOutgoing;
 	_ssrcAudio.outgoing = (!isOutgoing) ? ssrcAudioIncoming : ssrcAudioOutgoing;
 	_ssrcAudio.fecIncoming = isOutgoing ? ssrcAudioFecIncoming : ssrcAudioFecOutgoing;
@@ -70,6 +155,9 @@ _videoCapture(std::move(videoCapture)) {
 	_ssrcVideo.fecIncoming = isOutgoing ? ssrcVideoFecIncoming : ssrcVideoFecOutgoing;
 	_ssrcVideo.fecOutgoing = (!isOutgoing) ? ssrcVideoFecIncoming : ssrcVideoFecOutgoing;
 
+	_audioRtpCompressor = std::make_unique<RtpHeaderCompressor>(_ssrcAudio.outgoing);
+	_audioRtpDecompressor = std::make_unique<RtpHeaderDecompressor>(_ssrcAudio.incoming);
+
 	_audioNetworkInterface = std::unique_ptr<MediaManager::NetworkInterfaceImpl>(new MediaManager::NetworkInterfaceImpl(this, false));
 	_videoNetworkInterface = std::unique_ptr<MediaManager::NetworkInterfaceImpl>(new MediaManager::NetworkInterfaceImpl(this, true));
 
@@ -104,7 +192,7 @@ _videoCapture(std::move(videoCapture)) {
 	callConfig.task_queue_factory = _taskQueueFactory.get();
 	callConfig.trials = &_fieldTrials;
 	callConfig.audio_state = _mediaEngine->voice().GetAudioState();
-	_call.reset(webrtc::Call::Create(callConfig));
+	_call = std::make_unique<PacketSizeCall>(webrtc::Call::Create(callConfig));
 	_audioChannel.reset(_mediaEngine->voice().CreateMediaChannel(_call.get(), cricket::MediaConfig(), cricket::AudioOptions(), webrtc::CryptoOptions::NoGcm()));
 	_videoChannel.reset(_mediaEngine->video().CreateMediaChannel(_call.get(), cricket::MediaConfig(), cricket::VideoOptions(), webrtc::CryptoOptions::NoGcm(), _videoBitrateAllocatorFactory.get()));
 
@@ -156,10 +244,6 @@ _videoCapture(std::move(videoCapture)) {
 	_videoChannel->SetInterface(_videoNetworkInterface.get(), webrtc::MediaTransportConfig());
 
 	_sendSignalingMessage({ _myVideoFormats });
-
-	if (_videoCapture != nullptr) {
-        setSendVideo(_videoCapture);
-    }
 }
 
 MediaManager::~MediaManager() {
@@ -204,10 +288,50 @@ void MediaManager::setIsConnected(bool isConnected) {
 		_videoChannel->OnReadyToSend(_isConnected);
 		_videoChannel->SetSend(_isConnected);
 	}
+	if (_isConnected && !_sendBandwidthUpdatesStarted) {
+		_sendBandwidthUpdatesStarted = true;
+		updateSendBandwidth();
+	}
+}
+
+void MediaManager::updateSendBandwidth() {
+	const auto bandwidth = _isConnected ? _call->GetStats().send_bandwidth_bps : 0;
+	if (_sendBandwidth != bandwidth) {
+		_sendBandwidth = bandwidth;
+		_sendBandwidthUpdated(bandwidth);
+	}
+	_thread->PostDelayedTask(RTC_FROM_HERE, [weak = std::weak_ptr<MediaManager>(shared_from_this())] {
+		if (const auto strong = weak.lock()) {
+			strong->updateSendBandwidth();
+		}
+	}, kSendBandwidthUpdateIntervalMs);
+}
+
+void MediaManager::setTransportPacketSize(size_t maxDataPayloadSize, size_t packetOverhead) {
+	if (_transportOverhead != packetOverhead) {
+		_transportOverhead = packetOverhead;
+		_call->GetTransportControllerSend()->OnTransportOverheadChanged(packetOverhead);
+	}
+	if (_call->maxVideoPacketSize() == maxDataPayloadSize) {
+		return;
+	}
+	// A video RTP packet goes in one data message. The send stream
+	// takes the size when created, so it is created again.
+	_call->setMaxVideoPacketSize(maxDataPayloadSize);
+	if (computeIsSendingVideo()) {
+		removeVideoSendStream();
+		addVideoSendStream();
+	}
+}
+
+void MediaManager::setPeerCapabilities(uint32_t capabilities) {
+	_compressAudioRtp = (capabilities & kCapabilityRtpHeaderCompression) != 0;
 }
 
-void MediaManager::notifyPacketSent(const rtc::SentPacket &sentPacket) {
-	_call->OnSentPacket(sentPacket);
+void MediaManager::notifyPacketsSent(const std::vector<rtc::SentPacket> &sentPackets) {
+	for (const auto &sentPacket : sentPackets) {
+		_call->OnSentPacket(sentPacket);
+	}
 }
 
 void MediaManager::setPeerVideoFormats(VideoFormatsMessage &&peerFormats) {
@@ -235,26 +359,52 @@ bool MediaManager::videoCodecsNegotiated() const {
 }
 
 bool MediaManager::computeIsSendingVideo() const {
-	return _videoCapture != nullptr && _videoCodecOut.has_value();
+	return _videoSource != nullptr && _videoCodecOut.has_value();
 }
 
 void MediaManager::setSendVideo(std::shared_ptr<VideoCaptureInterface> videoCapture) {
     const auto wasSending = computeIsSendingVideo();
 
     if (_videoCapture) {
-		GetVideoCaptureAssumingSameThread(_videoCapture.get())->setIsActiveUpdated(nullptr);
+		GetVideoCaptureObject(_videoCapture.get())->perform([](VideoCaptureInterfaceObject *object) {
+			object->setIsActiveUpdated(nullptr);
+		});
     }
     _videoCapture = videoCapture;
+	_videoSource = nullptr;
 	if (_videoCapture) {
+		// The capture object lives on the media thread of the default
+		// thread shard, which may not be ours, so its source comes back
+		// in a task.
 		const auto sendTransportMessage = _sendTransportMessage;
-		GetVideoCaptureAssumingSameThread(_videoCapture.get())->setIsActiveUpdated([=](bool isActive) {
-			sendTransportMessage({ RemoteVideoIsActiveMessage{ isActive } });
+		const auto thread = _thread;
+		const auto weak = std::weak_ptr<MediaManager>(shared_from_this());
+		GetVideoCaptureObject(_videoCapture.get())->perform([=](VideoCaptureInterfaceObject *object) {
+			object->setIsActiveUpdated([=](bool isActive) {
+				sendTransportMessage({ RemoteVideoIsActiveMessage{ isActive } });
+			});
+			thread->PostTask(RTC_FROM_HERE, [=, source = object->_videoSource] {
+				if (const auto strong = weak.lock()) {
+					strong->setVideoSource(videoCapture, source);
+				}
+			});
 		});
 	}
 
     checkIsSendingVideoChanged(wasSending);
 }
 
+void MediaManager::setVideoSource(
+		const std::shared_ptr<VideoCaptureInterface> &videoCapture,
+		rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> source) {
+	if (_videoCapture != videoCapture || _videoSource == source) {
+		return;
+	}
+	const auto wasSending = computeIsSendingVideo();
+	_videoSource = std::move(source);
+	checkIsSendingVideoChanged(wasSending);
+}
+
 void MediaManager::checkIsSendingVideoChanged(bool wasSending) {
 	const auto sending = computeIsSendingVideo();
 	if (sending == wasSending) {
@@ -284,19 +434,7 @@ void MediaManager::checkIsSendingVideoChanged(bool wasSending) {
 		//videoSendParameters.rtcp.remote_estimate = true;
 		_videoChannel->SetSendParameters(videoSendParameters);
 
-		if (_enableFlexfec) {
-			cricket::StreamParams videoSendStreamParams;
-			cricket::SsrcGroup videoSendSsrcGroup(cricket::kFecFrSsrcGroupSemantics, {_ssrcVideo.outgoing, _ssrcVideo.fecOutgoing});
-			videoSendStreamParams.ssrcs = {_ssrcVideo.outgoing};
-			videoSendStreamParams.ssrc_groups.push_back(videoSendSsrcGroup);
-			videoSendStreamParams.cname = "cname";
-			_videoChannel->AddSendStream(videoSendStreamParams);
-			_videoChannel->SetVideoSend(_ssrcVideo.outgoing, NULL, GetVideoCaptureAssumingSameThread(_videoCapture.get())->_videoSource);
-			_videoChannel->SetVideoSend(_ssrcVideo.fecOutgoing, NULL, nullptr);
-		} else {
-			_videoChannel->AddSendStream(cricket::StreamParams::CreateLegacy(_ssrcVideo.outgoing));
-			_videoChannel->SetVideoSend(_ssrcVideo.outgoing, NULL, GetVideoCaptureAssumingSameThread(_videoCapture.get())->_videoSource);
-		}
+		addVideoSendStream();
 
 		cricket::VideoRecvParameters videoRecvParameters;
 
@@ -337,17 +475,36 @@ void MediaManager::checkIsSendingVideoChanged(bool wasSending) {
 		_videoChannel->OnReadyToSend(_isConnected);
 		_videoChannel->SetSend(_isConnected);
 	} else {
-		_videoChannel->SetVideoSend(_ssrcVideo.outgoing, NULL, nullptr);
-		_videoChannel->SetVideoSend(_ssrcVideo.fecOutgoing, NULL, nullptr);
-
 		_videoChannel->RemoveRecvStream(_ssrcVideo.incoming);
 		_videoChannel->RemoveRecvStream(_ssrcVideo.fecIncoming);
 		_readyToReceiveVideo = false;
 
-		_videoChannel->RemoveSendStream(_ssrcVideo.outgoing);
-		if (_enableFlexfec) {
-			_videoChannel->RemoveSendStream(_ssrcVideo.fecOutgoing);
-		}
+		removeVideoSendStream();
+	}
+}
+
+void MediaManager::addVideoSendStream() {
+	if (_enableFlexfec) {
+		cricket::StreamParams videoSendStreamParams;
+		cricket::SsrcGroup videoSendSsrcGroup(cricket::kFecFrSsrcGroupSemantics, {_ssrcVideo.outgoing, _ssrcVideo.fecOutgoing});
+		videoSendStreamParams.ssrcs = {_ssrcVideo.outgoing};
+		videoSendStreamParams.ssrc_groups.push_back(videoSendSsrcGroup);
+		videoSendStreamParams.cname = "cname";
+		_videoChannel->AddSendStream(videoSendStreamParams);
+		_videoChannel->SetVideoSend(_ssrcVideo.outgoing, NULL, _videoSource);
+		_videoChannel->SetVideoSend(_ssrcVideo.fecOutgoing, NULL, nullptr);
+	} else {
+		_videoChannel->AddSendStream(cricket::StreamParams::CreateLegacy(_ssrcVideo.outgoing));
+		_videoChannel->SetVideoSend(_ssrcVideo.outgoing, NULL, _videoSource);
+	}
+}
+
+void MediaManager::removeVideoSendStream() {
+	_videoChannel->SetVideoSend(_ssrcVideo.outgoing, NULL, nullptr);
+	_videoChannel->SetVideoSend(_ssrcVideo.fecOutgoing, NULL, nullptr);
+	_videoChannel->RemoveSendStream(_ssrcVideo.outgoing);
+	if (_enableFlexfec) {
+		_videoChannel->RemoveSendStream(_ssrcVideo.fecOutgoing);
 	}
 }
 
@@ -364,20 +521,34 @@ void MediaManager::setIncomingVideoOutput(std::shared_ptr<rtc::VideoSinkInterfac
 
 void MediaManager::receiveMessage(DecryptedMessage &&message) {
 	const auto data = &message.message.data;
-	if (const auto formats = absl::get_if<VideoFormatsMessage>(data)) {
-		setPeerVideoFormats(std::move(*formats));
-	} else if (const auto audio = absl::get_if<AudioDataMessage>(data)) {
-		if (_audioChannel) {
-			_audioChannel->OnPacketReceived(audio->data, -1);
-		}
-	} else if (const auto video = absl::get_if<VideoDataMessage>(data)) {
-		if (_videoChannel) {
-			if (_readyToReceiveVideo) {
-				_videoChannel->OnPacketReceived(video->data, -1);
-			} else {
-				// maybe we need to queue packets for some time?
+	switch (MessageTypeId(message.message)) {
+		case VideoFormatsMessage::kId:
+			setPeerVideoFormats(std::move(absl::get<VideoFormatsMessage>(*data)));
+			break;
+		case AudioDataMessage::kId:
+			if (_audioChannel) {
+				auto &packet = absl::get<AudioDataMessage>(*data).data;
+				if (RtpHeaderDecompressor::IsCompressed(packet)) {
+					auto decompressed = _audioRtpDecompressor->decompress(packet);
+					if (!decompressed) {
+						break;
+					}
+					packet = std::move(*decompressed);
+				}
+				_audioChannel->OnPacketReceived(std::move(packet), -1);
 			}
-		}
+			break;
+		case VideoDataMessage::kId:
+			if (_videoChannel) {
+				if (_readyToReceiveVideo) {
+					_videoChannel->OnPacketReceived(std::move(absl::get<VideoDataMessage>(*data).data), -1);
+				} else {
+					// maybe we need to queue packets for some time?
+				}
+			}
+			break;
+		default:
+			break;
 	}
 }
 
@@ -387,6 +558,10 @@ _isVideo(isVideo) {
 }
 
 bool MediaManager::NetworkInterfaceImpl::SendPacket(rtc::CopyOnWriteBuffer *packet, const rtc::PacketOptions& options) {
+	if (!_isVideo && _mediaManager->_compressAudioRtp) {
+		auto compressed = _mediaManager->_audioRtpCompressor->compress(*packet);
+		return sendTransportMessage(&compressed, options);
+	}
 	return sendTransportMessage(packet, options);
 }
 
@@ -395,11 +570,12 @@ bool MediaManager::NetworkInterfaceImpl::SendRtcp(rtc::CopyOnWriteBuffer *packet
 }
 
 bool MediaManager::NetworkInterfaceImpl::sendTransportMessage(rtc::CopyOnWriteBuffer *packet, const rtc::PacketOptions& options) {
-	_mediaManager->_sendTransportMessage(_isVideo
+	// The send time is set and reported by the network manager,
+	// after pacing or bundling, see setMediaPacketsSent.
+	rtc::SentPacket sentPacket(options.packet_id, -1, options.info_signaled_after_sent);
+	_mediaManager->_sendMediaMessage(_isVideo
 		? Message{ VideoDataMessage{ *packet } }
-		: Message{ AudioDataMessage{ *packet } });
-	rtc::SentPacket sentPacket(options.packet_id, rtc::TimeMillis(), options.info_signaled_after_sent);
-	_mediaManager->notifyPacketSent(sentPacket);
+		: Message{ AudioDataMessage{ *packet } }, sentPacket);
 	return true;
 }
 
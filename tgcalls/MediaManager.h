@@ -12,6 +12,7 @@
 
 #include <functional>
 #include <memory>
+#include <atomic>
 
 namespace webrtc {
 class Call;
@@ -30,6 +31,8 @@ class VideoMediaChannel;
 namespace tgcalls {
 
 class VideoCapturerInterface;
+class RtpHeaderCompressor;
+class RtpHeaderDecompressor;
 
 class MediaManager : public sigslot::has_slots<>, public std::enable_shared_from_this<MediaManager> {
 public:
@@ -38,13 +41,16 @@ public:
 	MediaManager(
 		rtc::Thread *thread,
 		bool isOutgoing,
-		std::shared_ptr<VideoCaptureInterface> videoCapture,
 		std::function<void(Message &&)> sendSignalingMessage,
-		std::function<void(Message &&)> sendTransportMessage);
+		std::function<void(Message &&)> sendTransportMessage,
+		std::function<void(Message &&, const rtc::SentPacket &)> sendMediaMessage,
+		std::function<void(int)> sendBandwidthUpdated);
 	~MediaManager();
 
 	void setIsConnected(bool isConnected);
-	void notifyPacketSent(const rtc::SentPacket &sentPacket);
+	void setTransportPacketSize(size_t maxDataPayloadSize, size_t packetOverhead);
+	void setPeerCapabilities(uint32_t capabilities);
+	void notifyPacketsSent(const std::vector<rtc::SentPacket> &sentPackets);
 	void setSendVideo(std::shared_ptr<VideoCaptureInterface> videoCapture);
 	void setMuteOutgoingAudio(bool mute);
 	void setIncomingVideoOutput(std::shared_ptr<rtc::VideoSinkInterface<webrtc::VideoFrame>> sink);
@@ -75,10 +81,18 @@ private:
 
 	friend class MediaManager::NetworkInterfaceImpl;
 
+	class PacketSizeCall;
+
 	void setPeerVideoFormats(VideoFormatsMessage &&peerFormats);
+	void setVideoSource(
+		const std::shared_ptr<VideoCaptureInterface> &videoCapture,
+		rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> source);
 
 	bool computeIsSendingVideo() const;
+	void updateSendBandwidth();
 	void checkIsSendingVideoChanged(bool wasSending);
+	void addVideoSendStream();
+	void removeVideoSendStream();
 	bool videoCodecsNegotiated() const;
 
 	rtc::Thread *_thread = nullptr;
@@ -87,12 +101,20 @@ private:
 
 	std::function<void(Message &&)> _sendSignalingMessage;
 	std::function<void(Message &&)> _sendTransportMessage;
+	std::function<void(Message &&, const rtc::SentPacket &)> _sendMediaMessage;
+	std::function<void(int)> _sendBandwidthUpdated;
 
 	SSRC _ssrcAudio;
 	SSRC _ssrcVideo;
 	bool _enableFlexfec = true;
 
 	bool _isConnected = false;
+	size_t _transportOverhead = 0;
+	int _sendBandwidth = 0;
+	bool _sendBandwidthUpdatesStarted = false;
+	std::atomic<bool> _compressAudioRtp{ false };
+	std::unique_ptr<RtpHeaderCompressor> _audioRtpCompressor;
+	std::unique_ptr<RtpHeaderDecompressor> _audioRtpDecompressor;
 	bool _muteOutgoingAudio = false;
 	bool _readyToReceiveVideo = false;
 
@@ -101,13 +123,14 @@ private:
 	absl::optional<cricket::VideoCodec> _videoCodecOut;
 
 	std::unique_ptr<cricket::MediaEngineInterface> _mediaEngine;
-	std::unique_ptr<webrtc::Call> _call;
+	std::unique_ptr<PacketSizeCall> _call;
 	webrtc::FieldTrialBasedConfig _fieldTrials;
 	webrtc::LocalAudioSinkAdapter _audioSource;
 	std::unique_ptr<cricket::VoiceMediaChannel> _audioChannel;
 	std::unique_ptr<cricket::VideoMediaChannel> _videoChannel;
 	std::unique_ptr<webrtc::VideoBitrateAllocatorFactory> _videoBitrateAllocatorFactory;
 	std::shared_ptr<VideoCaptureInterface> _videoCapture;
+	rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> _videoSource;
 	std::shared_ptr<rtc::VideoSinkInterface<webrtc::VideoFrame>> _currentIncomingVideoSink;
 
 	std::unique_ptr<MediaManager::NetworkInterfaceImpl> _audioNetworkInterface;
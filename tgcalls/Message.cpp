@@ -1,13 +1,34 @@
 #include "Message.h"
 
 #include "rtc_base/byte_buffer.h"
+#include "rtc_base/byte_order.h"
 #include "api/jsep_ice_candidate.h"
+#include "p2p/base/port.h"
 
 namespace tgcalls {
 namespace {
 
 constexpr auto kMaxStringLength = 65536;
 
+constexpr auto kCompactCandidatesBit = uint8_t(0x80);
+constexpr auto kCompactCandidatesVersion = uint8_t(1);
+constexpr auto kMaxShortStringLength = uint8_t(0xFE);
+constexpr auto kNumericFoundation = uint8_t(0xFF);
+
+// Indices in those lists are used on the wire, append only.
+const char *kCompactProtocols[] = {
+	cricket::UDP_PROTOCOL_NAME,
+	cricket::TCP_PROTOCOL_NAME,
+	cricket::SSLTCP_PROTOCOL_NAME,
+	cricket::TLS_PROTOCOL_NAME,
+};
+const char *kCompactTypes[] = {
+	cricket::LOCAL_PORT_TYPE,
+	cricket::STUN_PORT_TYPE,
+	cricket::PRFLX_PORT_TYPE,
+	cricket::RELAY_PORT_TYPE,
+};
+
 void Serialize(rtc::ByteBufferWriter &to, const std::string &from) {
 	assert(from.size() < kMaxStringLength);
 
@@ -90,6 +111,234 @@ bool Deserialize(cricket::Candidate &to, rtc::ByteBufferReader &from) {
 	return true;
 }
 
+template <size_t Size>
+int FindCompactIndex(const char *(&list)[Size], const std::string &value) {
+	for (auto i = 0; i != int(Size); ++i) {
+		if (value == list[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void SerializeShort(rtc::ByteBufferWriter &to, const std::string &from) {
+	assert(from.size() <= kMaxShortStringLength);
+
+	to.WriteUInt8(uint8_t(from.size()));
+	to.WriteString(from);
+}
+
+bool DeserializeShort(std::string &to, rtc::ByteBufferReader &from, uint8_t length) {
+	if (length > kMaxShortStringLength) {
+		RTC_LOG(LS_ERROR) << "Invalid short string length: " << int(length);
+		return false;
+	} else if (!from.ReadString(&to, length)) {
+		RTC_LOG(LS_ERROR) << "Could not read short string data.";
+		return false;
+	}
+	return true;
+}
+
+bool DeserializeShort(std::string &to, rtc::ByteBufferReader &from) {
+	auto length = uint8_t();
+	if (!from.ReadUInt8(&length)) {
+		RTC_LOG(LS_ERROR) << "Could not read short string length.";
+		return false;
+	}
+	return DeserializeShort(to, from, length);
+}
+
+absl::optional<uint32_t> NumericFoundation(const std::string &foundation) {
+	if (foundation.empty()
+		|| foundation.size() > 10
+		|| (foundation.size() > 1 && foundation[0] == '0')) {
+		return absl::nullopt;
+	}
+	auto result = uint64_t();
+	for (const auto ch : foundation) {
+		if (ch < '0' || ch > '9') {
+			return absl::nullopt;
+		}
+		result = result * 10 + (ch - '0');
+	}
+	return (result <= std::numeric_limits<uint32_t>::max())
+		? absl::make_optional(uint32_t(result))
+		: absl::nullopt;
+}
+
+bool IsCompactAddress(const rtc::SocketAddress &address) {
+	if (address.IsNil()) {
+		return true;
+	}
+	// Only the IP is written, so addresses that also have a hostname
+	// (resolved mDNS ones, for example) go in SDP form to keep it.
+	const auto family = address.ipaddr().family();
+	return !address.IsUnresolvedIP()
+		&& address.hostname().empty()
+		&& (family == AF_INET || family == AF_INET6);
+}
+
+void SerializeCompact(rtc::ByteBufferWriter &to, const rtc::SocketAddress &from) {
+	if (from.IsNil()) {
+		to.WriteUInt8(0);
+		return;
+	}
+	const auto &ip = from.ipaddr();
+	if (ip.family() == AF_INET) {
+		const auto value = ip.ipv4_address();
+		to.WriteUInt8(4);
+		to.WriteBytes(reinterpret_cast<const char*>(&value.s_addr), 4);
+	} else {
+		const auto value = ip.ipv6_address();
+		to.WriteUInt8(6);
+		to.WriteBytes(reinterpret_cast<const char*>(value.s6_addr), 16);
+	}
+	to.WriteUInt16(from.port());
+}
+
+bool DeserializeCompact(rtc::SocketAddress &to, rtc::ByteBufferReader &from) {
+	auto family = uint8_t();
+	if (!from.ReadUInt8(&family)) {
+		RTC_LOG(LS_ERROR) << "Could not read address family.";
+		return false;
+	}
+	auto ip = rtc::IPAddress();
+	if (family == 0) {
+		to = rtc::SocketAddress();
+		return true;
+	} else if (family == 4) {
+		auto value = in_addr();
+		if (!from.ReadBytes(reinterpret_cast<char*>(&value.s_addr), 4)) {
+			RTC_LOG(LS_ERROR) << "Could not read IPv4 address.";
+			return false;
+		}
+		ip = rtc::IPAddress(value);
+	} else if (family == 6) {
+		auto value = in6_addr();
+		if (!from.ReadBytes(reinterpret_cast<char*>(value.s6_addr), 16)) {
+			RTC_LOG(LS_ERROR) << "Could not read IPv6 address.";
+			return false;
+		}
+		ip = rtc::IPAddress(value);
+	} else {
+		RTC_LOG(LS_ERROR) << "Invalid address family: " << int(family);
+		return false;
+	}
+	auto port = uint16_t();
+	if (!from.ReadUInt16(&port)) {
+		RTC_LOG(LS_ERROR) << "Could not read port.";
+		return false;
+	}
+	to = rtc::SocketAddress(ip, port);
+	return true;
+}
+
+bool IsCompactCandidate(const cricket::Candidate &candidate) {
+	return (candidate.component() >= 0)
+		&& (candidate.component() <= std::numeric_limits<uint8_t>::max())
+		&& (FindCompactIndex(kCompactProtocols, candidate.protocol()) >= 0)
+		&& (FindCompactIndex(kCompactTypes, candidate.type()) >= 0)
+		&& IsCompactAddress(candidate.address())
+		&& IsCompactAddress(candidate.related_address())
+		&& (candidate.foundation().size() <= kMaxShortStringLength)
+		&& (candidate.username().size() <= kMaxShortStringLength)
+		&& (candidate.tcptype().size() <= kMaxShortStringLength);
+}
+
+void SerializeCompact(rtc::ByteBufferWriter &to, const cricket::Candidate &from) {
+	assert(IsCompactCandidate(from));
+
+	to.WriteUInt8(uint8_t(from.component()));
+	to.WriteUInt8(uint8_t(FindCompactIndex(kCompactProtocols, from.protocol())));
+	to.WriteUInt8(uint8_t(FindCompactIndex(kCompactTypes, from.type())));
+	to.WriteUInt32(from.priority());
+	SerializeCompact(to, from.address());
+	SerializeCompact(to, from.related_address());
+	if (const auto numeric = NumericFoundation(from.foundation())) {
+		to.WriteUInt8(kNumericFoundation);
+		to.WriteUInt32(*numeric);
+	} else {
+		SerializeShort(to, from.foundation());
+	}
+	SerializeShort(to, from.username());
+	SerializeShort(to, from.tcptype());
+	to.WriteUInt32(from.generation());
+	to.WriteUInt16(from.network_id());
+	to.WriteUInt16(from.network_cost());
+}
+
+bool DeserializeCompact(cricket::Candidate &to, rtc::ByteBufferReader &from) {
+	auto component = uint8_t();
+	auto protocol = uint8_t();
+	auto type = uint8_t();
+	auto priority = uint32_t();
+	if (!from.ReadUInt8(&component)
+		|| !from.ReadUInt8(&protocol)
+		|| !from.ReadUInt8(&type)
+		|| !from.ReadUInt32(&priority)) {
+		RTC_LOG(LS_ERROR) << "Could not read candidate fields.";
+		return false;
+	} else if (protocol >= (sizeof(kCompactProtocols) / sizeof(kCompactProtocols[0]))) {
+		RTC_LOG(LS_ERROR) << "Invalid candidate protocol: " << int(protocol);
+		return false;
+	} else if (type >= (sizeof(kCompactTypes) / sizeof(kCompactTypes[0]))) {
+		RTC_LOG(LS_ERROR) << "Invalid candidate type: " << int(type);
+		return false;
+	}
+	to.set_component(component);
+	to.set_protocol(kCompactProtocols[protocol]);
+	to.set_type(kCompactTypes[type]);
+	to.set_priority(priority);
+
+	auto address = rtc::SocketAddress();
+	auto relatedAddress = rtc::SocketAddress();
+	if (!DeserializeCompact(address, from)
+		|| !DeserializeCompact(relatedAddress, from)) {
+		RTC_LOG(LS_ERROR) << "Could not read candidate address.";
+		return false;
+	}
+	to.set_address(address);
+	to.set_related_address(relatedAddress);
+
+	auto foundationLength = uint8_t();
+	auto foundation = std::string();
+	if (!from.ReadUInt8(&foundationLength)) {
+		RTC_LOG(LS_ERROR) << "Could not read candidate foundation.";
+		return false;
+	} else if (foundationLength == kNumericFoundation) {
+		auto value = uint32_t();
+		if (!from.ReadUInt32(&value)) {
+			RTC_LOG(LS_ERROR) << "Could not read numeric candidate foundation.";
+			return false;
+		}
+		foundation = std::to_string(value);
+	} else if (!DeserializeShort(foundation, from, foundationLength)) {
+		RTC_LOG(LS_ERROR) << "Could not read candidate foundation.";
+		return false;
+	}
+	to.set_foundation(foundation);
+
+	auto username = std::string();
+	auto tcptype = std::string();
+	auto generation = uint32_t();
+	auto networkId = uint16_t();
+	auto networkCost = uint16_t();
+	if (!DeserializeShort(username, from)
+		|| !DeserializeShort(tcptype, from)
+		|| !from.ReadUInt32(&generation)
+		|| !from.ReadUInt16(&networkId)
+		|| !from.ReadUInt16(&networkCost)) {
+		RTC_LOG(LS_ERROR) << "Could not read candidate fields.";
+		return false;
+	}
+	to.set_username(username);
+	to.set_tcptype(tcptype);
+	to.set_generation(generation);
+	to.set_network_id(networkId);
+	to.set_network_cost(networkCost);
+	return true;
+}
+
 void Serialize(rtc::ByteBufferWriter &to, const RequestVideoMessage &from, bool singleMessagePacket) {
 }
 
@@ -112,7 +361,22 @@ bool Deserialize(RemoteVideoIsActiveMessage &to, rtc::ByteBufferReader &reader,
 }
 
 void Serialize(rtc::ByteBufferWriter &to, const CandidatesListMessage &from, bool singleMessagePacket) {
-	assert(from.candidates.size() < std::numeric_limits<uint8_t>::max());
+	const auto compact = from.compact
+		&& std::all_of(
+			from.candidates.begin(),
+			from.candidates.end(),
+			IsCompactCandidate);
+	if (compact) {
+		assert(from.candidates.size() < kCompactCandidatesBit);
+
+		to.WriteUInt8(kCompactCandidatesBit | uint8_t(from.candidates.size()));
+		to.WriteUInt8(kCompactCandidatesVersion);
+		for (const auto &candidate : from.candidates) {
+			SerializeCompact(to, candidate);
+		}
+		return;
+	}
+	assert(from.candidates.size() < kCompactCandidatesBit);
 
 	to.WriteUInt8(uint8_t(from.candidates.size()));
 	for (const auto &candidate : from.candidates) {
@@ -126,9 +390,24 @@ bool Deserialize(CandidatesListMessage &to, rtc::ByteBufferReader &reader, bool
 		RTC_LOG(LS_ERROR) << "Could not read candidates count.";
 		return false;
 	}
+	to.compact = (count & kCompactCandidatesBit) != 0;
+	count &= ~kCompactCandidatesBit;
+	if (to.compact) {
+		auto version = uint8_t();
+		if (!reader.ReadUInt8(&version)) {
+			RTC_LOG(LS_ERROR) << "Could not read compact candidates version.";
+			return false;
+		} else if (version != kCompactCandidatesVersion) {
+			RTC_LOG(LS_ERROR) << "Unsupported compact candidates version: " << int(version);
+			return false;
+		}
+	}
 	for (uint32_t i = 0; i != count; ++i) {
 		auto candidate = cricket::Candidate();
-		if (!Deserialize(candidate, reader)) {
+		const auto success = to.compact
+			? DeserializeCompact(candidate, reader)
+			: Deserialize(candidate, reader);
+		if (!success) {
 			RTC_LOG(LS_ERROR) << "Could not read candidate.";
 			return false;
 		}
@@ -174,108 +453,178 @@ bool Deserialize(VideoFormatsMessage &to, rtc::ByteBufferReader &from, bool sing
 	return true;
 }
 
-void Serialize(rtc::ByteBufferWriter &to, const rtc::CopyOnWriteBuffer &from, bool singleMessagePacket) {
+void SerializeInto(rtc::CopyOnWriteBuffer &to, const rtc::CopyOnWriteBuffer &from, bool singleMessagePacket) {
 	if (!singleMessagePacket) {
 		assert(from.size() <= UINT16_MAX);
-		to.WriteUInt16(from.size());
+		const auto length = rtc::HostToNetwork16(uint16_t(from.size()));
+		to.AppendData(reinterpret_cast<const char*>(&length), sizeof(length));
 	}
-	to.WriteBytes(reinterpret_cast<const char*>(from.cdata()), from.size());
+	to.AppendData(from);
 }
 
-bool Deserialize(rtc::CopyOnWriteBuffer &to, rtc::ByteBufferReader &from, bool singleMessagePacket) {
-	auto length = uint16_t(from.Length());
+bool Deserialize(
+		rtc::CopyOnWriteBuffer &to,
+		rtc::ByteBufferReader &from,
+		bool singleMessagePacket,
+		const rtc::CopyOnWriteBuffer *source) {
+	auto length = from.Length();
 	if (!singleMessagePacket) {
-		if (!from.ReadUInt16(&length)) {
+		auto value = uint16_t();
+		if (!from.ReadUInt16(&value)) {
 			RTC_LOG(LS_ERROR) << "Could not read buffer length.";
 			return false;
-		} else if (from.Length() < length) {
-			RTC_LOG(LS_ERROR) << "Invalid buffer length: " << length << ", available: " << from.Length();
+		} else if (from.Length() < value) {
+			RTC_LOG(LS_ERROR) << "Invalid buffer length: " << value << ", available: " << from.Length();
 			return false;
 		}
+		length = value;
+	}
+	if (source) {
+		// Share the decrypted packet memory instead of copying the payload.
+		const auto offset = size_t(from.Data() - source->cdata<char>());
+		assert(offset + length <= source->size());
+		to = source->Slice(offset, length);
+	} else {
+		to.AppendData(from.Data(), length);
 	}
-	to.AppendData(from.Data(), length);
 	from.Consume(length);
 	return true;
 }
 
-void Serialize(rtc::ByteBufferWriter &to, const AudioDataMessage &from, bool singleMessagePacket) {
-	Serialize(to, from.data, singleMessagePacket);
+void SerializeInto(rtc::CopyOnWriteBuffer &to, const AudioDataMessage &from, bool singleMessagePacket) {
+	SerializeInto(to, from.data, singleMessagePacket);
 }
 
-bool Deserialize(AudioDataMessage &to, rtc::ByteBufferReader &from, bool singleMessagePacket) {
-	return Deserialize(to.data, from, singleMessagePacket);
+bool Deserialize(AudioDataMessage &to, rtc::ByteBufferReader &from, bool singleMessagePacket, const rtc::CopyOnWriteBuffer *source) {
+	return Deserialize(to.data, from, singleMessagePacket, source);
 }
 
-void Serialize(rtc::ByteBufferWriter &to, const VideoDataMessage &from, bool singleMessagePacket) {
-	Serialize(to, from.data, singleMessagePacket);
+void SerializeInto(rtc::CopyOnWriteBuffer &to, const VideoDataMessage &from, bool singleMessagePacket) {
+	SerializeInto(to, from.data, singleMessagePacket);
 }
 
-bool Deserialize(VideoDataMessage &to, rtc::ByteBufferReader &from, bool singleMessagePacket) {
-	return Deserialize(to.data, from, singleMessagePacket);
+bool Deserialize(VideoDataMessage &to, rtc::ByteBufferReader &from, bool singleMessagePacket, const rtc::CopyOnWriteBuffer *source) {
+	return Deserialize(to.data, from, singleMessagePacket, source);
 }
 
-void Serialize(rtc::ByteBufferWriter &to, const UnstructuredDataMessage &from, bool singleMessagePacket) {
-    Serialize(to, from.data, singleMessagePacket);
+void SerializeInto(rtc::CopyOnWriteBuffer &to, const UnstructuredDataMessage &from, bool singleMessagePacket) {
+	SerializeInto(to, from.data, singleMessagePacket);
 }
 
-bool Deserialize(UnstructuredDataMessage &to, rtc::ByteBufferReader &from, bool singleMessagePacket) {
-    return Deserialize(to.data, from, singleMessagePacket);
+bool Deserialize(UnstructuredDataMessage &to, rtc::ByteBufferReader &from, bool singleMessagePacket, const rtc::CopyOnWriteBuffer *source) {
+	return Deserialize(to.data, from, singleMessagePacket, source);
 }
 
-template <typename T>
-bool TryDeserialize(
-		absl::optional<Message> &to,
-		rtc::ByteBufferReader &reader,
-		bool singleMessagePacket) {
-	assert(reader.Length() != 0);
+void Serialize(rtc::ByteBufferWriter &to, const CapabilitiesMessage &from, bool singleMessagePacket) {
+	to.WriteUInt32(from.capabilities);
+}
 
-	constexpr auto id = T::kId;
-	if (uint8_t(*reader.Data()) != id) {
+bool Deserialize(CapabilitiesMessage &to, rtc::ByteBufferReader &reader, bool singleMessagePacket) {
+	if (!reader.ReadUInt32(&to.capabilities)) {
+		RTC_LOG(LS_ERROR) << "Could not read capabilities.";
 		return false;
 	}
-	reader.Consume(1);
-	auto parsed = T();
-	if (!Deserialize(parsed, reader, singleMessagePacket)) {
-		RTC_LOG(LS_ERROR) << "Could not read message with kId: " << id;
+	if (singleMessagePacket) {
+		// Newer peers may append more data here.
+		reader.Consume(reader.Length());
+	}
+	return true;
+}
+
+void Serialize(rtc::ByteBufferWriter &to, const PathMtuProbeMessage &from, bool singleMessagePacket) {
+	to.WriteUInt16(from.size);
+	to.WriteUInt8(from.reply ? 1 : 0);
+}
+
+bool Deserialize(PathMtuProbeMessage &to, rtc::ByteBufferReader &reader, bool singleMessagePacket) {
+	auto reply = uint8_t();
+	if (!reader.ReadUInt16(&to.size) || !reader.ReadUInt8(&reply)) {
+		RTC_LOG(LS_ERROR) << "Could not read path MTU probe.";
 		return false;
 	}
-	to = Message{ parsed };
+	to.reply = (reply != 0);
+	if (singleMessagePacket) {
+		// Skip the padding.
+		reader.Consume(reader.Length());
+	}
 	return true;
 }
 
-template <typename ...Types>
-struct TryDeserializeNext;
-
-template <>
-struct TryDeserializeNext<> {
-	static bool Call(
-			absl::optional<Message> &to,
-			rtc::ByteBufferReader &reader,
-			bool singleMessagePacket) {
+template <typename T>
+void SerializeInto(rtc::CopyOnWriteBuffer &to, const T &from, bool singleMessagePacket) {
+	rtc::ByteBufferWriter writer;
+	Serialize(writer, from, singleMessagePacket);
+	to.AppendData(writer.Data(), writer.Length());
+}
+
+template <typename T>
+bool Deserialize(T &to, rtc::ByteBufferReader &from, bool singleMessagePacket, const rtc::CopyOnWriteBuffer *source) {
+	return Deserialize(to, from, singleMessagePacket);
+}
+
+using DeserializeMethod = bool(*)(
+	absl::optional<Message> &to,
+	rtc::ByteBufferReader &reader,
+	bool singleMessagePacket,
+	const rtc::CopyOnWriteBuffer *source);
+
+template <typename T>
+bool DeserializeTyped(
+		absl::optional<Message> &to,
+		rtc::ByteBufferReader &reader,
+		bool singleMessagePacket,
+		const rtc::CopyOnWriteBuffer *source) {
+	auto parsed = T();
+	if (!Deserialize(parsed, reader, singleMessagePacket, source)) {
+		RTC_LOG(LS_ERROR) << "Could not read message with kId: " << int(T::kId);
 		return false;
 	}
+	to = Message{ std::move(parsed) };
+	return true;
+}
+
+struct DeserializeTable {
+	DeserializeMethod methods[256] = { nullptr };
 };
 
-template <typename T, typename ...Other>
-struct TryDeserializeNext<T, Other...> {
-	static bool Call(
-			absl::optional<Message> &to,
-			rtc::ByteBufferReader &reader,
-			bool singleMessagePacket) {
-		return TryDeserialize<T>(to, reader, singleMessagePacket)
-			|| TryDeserializeNext<Other...>::Call(to, reader, singleMessagePacket);
+template <typename ...Types>
+constexpr bool MessageIdsAreUnique(absl::variant<Types...> *) {
+	const uint8_t ids[] = { Types::kId... };
+	for (auto i = size_t(); i != sizeof...(Types); ++i) {
+		for (auto j = i + 1; j != sizeof...(Types); ++j) {
+			if (ids[i] == ids[j]) {
+				return false;
+			}
+		}
 	}
-};
+	return true;
+}
 
 template <typename ...Types>
-bool TryDeserializeRecursive(
-		absl::optional<Message> &to,
-		rtc::ByteBufferReader &reader,
-		bool singleMessagePacket,
-		absl::variant<Types...> *) {
-	return TryDeserializeNext<Types...>::Call(to, reader, singleMessagePacket);
+constexpr DeserializeTable MakeDeserializeTable(absl::variant<Types...> *) {
+	const uint8_t ids[] = { Types::kId... };
+	const DeserializeMethod methods[] = { &DeserializeTyped<Types>... };
+	auto result = DeserializeTable();
+	for (auto i = size_t(); i != sizeof...(Types); ++i) {
+		result.methods[ids[i]] = methods[i];
+	}
+	return result;
+}
+
+template <typename ...Types>
+uint8_t MessageTypeIdByIndex(const absl::variant<Types...> &data) {
+	static constexpr uint8_t kIds[] = { Types::kId... };
+	return kIds[data.index()];
 }
 
+using MessageVariant = decltype(std::declval<Message>().data);
+
+static_assert(
+	MessageIdsAreUnique((MessageVariant*)nullptr),
+	"Message kId values must be unique.");
+
+constexpr auto kDeserializeTable = MakeDeserializeTable((MessageVariant*)nullptr);
+
 } // namespace
 
 
@@ -283,30 +632,55 @@ rtc::CopyOnWriteBuffer SerializeMessageWithSeq(
 		const Message &message,
 		uint32_t seq,
 		bool singleMessagePacket) {
-	rtc::ByteBufferWriter writer;
-	writer.WriteUInt32(seq);
-	absl::visit([&](const auto &data) {
-		writer.WriteUInt8(std::decay_t<decltype(data)>::kId);
-		Serialize(writer, data, singleMessagePacket);
-	}, message.data);
-
 	auto result = rtc::CopyOnWriteBuffer();
-	result.AppendData(writer.Data(), writer.Length());
-
+	SerializeMessageWithSeq(result, message, seq, singleMessagePacket);
 	return result;
 }
 
+void SerializeMessageWithSeq(
+		rtc::CopyOnWriteBuffer &to,
+		const Message &message,
+		uint32_t seq,
+		bool singleMessagePacket) {
+	const auto bytes = rtc::HostToNetwork32(seq);
+	to.AppendData(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+	absl::visit([&](const auto &data) {
+		const auto id = std::decay_t<decltype(data)>::kId;
+		to.AppendData(&id, 1);
+		SerializeInto(to, data, singleMessagePacket);
+	}, message.data);
+}
+
 absl::optional<Message> DeserializeMessage(
 		rtc::ByteBufferReader &reader,
 		bool singleMessagePacket) {
+	return DeserializeMessage(reader, singleMessagePacket, nullptr);
+}
+
+absl::optional<Message> DeserializeMessage(
+		rtc::ByteBufferReader &reader,
+		bool singleMessagePacket,
+		const rtc::CopyOnWriteBuffer *source) {
 	if (!reader.Length()) {
 		return absl::nullopt;
 	}
-	using Variant = decltype(std::declval<Message>().data);
-	auto result = absl::make_optional<Message>();
-	return TryDeserializeRecursive(result, reader, singleMessagePacket, (Variant*)nullptr)
+	const auto method = kDeserializeTable.methods[uint8_t(*reader.Data())];
+	if (!method) {
+		return absl::nullopt;
+	}
+	reader.Consume(1);
+	auto result = absl::optional<Message>();
+	return method(result, reader, singleMessagePacket, source)
 		? result
 		: absl::nullopt;
 }
 
+uint8_t MessageTypeId(const Message &message) {
+	return MessageTypeIdByIndex(message.data);
+}
+
+std::vector<uint8_t> ToBytes(const rtc::CopyOnWriteBuffer &buffer) {
+	return std::vector<uint8_t>(buffer.cdata(), buffer.cdata() + buffer.size());
+}
+
 } // namespace tgcalls
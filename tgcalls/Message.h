@@ -12,11 +12,39 @@
 
 namespace tgcalls {
 
+// Optional protocol features, advertised to the peer in CapabilitiesMessage.
+// A feature is used only after the peer advertised it as well.
+constexpr auto kCapabilityCompactCandidates = (uint32_t(1) << 0);
+constexpr auto kCapabilityTransportAead = (uint32_t(1) << 1);
+constexpr auto kCapabilityAckRanges = (uint32_t(1) << 2);
+constexpr auto kCapabilityPathMtuProbe = (uint32_t(1) << 3);
+constexpr auto kCapabilityRtpHeaderCompression = (uint32_t(1) << 4);
+
+constexpr auto kSupportedCapabilities = kCapabilityCompactCandidates
+	| kCapabilityTransportAead
+	| kCapabilityAckRanges
+	| kCapabilityPathMtuProbe
+	| kCapabilityRtpHeaderCompression;
+
+// Fixed media SSRCs, known to both sides of the call.
+constexpr uint32_t ssrcAudioIncoming = 1;
+constexpr uint32_t ssrcAudioOutgoing = 2;
+constexpr uint32_t ssrcAudioFecIncoming = 5;
+constexpr uint32_t ssrcAudioFecOutgoing = 6;
+constexpr uint32_t ssrcVideoIncoming = 3;
+constexpr uint32_t ssrcVideoOutgoing = 4;
+constexpr uint32_t ssrcVideoFecIncoming = 7;
+constexpr uint32_t ssrcVideoFecOutgoing = 8;
+
 struct CandidatesListMessage {
 	static constexpr uint8_t kId = 1;
 	static constexpr bool kRequiresAck = true;
 
 	std::vector<cricket::Candidate> candidates;
+
+	// Binary candidates encoding instead of SDP strings,
+	// requires kCapabilityCompactCandidates from the peer.
+	bool compact = false;
 };
 
 struct VideoFormatsMessage {
@@ -60,10 +88,31 @@ struct UnstructuredDataMessage {
     rtc::CopyOnWriteBuffer data;
 };
 
+struct CapabilitiesMessage {
+	static constexpr uint8_t kId = 8;
+
+	// Peers that don't know this message just drop it,
+	// so it can't block the queue of messages requiring ack.
+	static constexpr bool kRequiresAck = false;
+
+	uint32_t capabilities = 0;
+};
+
+struct PathMtuProbeMessage {
+	static constexpr uint8_t kId = 9;
+	static constexpr bool kRequiresAck = false;
+
+	// Probes are padded up to 'size' bytes of the encrypted packet,
+	// replies are small and only repeat the size.
+	uint16_t size = 0;
+	bool reply = false;
+};
+
 // To add a new message you should:
 // 1. Add the message struct.
 // 2. Add the message to the variant in Message struct.
 // 3. Add Serialize/Deserialize methods in Message module.
+// Message kId values must be unique, that is checked at compile time.
 
 struct Message {
 	absl::variant<
@@ -73,17 +122,40 @@ struct Message {
         RemoteVideoIsActiveMessage,
 		AudioDataMessage,
 		VideoDataMessage,
-        UnstructuredDataMessage> data;
+        UnstructuredDataMessage,
+		CapabilitiesMessage,
+		PathMtuProbeMessage> data;
 };
 
 rtc::CopyOnWriteBuffer SerializeMessageWithSeq(
 	const Message &message,
 	uint32_t seq,
 	bool singleMessagePacket);
+
+// Appends seq, type and message data right to the end of the given buffer,
+// so that a packet can be assembled without intermediate copies.
+void SerializeMessageWithSeq(
+	rtc::CopyOnWriteBuffer &to,
+	const Message &message,
+	uint32_t seq,
+	bool singleMessagePacket);
 absl::optional<Message> DeserializeMessage(
 	rtc::ByteBufferReader &reader,
 	bool singleMessagePacket);
 
+// If the reader points into the source buffer, data message payloads are
+// taken as slices of the source buffer, without copying.
+absl::optional<Message> DeserializeMessage(
+	rtc::ByteBufferReader &reader,
+	bool singleMessagePacket,
+	const rtc::CopyOnWriteBuffer *source);
+
+// Returns kId of the held message type, so that handlers can switch on it.
+uint8_t MessageTypeId(const Message &message);
+
+// Prepared packets are emitted to the app as plain bytes.
+std::vector<uint8_t> ToBytes(const rtc::CopyOnWriteBuffer &buffer);
+
 struct DecryptedMessage {
 	Message message;
 	uint32_t counter = 0;
@@ -1,15 +1,20 @@
 #include "NetworkManager.h"
 
 #include "Message.h"
+#include "TransportCounters.h"
+#include "BatchedPacketSocketFactory.h"
 
 #include "p2p/base/basic_packet_socket_factory.h"
 #include "p2p/client/basic_port_allocator.h"
 #include "p2p/base/p2p_transport_channel.h"
+#include "p2p/base/connection.h"
 #include "p2p/base/basic_async_resolver_factory.h"
 #include "api/packet_socket_factory.h"
 #include "rtc_base/task_utils/to_queued_task.h"
 #include "p2p/base/ice_credentials_iterator.h"
 #include "api/jsep_ice_candidate.h"
+#include "rtc_base/network_route.h"
+#include "rtc_base/time_utils.h"
 
 extern "C" {
 #include <openssl/sha.h>
@@ -19,13 +24,92 @@ extern "C" {
 #include <openssl/crypto.h>
 } // extern "C"
 
+#include <algorithm>
+
 namespace tgcalls {
+namespace {
+
+// Keeps each CandidatesListMessage well below the signaling packet limit
+// even with SDP encoded candidates.
+constexpr auto kMaxCandidatesInMessage = 16;
+
+// Outer packet sizes to probe, ascending. The default limit is probed
+// first, the smallest one is assumed to always work. All probes are sent
+// with the don't fragment bit set, so that a probe fragmented on the way
+// doesn't pass for a working size.
+constexpr uint16_t kPathMtuLadder[] = { 1200, 1280, 1360, 1400, 1452, 1472 };
+constexpr auto kPathMtuDefaultIndex = 4;
+constexpr auto kPathMtuLadderSize = int(sizeof(kPathMtuLadder) / sizeof(kPathMtuLadder[0]));
+constexpr auto kPathMtuProbeAttempts = 3;
+constexpr auto kPathMtuProbeMinTimeoutMs = 200;
+constexpr auto kPathMtuProbeDefaultTimeoutMs = 1000;
+
+// Headers around our packets on the wire. Max seen TURN overhead is
+// around 36, IPv6 is assumed until we know the route.
+constexpr auto kIpv6HeaderSize = 40;
+constexpr auto kUdpHeaderSize = 8;
+constexpr auto kTurnOverhead = 36;
+
+// Opus sends a frame every 120 ms (opusPTimeMs in MediaManager), so two
+// frames are bundled by holding the first one until the next arrives,
+// with some slack for jitter. That adds up to 140 ms to the audio delay,
+// so it is done only while the one way delay stays within 400 ms, the
+// limit ITU-T G.114 gives for conversation.
+constexpr auto kAudioBundleMessages = 2;
+constexpr auto kAudioBundleMaxHoldMs = 120 + 20;
+constexpr auto kAudioBundleMaxOneWayDelayMs = 400;
+
+// Video is paced at this multiple of the send bandwidth estimate,
+// so that a keyframe drains quickly without bursting ahead of audio.
+constexpr auto kPacingFactor = 2.5;
+constexpr auto kPacingIntervalMs = 5;
+constexpr auto kPacingBurstMs = 20;
+constexpr auto kPacingMinBurst = 1500.;
+
+// Queued longer than that is dropped instead of sent late,
+// FEC first as it only helps fresh frames.
+constexpr auto kMaxVideoFecQueueDelayMs = 100;
+constexpr auto kMaxVideoRetransmissionQueueDelayMs = 200;
+constexpr auto kMaxVideoQueueDelayMs = 400;
+
+bool IsRtcpPacket(const rtc::CopyOnWriteBuffer &packet) {
+	// RTCP packet types are 192..223 (RFC 5761).
+	return (packet.size() >= 2)
+		&& (packet.cdata()[1] >= 192)
+		&& (packet.cdata()[1] <= 223);
+}
+
+uint16_t ReadRtpSequenceNumber(const rtc::CopyOnWriteBuffer &packet) {
+	const auto data = packet.cdata() + 2;
+	return (uint16_t(data[0]) << 8) | uint16_t(data[1]);
+}
+
+uint32_t ReadRtpSsrc(const rtc::CopyOnWriteBuffer &packet) {
+	if (packet.size() < 12) {
+		return 0;
+	}
+	const auto data = packet.cdata() + 8;
+	return (uint32_t(data[0]) << 24)
+		| (uint32_t(data[1]) << 16)
+		| (uint32_t(data[2]) << 8)
+		| uint32_t(data[3]);
+}
+
+bool SameCandidateAddress(const cricket::Candidate &a, const cricket::Candidate &b) {
+	return (a.address() == b.address()) && (a.protocol() == b.protocol());
+}
+
+} // namespace
 
 NetworkManager::NetworkManager(
 	rtc::Thread *thread,
+	rtc::PhysicalSocketServer *socketServer,
 	EncryptionKey encryptionKey,
 	bool enableP2P,
 	std::vector<RtcServer> const &rtcServers,
+	int candidatesCoalesceMs,
+	std::shared_ptr<TransportCounters> counters,
+	std::shared_ptr<TraceRecorder> trace,
 	std::function<void(const NetworkManager::State &)> stateUpdated,
 	std::function<void(DecryptedMessage &&)> transportMessageReceived,
 	std::function<void(Message &&)> sendSignalingMessage,
@@ -38,10 +122,15 @@ _transport(
 _isOutgoing(encryptionKey.isOutgoing),
 _stateUpdated(std::move(stateUpdated)),
 _transportMessageReceived(std::move(transportMessageReceived)),
-_sendSignalingMessage(std::move(sendSignalingMessage)) {
+_sendSignalingMessage(std::move(sendSignalingMessage)),
+_candidatesCoalesceMs(candidatesCoalesceMs),
+_counters(std::move(counters)) {
 	assert(_thread->IsCurrent());
 
-	_socketFactory.reset(new rtc::BasicPacketSocketFactory(_thread));
+	_transport.setCounters(_counters);
+	_transport.setTrace(std::move(trace));
+
+	_socketFactory.reset(new BatchedPacketSocketFactory(_thread, socketServer));
 
 	_networkManager = std::make_unique<rtc::BasicNetworkManager>();
 	_portAllocator.reset(new cricket::BasicPortAllocator(_networkManager.get(), _socketFactory.get(), nullptr, nullptr));
@@ -110,6 +199,7 @@ _sendSignalingMessage(std::move(sendSignalingMessage)) {
 	_transportChannel->SignalGatheringState.connect(this, &NetworkManager::candidateGatheringState);
 	_transportChannel->SignalIceTransportStateChanged.connect(this, &NetworkManager::transportStateChanged);
 	_transportChannel->SignalReadPacket.connect(this, &NetworkManager::transportPacketReceived);
+	_transportChannel->SignalNetworkRouteChanged.connect(this, &NetworkManager::transportRouteChanged);
 
 	_transportChannel->MaybeStartGathering();
 
@@ -136,10 +226,107 @@ void NetworkManager::receiveSignalingMessage(DecryptedMessage &&message) {
 	}
 }
 
-uint32_t NetworkManager::sendMessage(const Message &message) {
+void NetworkManager::setPeerCapabilities(uint32_t capabilities) {
+	assert(_thread->IsCurrent());
+
+	_transport.setPeerCapabilities(capabilities);
+
+	const auto hadPathMtuProbe = (_peerCapabilities & kCapabilityPathMtuProbe) != 0;
+	_peerCapabilities = capabilities;
+	if (!hadPathMtuProbe && _hasRoute) {
+		startPathMtuDiscovery();
+	}
+}
+
+void NetworkManager::setAudioBundling(bool enabled) {
+	assert(_thread->IsCurrent());
+
+	_audioBundling = enabled;
+	if (!_audioBundling) {
+		flushAudioBundle();
+	}
+}
+
+void NetworkManager::setSendBandwidth(int bandwidth) {
+	assert(_thread->IsCurrent());
+
+	refillPacingBudget(rtc::TimeMillis());
+	_pacingRate = (bandwidth > 0) ? (bandwidth * kPacingFactor) : 0.;
+	processPacedQueues();
+}
+
+void NetworkManager::setMediaMessageReceived(std::function<void(DecryptedMessage &&)> callback) {
+	assert(_thread->IsCurrent());
+
+	_mediaMessageReceived = std::move(callback);
+}
+
+void NetworkManager::setMediaPacketsSent(std::function<void(std::vector<rtc::SentPacket> &&)> callback) {
+	assert(_thread->IsCurrent());
+
+	_mediaPacketsSent = std::move(callback);
+}
+
+uint32_t NetworkManager::sendMessage(const Message &message, const rtc::SentPacket &sentPacket) {
+	if (absl::holds_alternative<AudioDataMessage>(message.data)) {
+		if (_audioBundling && audioBundleFitsDelay()) {
+			holdAudioMessage(message, sentPacket);
+			return 0;
+		}
+		// Not ahead of the audio held before.
+		flushAudioBundle();
+	}
+	// Computed even without pacing, to keep track of the sequence numbers.
+	const auto priority = computeSendPriority(message);
+	if (_pacingRate > 0.
+		&& priority != SendPriority::Control
+		&& priority != SendPriority::Audio) {
+		auto &queue = (priority == SendPriority::VideoRetransmission)
+			? _videoRetransmissionQueue
+			: (priority == SendPriority::Video)
+			? _videoQueue
+			: _videoFecQueue;
+		queue.push_back({ message, rtc::TimeMillis(), sentPacket });
+		processPacedQueues();
+		return 0;
+	}
+	const auto result = sendMessageNow(message);
+	reportMediaPacketSent(sentPacket);
+	return result;
+}
+
+void NetworkManager::reportMediaPacketSent(rtc::SentPacket sentPacket) {
+	if (sentPacket.packet_id < 0 || !_mediaPacketsSent) {
+		return;
+	}
+	sentPacket.send_time_ms = rtc::TimeMillis();
+	_mediaPacketsSentPending.push_back(sentPacket);
+
+	// Packets sent right away are reported together after the whole
+	// batch of messages from the media thread is processed.
+	if (!_mediaPacketsSentFlushScheduled) {
+		_mediaPacketsSentFlushScheduled = true;
+		_thread->PostTask(RTC_FROM_HERE, [weak = std::weak_ptr<NetworkManager>(shared_from_this())] {
+			if (const auto strong = weak.lock()) {
+				strong->_mediaPacketsSentFlushScheduled = false;
+				strong->flushMediaPacketsSent();
+			}
+		});
+	}
+}
+
+void NetworkManager::flushMediaPacketsSent() {
+	if (_mediaPacketsSentPending.empty() || !_mediaPacketsSent) {
+		return;
+	}
+	auto sentPackets = std::move(_mediaPacketsSentPending);
+	_mediaPacketsSentPending.clear();
+	_mediaPacketsSent(std::move(sentPackets));
+}
+
+uint32_t NetworkManager::sendMessageNow(const Message &message) {
 	if (const auto prepared = _transport.prepareForSending(message)) {
-		rtc::PacketOptions packetOptions;
-		_transportChannel->SendPacket((const char *)prepared->bytes.data(), prepared->bytes.size(), packetOptions, 0);
+		sendPacket(prepared->bytes);
 		return prepared->counter;
 	}
 	return 0;
@@ -147,14 +334,228 @@ uint32_t NetworkManager::sendMessage(const Message &message) {
 
 void NetworkManager::sendTransportService(int cause) {
 	if (const auto prepared = _transport.prepareForSendingService(cause)) {
-		rtc::PacketOptions packetOptions;
-		_transportChannel->SendPacket((const char *)prepared->bytes.data(), prepared->bytes.size(), packetOptions, 0);
+		sendPacket(prepared->bytes);
 	}
 }
 
+void NetworkManager::sendPacket(const rtc::CopyOnWriteBuffer &bytes) {
+	rtc::PacketOptions packetOptions;
+	if (_transportChannel->SendPacket((const char *)bytes.data(), bytes.size(), packetOptions, 0) > 0
+		&& _counters) {
+		_counters->packetSent(bytes.size());
+	}
+	if (_pacingRate > 0.) {
+		// Audio and control packets are never delayed, but video yields to them.
+		refillPacingBudget(rtc::TimeMillis());
+		_pacingBudget = std::max(_pacingBudget - bytes.size(), -maxPacingBudget());
+	}
+}
+
+auto NetworkManager::computeSendPriority(const Message &message) -> SendPriority {
+	if (const auto video = absl::get_if<VideoDataMessage>(&message.data)) {
+		if (IsRtcpPacket(video->data)) {
+			return SendPriority::Control;
+		}
+		const auto ssrc = ReadRtpSsrc(video->data);
+		if (ssrc == ssrcVideoFecIncoming || ssrc == ssrcVideoFecOutgoing) {
+			return SendPriority::VideoFec;
+		} else if (!ssrc) {
+			return SendPriority::Video;
+		}
+
+		// We don't negotiate an RTX stream, so NACKed packets are resent
+		// on the media SSRC with the sequence number they had before.
+		const auto sequenceNumber = ReadRtpSequenceNumber(video->data);
+		if (_videoLastSequenceNumber
+			&& int16_t(uint16_t(sequenceNumber - *_videoLastSequenceNumber)) <= 0) {
+			return SendPriority::VideoRetransmission;
+		}
+		_videoLastSequenceNumber = sequenceNumber;
+		return SendPriority::Video;
+	} else if (absl::holds_alternative<AudioDataMessage>(message.data)) {
+		return SendPriority::Audio;
+	}
+	return SendPriority::Control;
+}
+
+void NetworkManager::processPacedQueues() {
+	const auto now = rtc::TimeMillis();
+	dropStalePacedMessages(now);
+	if (_pacingRate <= 0.) {
+		// Pacing was turned off, send everything we have.
+		_pacingBudget = 0.;
+	} else {
+		refillPacingBudget(now);
+	}
+	while (_pacingRate <= 0. || _pacingBudget > 0.) {
+		// Retransmissions are for frames the peer is already waiting for.
+		auto &queue = !_videoRetransmissionQueue.empty()
+			? _videoRetransmissionQueue
+			: !_videoQueue.empty()
+			? _videoQueue
+			: _videoFecQueue;
+		if (queue.empty()) {
+			break;
+		}
+		const auto paced = std::move(queue.front());
+		queue.pop_front();
+		sendMessageNow(paced.message);
+		reportMediaPacketSent(paced.sentPacket);
+	}
+	flushMediaPacketsSent();
+	const auto pending = !_videoRetransmissionQueue.empty()
+		|| !_videoQueue.empty()
+		|| !_videoFecQueue.empty();
+	if (pending && !_pacingScheduled) {
+		_pacingScheduled = true;
+		_thread->PostDelayedTask(RTC_FROM_HERE, [weak = std::weak_ptr<NetworkManager>(shared_from_this())] {
+			if (const auto strong = weak.lock()) {
+				strong->_pacingScheduled = false;
+				strong->processPacedQueues();
+			}
+		}, kPacingIntervalMs);
+	}
+}
+
+void NetworkManager::dropStalePacedMessages(int64_t now) {
+	// Dropped packets are reported as sent, so that the estimator
+	// counts them as lost, as it would if a router dropped them.
+	while (!_videoFecQueue.empty()
+		&& now - _videoFecQueue.front().queued > kMaxVideoFecQueueDelayMs) {
+		reportMediaPacketSent(_videoFecQueue.front().sentPacket);
+		_videoFecQueue.pop_front();
+	}
+	while (!_videoRetransmissionQueue.empty()
+		&& now - _videoRetransmissionQueue.front().queued > kMaxVideoRetransmissionQueueDelayMs) {
+		reportMediaPacketSent(_videoRetransmissionQueue.front().sentPacket);
+		_videoRetransmissionQueue.pop_front();
+	}
+	while (!_videoQueue.empty()
+		&& now - _videoQueue.front().queued > kMaxVideoQueueDelayMs) {
+		reportMediaPacketSent(_videoQueue.front().sentPacket);
+		_videoQueue.pop_front();
+	}
+}
+
+void NetworkManager::refillPacingBudget(int64_t now) {
+	const auto elapsed = now - _pacingUpdated;
+	_pacingUpdated = now;
+	if (elapsed > 0) {
+		_pacingBudget = std::min(
+			_pacingBudget + _pacingRate * elapsed / 8000.,
+			maxPacingBudget());
+	}
+}
+
+double NetworkManager::maxPacingBudget() const {
+	return std::max(_pacingRate * kPacingBurstMs / 8000., kPacingMinBurst);
+}
+
+void NetworkManager::holdAudioMessage(const Message &message, const rtc::SentPacket &sentPacket) {
+	_audioBundleSize += absl::get<AudioDataMessage>(message.data).data.size();
+	_audioBundle.push_back(message);
+	_audioBundleSentPackets.push_back(sentPacket);
+	if (_audioBundle.size() >= kAudioBundleMessages
+		|| _audioBundleSize >= _transport.maxDataPayloadSize()) {
+		flushAudioBundle();
+	} else if (_audioBundle.size() == 1) {
+		const auto bundleId = _audioBundleId;
+		_thread->PostDelayedTask(RTC_FROM_HERE, [weak = std::weak_ptr<NetworkManager>(shared_from_this()), bundleId] {
+			const auto strong = weak.lock();
+			if (strong && strong->_audioBundleId == bundleId) {
+				strong->flushAudioBundle();
+			}
+		}, kAudioBundleMaxHoldMs);
+	}
+}
+
+void NetworkManager::flushAudioBundle() {
+	if (_audioBundle.empty()) {
+		return;
+	}
+	++_audioBundleId;
+	_audioBundleSize = 0;
+	if (_audioBundle.size() == 1) {
+		// Single message packet is a bit smaller.
+		const auto message = std::move(_audioBundle.front());
+		_audioBundle.clear();
+		if (const auto prepared = _transport.prepareForSending(message)) {
+			sendPacket(prepared->bytes);
+		}
+		reportMediaPacketSent(_audioBundleSentPackets.front());
+		_audioBundleSentPackets.clear();
+		flushMediaPacketsSent();
+		return;
+	}
+	while (!_audioBundle.empty()) {
+		const auto wasHeld = _audioBundle.size();
+		if (const auto prepared = _transport.prepareForSendingBundle(_audioBundle)) {
+			sendPacket(prepared->bytes);
+		}
+		for (auto i = _audioBundle.size(); i != wasHeld; ++i) {
+			reportMediaPacketSent(_audioBundleSentPackets.front());
+			_audioBundleSentPackets.pop_front();
+		}
+	}
+	flushMediaPacketsSent();
+}
+
+bool NetworkManager::audioBundleFitsDelay() const {
+	// Before the first RTT sample the route is assumed to be fine.
+	const auto rtt = _transport.rttEstimate();
+	return !rtt || (*rtt / 2 + kAudioBundleMaxHoldMs <= kAudioBundleMaxOneWayDelayMs);
+}
+
 void NetworkManager::candidateGathered(cricket::IceTransportInternal *transport, const cricket::Candidate &candidate) {
 	assert(_thread->IsCurrent());
-	_sendSignalingMessage({ CandidatesListMessage{ std::vector<cricket::Candidate>(1, candidate) } });
+
+	const auto same = [&](const cricket::Candidate &other) {
+		return SameCandidateAddress(candidate, other);
+	};
+	if (std::any_of(_sentCandidates.begin(), _sentCandidates.end(), same)
+		|| std::any_of(_pendingCandidates.begin(), _pendingCandidates.end(), same)) {
+		return;
+	}
+	_pendingCandidates.push_back(candidate);
+
+	// The first host and server reflexive candidates are enough
+	// to start connectivity checks, so they don't wait for the others.
+	auto flushNow = (_candidatesCoalesceMs <= 0);
+	if (candidate.type() == cricket::LOCAL_PORT_TYPE && !_hostCandidateSent) {
+		_hostCandidateSent = true;
+		flushNow = true;
+	} else if (candidate.type() == cricket::STUN_PORT_TYPE && !_stunCandidateSent) {
+		_stunCandidateSent = true;
+		flushNow = true;
+	}
+	if (flushNow) {
+		flushCandidates();
+	} else if (!_candidatesFlushScheduled) {
+		_candidatesFlushScheduled = true;
+		_thread->PostDelayedTask(RTC_FROM_HERE, [weak = std::weak_ptr<NetworkManager>(shared_from_this())] {
+			if (const auto strong = weak.lock()) {
+				strong->_candidatesFlushScheduled = false;
+				strong->flushCandidates();
+			}
+		}, _candidatesCoalesceMs);
+	}
+}
+
+void NetworkManager::flushCandidates() {
+	assert(_thread->IsCurrent());
+
+	auto from = _pendingCandidates.begin();
+	const auto till = _pendingCandidates.end();
+	while (from != till) {
+		const auto count = std::min(int(till - from), kMaxCandidatesInMessage);
+		_sendSignalingMessage({ CandidatesListMessage{ std::vector<cricket::Candidate>(from, from + count) } });
+		from += count;
+	}
+	_sentCandidates.insert(
+		_sentCandidates.end(),
+		std::make_move_iterator(_pendingCandidates.begin()),
+		std::make_move_iterator(_pendingCandidates.end()));
+	_pendingCandidates.clear();
 }
 
 void NetworkManager::candidateGatheringState(cricket::IceTransportInternal *transport) {
@@ -174,9 +575,31 @@ void NetworkManager::transportStateChanged(cricket::IceTransportInternal *transp
 		default:
 			break;
 	}
-	NetworkManager::State emitState;
-	emitState.isReadyToSendData = isConnected;
-	_stateUpdated(emitState);
+	_isConnected = isConnected;
+	emitState();
+}
+
+void NetworkManager::emitState() {
+	NetworkManager::State state;
+	state.isReadyToSendData = _isConnected;
+	state.maxDataPayloadSize = _transport.maxDataPayloadSize();
+	state.packetOverhead = _packetOverhead = computePacketOverhead();
+	_stateUpdated(state);
+}
+
+size_t NetworkManager::computePacketOverhead() const {
+	const auto connection = _transportChannel->selected_connection();
+	if (!connection) {
+		return EncryptedConnection::MaxPacketOverhead()
+			+ kIpv6HeaderSize
+			+ kUdpHeaderSize;
+	}
+	const auto &local = connection->local_candidate();
+	const auto ipHeaderSize = local.address().ipaddr().overhead();
+	return EncryptedConnection::MaxPacketOverhead()
+		+ (ipHeaderSize ? ipHeaderSize : kIpv6HeaderSize)
+		+ kUdpHeaderSize
+		+ ((local.type() == cricket::RELAY_PORT_TYPE) ? kTurnOverhead : 0);
 }
 
 void NetworkManager::transportReadyToSend(cricket::IceTransportInternal *transport) {
@@ -186,14 +609,175 @@ void NetworkManager::transportReadyToSend(cricket::IceTransportInternal *transpo
 void NetworkManager::transportPacketReceived(rtc::PacketTransportInternal *transport, const char *bytes, size_t size, const int64_t &timestamp, int unused) {
 	assert(_thread->IsCurrent());
 
+	if (_counters) {
+		_counters->packetReceived(size);
+	}
 	if (auto decrypted = _transport.handleIncomingPacket(bytes, size)) {
-		if (_transportMessageReceived) {
-			_transportMessageReceived(std::move(decrypted->main));
-			for (auto &message : decrypted->additional) {
-				_transportMessageReceived(std::move(message));
+		deliverReceivedMessage(std::move(decrypted->main));
+		for (auto &message : decrypted->additional) {
+			deliverReceivedMessage(std::move(message));
+		}
+	}
+}
+
+void NetworkManager::deliverReceivedMessage(DecryptedMessage &&message) {
+	if (handlePathMtuProbe(message)) {
+		return;
+	}
+	switch (MessageTypeId(message.message)) {
+		case AudioDataMessage::kId:
+		case VideoDataMessage::kId:
+			if (_mediaMessageReceived) {
+				_mediaMessageReceived(std::move(message));
+				return;
 			}
+			break;
+	}
+	if (_transportMessageReceived) {
+		_transportMessageReceived(std::move(message));
+	}
+}
+
+void NetworkManager::transportRouteChanged(absl::optional<rtc::NetworkRoute> route) {
+	assert(_thread->IsCurrent());
+
+	_hasRoute = route.has_value();
+	if (_hasRoute) {
+		startPathMtuDiscovery();
+	} else {
+		++_pathMtuProbeGeneration;
+		_pathMtuProbing = PathMtuProbing::None;
+		updatePathMtuDontFragment();
+	}
+	if (_packetOverhead != computePacketOverhead()) {
+		emitState();
+	}
+}
+
+bool NetworkManager::handlePathMtuProbe(const DecryptedMessage &message) {
+	const auto probe = absl::get_if<PathMtuProbeMessage>(&message.message.data);
+	if (!probe) {
+		return false;
+	} else if (!probe->reply) {
+		auto reply = PathMtuProbeMessage();
+		reply.size = probe->size;
+		reply.reply = true;
+		sendMessage({ reply });
+	} else if (_pathMtuProbing != PathMtuProbing::None
+		&& probe->size == kPathMtuLadder[_pathMtuProbeIndex]) {
+		pathMtuProbeFinished(true);
+	}
+	return true;
+}
+
+void NetworkManager::startPathMtuDiscovery() {
+	// Keep the default limit until the new path proves otherwise.
+	++_pathMtuProbeGeneration;
+	setMaxPacketSize(kPathMtuLadder[kPathMtuDefaultIndex]);
+	if (!(_peerCapabilities & kCapabilityPathMtuProbe)) {
+		_pathMtuProbing = PathMtuProbing::None;
+		updatePathMtuDontFragment();
+		return;
+	}
+	_pathMtuProbing = PathMtuProbing::Confirm;
+	_pathMtuProbeIndex = kPathMtuDefaultIndex;
+	_pathMtuProbeAttempts = 0;
+	updatePathMtuDontFragment();
+	sendPathMtuProbe();
+}
+
+void NetworkManager::sendPathMtuProbe() {
+	assert(_pathMtuProbing != PathMtuProbing::None);
+
+	++_pathMtuProbeAttempts;
+	if (const auto prepared = _transport.prepareForSendingMtuProbe(kPathMtuLadder[_pathMtuProbeIndex])) {
+		sendPacket(prepared->bytes);
+	}
+
+	const auto rtt = _transport.rttEstimate();
+	const auto timeout = rtt
+		? std::max(2 * *rtt, kPathMtuProbeMinTimeoutMs)
+		: kPathMtuProbeDefaultTimeoutMs;
+	const auto generation = _pathMtuProbeGeneration;
+	_thread->PostDelayedTask(RTC_FROM_HERE, [weak = std::weak_ptr<NetworkManager>(shared_from_this()), generation] {
+		const auto strong = weak.lock();
+		if (!strong || strong->_pathMtuProbeGeneration != generation) {
+			return;
+		} else if (strong->_pathMtuProbeAttempts < kPathMtuProbeAttempts) {
+			strong->sendPathMtuProbe();
+		} else {
+			strong->pathMtuProbeFinished(false);
+		}
+	}, timeout);
+}
+
+void NetworkManager::pathMtuProbeFinished(bool success) {
+	// Invalidate the pending timeout.
+	++_pathMtuProbeGeneration;
+	_pathMtuProbeAttempts = 0;
+
+	const auto index = _pathMtuProbeIndex;
+	if (success) {
+		setMaxPacketSize(kPathMtuLadder[index]);
+		if (_pathMtuProbing == PathMtuProbing::Down
+			|| index + 1 == kPathMtuLadderSize
+			|| !canProbeAboveDefaultPathMtu()) {
+			_pathMtuProbing = PathMtuProbing::None;
+		} else {
+			_pathMtuProbing = PathMtuProbing::Up;
+			_pathMtuProbeIndex = index + 1;
+		}
+	} else if (_pathMtuProbing == PathMtuProbing::Up) {
+		// The limit stays at the last confirmed size.
+		_pathMtuProbing = PathMtuProbing::None;
+	} else {
+		// Lost probes of the current limit, go down right away.
+		setMaxPacketSize(kPathMtuLadder[index - 1]);
+		if (index - 1 == 0) {
+			_pathMtuProbing = PathMtuProbing::None;
+		} else {
+			_pathMtuProbing = PathMtuProbing::Down;
+			_pathMtuProbeIndex = index - 1;
 		}
 	}
+	updatePathMtuDontFragment();
+	if (_pathMtuProbing != PathMtuProbing::None) {
+		sendPathMtuProbe();
+	}
+}
+
+bool NetworkManager::canProbeAboveDefaultPathMtu() const {
+#if defined(WEBRTC_LINUX) || defined(WEBRTC_WIN)
+	// A relay may fragment what it forwards, whatever we set.
+	const auto connection = _transportChannel->selected_connection();
+	return connection
+		&& connection->local_candidate().type() != cricket::RELAY_PORT_TYPE
+		&& connection->remote_candidate().type() != cricket::RELAY_PORT_TYPE;
+#else // WEBRTC_LINUX || WEBRTC_WIN
+	// The don't fragment socket option is not supported here.
+	return false;
+#endif // WEBRTC_LINUX || WEBRTC_WIN
+}
+
+void NetworkManager::updatePathMtuDontFragment() {
+	// All probes go with it, otherwise a probe fragmented on the way, for
+	// example on the leg to a TURN relay or into a VPN, passes for a
+	// working size and the fallback never fires. Cleared when probing is
+	// done, so that packets of the confirmed size still get through if
+	// the path changes under us.
+	const auto dontFragment = (_pathMtuProbing != PathMtuProbing::None);
+	if (_pathMtuDontFragment != dontFragment) {
+		_pathMtuDontFragment = dontFragment;
+		_transportChannel->SetOption(rtc::Socket::OPT_DONTFRAGMENT, dontFragment ? 1 : 0);
+	}
+}
+
+void NetworkManager::setMaxPacketSize(size_t size) {
+	const auto was = _transport.maxDataPayloadSize();
+	_transport.setMaxPacketSize(size);
+	if (_transport.maxDataPayloadSize() != was) {
+		emitState();
+	}
 }
 
 } // namespace tgcalls
@@ -8,12 +8,17 @@
 #include "Message.h"
 
 #include "rtc_base/copy_on_write_buffer.h"
+#include "rtc_base/network/sent_packet.h"
 #include "api/candidate.h"
 
 #include <functional>
 #include <memory>
+#include <deque>
+#include <vector>
 
 namespace rtc {
+struct NetworkRoute;
+class PhysicalSocketServer;
 class BasicPacketSocketFactory;
 class BasicNetworkManager;
 class PacketTransportInternal;
@@ -32,18 +37,29 @@ class BasicAsyncResolverFactory;
 namespace tgcalls {
 
 struct Message;
+class TransportCounters;
+class TraceRecorder;
 
-class NetworkManager : public sigslot::has_slots<> {
+class NetworkManager : public sigslot::has_slots<>, public std::enable_shared_from_this<NetworkManager> {
 public:
 	struct State {
 		bool isReadyToSendData = false;
+		size_t maxDataPayloadSize = 0;
+
+		// Bytes added to a data message on the wire: our packet header,
+		// IP and UDP headers, and TURN when relayed.
+		size_t packetOverhead = 0;
 	};
 
 	NetworkManager(
 		rtc::Thread *thread,
+		rtc::PhysicalSocketServer *socketServer,
 		EncryptionKey encryptionKey,
 		bool enableP2P,
 		std::vector<RtcServer> const &rtcServers,
+		int candidatesCoalesceMs,
+		std::shared_ptr<TransportCounters> counters,
+		std::shared_ptr<TraceRecorder> trace,
 		std::function<void(const State &)> stateUpdated,
 		std::function<void(DecryptedMessage &&)> transportMessageReceived,
 		std::function<void(Message &&)> sendSignalingMessage,
@@ -51,23 +67,117 @@ public:
 	~NetworkManager();
 
 	void receiveSignalingMessage(DecryptedMessage &&message);
-	uint32_t sendMessage(const Message &message);
+	void setPeerCapabilities(uint32_t capabilities);
+	void setAudioBundling(bool enabled);
+	void setSendBandwidth(int bandwidth);
+
+	// Audio and video data is passed here instead, bypassing the manager.
+	void setMediaMessageReceived(std::function<void(DecryptedMessage &&)> callback);
+
+	// Media packets are reported when they leave the queues, sent or dropped,
+	// so that the bandwidth estimator sees the real send times. The reports
+	// are collected and passed once per paced drain, bundle flush or task.
+	void setMediaPacketsSent(std::function<void(std::vector<rtc::SentPacket> &&)> callback);
+
+	uint32_t sendMessage(const Message &message, const rtc::SentPacket &sentPacket = rtc::SentPacket());
 	void sendTransportService(int cause);
 
 private:
+	enum class SendPriority {
+		Control,
+		Audio,
+		VideoRetransmission,
+		Video,
+		VideoFec,
+	};
+	struct PacedMessage {
+		Message message;
+		int64_t queued = 0;
+		rtc::SentPacket sentPacket;
+	};
+
+	SendPriority computeSendPriority(const Message &message);
+
+	uint32_t sendMessageNow(const Message &message);
+	void sendPacket(const rtc::CopyOnWriteBuffer &bytes);
+	void reportMediaPacketSent(rtc::SentPacket sentPacket);
+	void flushMediaPacketsSent();
+	void processPacedQueues();
+	void dropStalePacedMessages(int64_t now);
+	void refillPacingBudget(int64_t now);
+	double maxPacingBudget() const;
+	void holdAudioMessage(const Message &message, const rtc::SentPacket &sentPacket);
+	void flushAudioBundle();
+	bool audioBundleFitsDelay() const;
 	void candidateGathered(cricket::IceTransportInternal *transport, const cricket::Candidate &candidate);
+	void flushCandidates();
 	void candidateGatheringState(cricket::IceTransportInternal *transport);
 	void transportStateChanged(cricket::IceTransportInternal *transport);
 	void transportReadyToSend(cricket::IceTransportInternal *transport);
 	void transportPacketReceived(rtc::PacketTransportInternal *transport, const char *bytes, size_t size, const int64_t &timestamp, int unused);
+	void transportRouteChanged(absl::optional<rtc::NetworkRoute> route);
+	bool handlePathMtuProbe(const DecryptedMessage &message);
+	void deliverReceivedMessage(DecryptedMessage &&message);
+	void startPathMtuDiscovery();
+	void sendPathMtuProbe();
+	void pathMtuProbeFinished(bool success);
+	bool canProbeAboveDefaultPathMtu() const;
+	void updatePathMtuDontFragment();
+	void setMaxPacketSize(size_t size);
+	size_t computePacketOverhead() const;
+	void emitState();
 
 	rtc::Thread *_thread = nullptr;
 	EncryptedConnection _transport;
 	bool _isOutgoing = false;
 	std::function<void(const NetworkManager::State &)> _stateUpdated;
 	std::function<void(DecryptedMessage &&)> _transportMessageReceived;
+	std::function<void(DecryptedMessage &&)> _mediaMessageReceived;
+	std::function<void(std::vector<rtc::SentPacket> &&)> _mediaPacketsSent;
+	std::vector<rtc::SentPacket> _mediaPacketsSentPending;
+	bool _mediaPacketsSentFlushScheduled = false;
 	std::function<void(Message &&)> _sendSignalingMessage;
 
+	int _candidatesCoalesceMs = 0;
+	std::shared_ptr<TransportCounters> _counters;
+	std::vector<cricket::Candidate> _pendingCandidates;
+	std::vector<cricket::Candidate> _sentCandidates;
+	bool _candidatesFlushScheduled = false;
+	bool _hostCandidateSent = false;
+	bool _stunCandidateSent = false;
+
+	enum class PathMtuProbing {
+		None,
+		Confirm,
+		Up,
+		Down,
+	};
+	bool _audioBundling = false;
+	std::vector<Message> _audioBundle;
+	std::deque<rtc::SentPacket> _audioBundleSentPackets;
+	size_t _audioBundleSize = 0;
+	uint32_t _audioBundleId = 0;
+
+	// Bits per second, zero until we have a send bandwidth estimate.
+	double _pacingRate = 0.;
+	double _pacingBudget = 0.;
+	int64_t _pacingUpdated = 0;
+	bool _pacingScheduled = false;
+	std::deque<PacedMessage> _videoRetransmissionQueue;
+	std::deque<PacedMessage> _videoQueue;
+	std::deque<PacedMessage> _videoFecQueue;
+	absl::optional<uint16_t> _videoLastSequenceNumber;
+
+	uint32_t _peerCapabilities = 0;
+	bool _isConnected = false;
+	bool _hasRoute = false;
+	size_t _packetOverhead = 0;
+	PathMtuProbing _pathMtuProbing = PathMtuProbing::None;
+	int _pathMtuProbeIndex = 0;
+	bool _pathMtuDontFragment = false;
+	int _pathMtuProbeAttempts = 0;
+	uint32_t _pathMtuProbeGeneration = 0;
+
 	std::unique_ptr<rtc::BasicPacketSocketFactory> _socketFactory;
 	std::unique_ptr<rtc::BasicNetworkManager> _networkManager;
 	std::unique_ptr<cricket::BasicPortAllocator> _portAllocator;
@@ -0,0 +1,226 @@
+#include "RtpHeaderCompression.h"
+
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+
+namespace tgcalls {
+namespace {
+
+constexpr auto kRtpHeaderSize = 12;
+
+// byte 0: 00, refresh, marker, extension, 000
+// byte 1: payload type
+// byte 2: seq offset from the context base
+// byte 3: context generation
+// byte 4: CRC-8 of the original RTP header
+//   or, in refresh packets: base seq (2), base timestamp (4),
+//   timestamp stride (2)
+constexpr auto kCommonHeaderSize = 4;
+constexpr auto kCompressedHeaderSize = kCommonHeaderSize + 1;
+constexpr auto kRefreshHeaderSize = kCommonHeaderSize + 8;
+
+constexpr auto kRefreshBit = uint8_t(0x20);
+constexpr auto kMarkerBit = uint8_t(0x10);
+constexpr auto kExtensionBit = uint8_t(0x08);
+
+// Context lifetime in packets.
+constexpr auto kMaxSeqOffset = 64;
+
+// Packets to carry the full context in after it changes.
+constexpr auto kRefreshRepeat = 3;
+
+// The context is sent again at least that often, so that a receiver
+// that lost all of its refreshes resyncs soon even with long ptime.
+constexpr auto kRefreshIntervalMs = int64_t(500);
+
+// CRC-8 with polynomial x^8 + x^2 + x + 1.
+uint8_t HeaderCrc(const uint8_t *data) {
+	auto result = uint8_t(0);
+	for (auto i = 0; i != kRtpHeaderSize; ++i) {
+		result ^= data[i];
+		for (auto bit = 0; bit != 8; ++bit) {
+			result = (result & 0x80)
+				? uint8_t((result << 1) ^ 0x07)
+				: uint8_t(result << 1);
+		}
+	}
+	return result;
+}
+
+uint16_t ReadUInt16(const uint8_t *data) {
+	return uint16_t((data[0] << 8) | data[1]);
+}
+
+uint32_t ReadUInt32(const uint8_t *data) {
+	return (uint32_t(data[0]) << 24)
+		| (uint32_t(data[1]) << 16)
+		| (uint32_t(data[2]) << 8)
+		| uint32_t(data[3]);
+}
+
+uint8_t *WriteUInt16(uint8_t *data, uint16_t value) {
+	data[0] = uint8_t(value >> 8);
+	data[1] = uint8_t(value);
+	return data + 2;
+}
+
+uint8_t *WriteUInt32(uint8_t *data, uint32_t value) {
+	data[0] = uint8_t(value >> 24);
+	data[1] = uint8_t(value >> 16);
+	data[2] = uint8_t(value >> 8);
+	data[3] = uint8_t(value);
+	return data + 4;
+}
+
+} // namespace
+
+RtpHeaderCompressor::RtpHeaderCompressor(uint32_t ssrc) : _ssrc(ssrc) {
+}
+
+rtc::CopyOnWriteBuffer RtpHeaderCompressor::compress(const rtc::CopyOnWriteBuffer &packet) {
+	if (packet.size() < kRtpHeaderSize) {
+		return packet;
+	}
+	const auto header = packet.cdata();
+	const auto version = (header[0] >> 6);
+	const auto padding = (header[0] & 0x20) != 0;
+	const auto extension = (header[0] & 0x10) != 0;
+	const auto csrcCount = (header[0] & 0x0F);
+	if (version != 2 || padding || csrcCount || ReadUInt32(header + 8) != _ssrc) {
+		return packet;
+	}
+	const auto marker = (header[1] & 0x80) != 0;
+	const auto payloadType = uint8_t(header[1] & 0x7F);
+	const auto seq = ReadUInt16(header + 2);
+	const auto timestamp = ReadUInt32(header + 4);
+
+	auto offset = uint16_t(seq - _baseSeq);
+	const auto fits = _hasContext
+		&& (offset < kMaxSeqOffset)
+		&& (timestamp == _baseTimestamp + uint32_t(offset) * _stride);
+	if (!fits) {
+		startContext(seq, timestamp);
+		offset = 0;
+	}
+	_hasLast = true;
+	_lastSeq = seq;
+	_lastTimestamp = timestamp;
+
+	const auto now = rtc::TimeMillis();
+	if (!_refreshesLeft && now - _lastRefreshTime >= kRefreshIntervalMs) {
+		_refreshesLeft = 1;
+	}
+	const auto refresh = (_refreshesLeft > 0);
+	if (refresh) {
+		--_refreshesLeft;
+		_lastRefreshTime = now;
+	}
+	const auto headerSize = refresh ? kRefreshHeaderSize : kCompressedHeaderSize;
+	const auto payloadSize = packet.size() - kRtpHeaderSize;
+	auto result = rtc::CopyOnWriteBuffer(headerSize + payloadSize);
+	auto data = result.data();
+	*data++ = (refresh ? kRefreshBit : 0)
+		| (marker ? kMarkerBit : 0)
+		| (extension ? kExtensionBit : 0);
+	*data++ = payloadType;
+	*data++ = uint8_t(offset);
+	*data++ = _generation;
+	if (refresh) {
+		data = WriteUInt16(data, _baseSeq);
+		data = WriteUInt32(data, _baseTimestamp);
+		data = WriteUInt16(data, _stride);
+	} else {
+		*data++ = HeaderCrc(header);
+	}
+	memcpy(data, header + kRtpHeaderSize, payloadSize);
+	return result;
+}
+
+void RtpHeaderCompressor::startContext(uint16_t seq, uint32_t timestamp) {
+	// A timestamp jump (after silence) keeps the stride. We learn it
+	// from the previous packet only if there is none yet or if the
+	// context we started on the previous packet failed right away.
+	const auto seqDelta = uint16_t(seq - _lastSeq);
+	const auto timestampDelta = timestamp - _lastTimestamp;
+	const auto learn = !_stride || (_hasContext && _lastSeq == _baseSeq);
+	if (learn
+		&& _hasLast
+		&& seqDelta > 0
+		&& seqDelta < kMaxSeqOffset
+		&& (timestampDelta % seqDelta) == 0
+		&& (timestampDelta / seqDelta) <= 0xFFFFU) {
+		_stride = uint16_t(timestampDelta / seqDelta);
+	}
+	_hasContext = true;
+	++_generation;
+	_baseSeq = seq;
+	_baseTimestamp = timestamp;
+	_refreshesLeft = kRefreshRepeat;
+}
+
+RtpHeaderDecompressor::RtpHeaderDecompressor(uint32_t ssrc) : _ssrc(ssrc) {
+}
+
+bool RtpHeaderDecompressor::IsCompressed(const rtc::CopyOnWriteBuffer &packet) {
+	return (packet.size() >= kCommonHeaderSize)
+		&& ((packet.cdata()[0] >> 6) == 0);
+}
+
+absl::optional<rtc::CopyOnWriteBuffer> RtpHeaderDecompressor::decompress(
+		const rtc::CopyOnWriteBuffer &packet) {
+	assert(IsCompressed(packet));
+
+	const auto header = packet.cdata();
+	const auto refresh = (header[0] & kRefreshBit) != 0;
+	const auto headerSize = refresh ? kRefreshHeaderSize : kCompressedHeaderSize;
+	if (packet.size() < headerSize) {
+		RTC_LOG(LS_ERROR) << "Bad compressed RTP packet size: " << packet.size();
+		return absl::nullopt;
+	}
+	const auto generation = header[3];
+	auto baseSeq = _baseSeq;
+	auto baseTimestamp = _baseTimestamp;
+	auto stride = _stride;
+	if (refresh) {
+		baseSeq = ReadUInt16(header + 4);
+		baseTimestamp = ReadUInt32(header + 6);
+		stride = ReadUInt16(header + 10);
+
+		// A late refresh of an older context still decodes its own
+		// packet, but must not replace the current context.
+		const auto older = _hasContext
+			&& !_contextStale
+			&& (int8_t(uint8_t(generation - _generation)) < 0);
+		if (!older) {
+			_hasContext = true;
+			_contextStale = false;
+			_generation = generation;
+			_baseSeq = baseSeq;
+			_baseTimestamp = baseTimestamp;
+			_stride = stride;
+		}
+	} else if (!_hasContext || _generation != generation) {
+		// The refresh packets were lost, wait for the next context.
+		_contextStale = _hasContext;
+		return absl::nullopt;
+	}
+	const auto offset = uint16_t(header[2]);
+	const auto payloadSize = packet.size() - headerSize;
+	auto result = rtc::CopyOnWriteBuffer(kRtpHeaderSize + payloadSize);
+	auto data = result.data();
+	*data++ = uint8_t(0x80) | ((header[0] & kExtensionBit) ? 0x10 : 0);
+	*data++ = ((header[0] & kMarkerBit) ? 0x80 : 0) | (header[1] & 0x7F);
+	data = WriteUInt16(data, uint16_t(baseSeq + offset));
+	data = WriteUInt32(data, baseTimestamp + uint32_t(offset) * stride);
+	data = WriteUInt32(data, _ssrc);
+	if (!refresh && HeaderCrc(result.cdata()) != header[4]) {
+		// The generation matched a context that is gone after 256
+		// others, or the packet is corrupt, wait for the next refresh.
+		_contextStale = true;
+		return absl::nullopt;
+	}
+	memcpy(data, header + headerSize, payloadSize);
+	return result;
+}
+
+} // namespace tgcalls
@@ -0,0 +1,65 @@
+#ifndef TGCALLS_RTP_HEADER_COMPRESSION_H
+#define TGCALLS_RTP_HEADER_COMPRESSION_H
+
+#include "rtc_base/copy_on_write_buffer.h"
+#include "absl/types/optional.h"
+
+namespace tgcalls {
+
+// Compressed packets start with version bits 00, so they are told apart
+// from RTP and RTCP packets, which always have version 2.
+//
+// The fixed header of one known SSRC is replaced by a context generation,
+// a sequence number offset, the marker / payload type and a CRC of the
+// original header. The context (base seq, base timestamp and timestamp
+// stride) is sent in full in the first packets after it changes and then
+// again every kRefreshIntervalMs, so a receiver that lost it resyncs soon.
+// A packet of a context the receiver doesn't have is dropped by its
+// generation, the CRC also catches a generation that wrapped around.
+class RtpHeaderCompressor final {
+public:
+	explicit RtpHeaderCompressor(uint32_t ssrc);
+
+	// Returns the packet as is if it can't be compressed.
+	rtc::CopyOnWriteBuffer compress(const rtc::CopyOnWriteBuffer &packet);
+
+private:
+	void startContext(uint16_t seq, uint32_t timestamp);
+
+	uint32_t _ssrc = 0;
+	bool _hasContext = false;
+	uint8_t _generation = 0;
+	uint16_t _baseSeq = 0;
+	uint32_t _baseTimestamp = 0;
+	uint16_t _stride = 0;
+	int _refreshesLeft = 0;
+	int64_t _lastRefreshTime = 0;
+	bool _hasLast = false;
+	uint16_t _lastSeq = 0;
+	uint32_t _lastTimestamp = 0;
+
+};
+
+class RtpHeaderDecompressor final {
+public:
+	explicit RtpHeaderDecompressor(uint32_t ssrc);
+
+	static bool IsCompressed(const rtc::CopyOnWriteBuffer &packet);
+
+	// Returns nullopt while the context of the packet is unknown.
+	absl::optional<rtc::CopyOnWriteBuffer> decompress(const rtc::CopyOnWriteBuffer &packet);
+
+private:
+	uint32_t _ssrc = 0;
+	bool _hasContext = false;
+	bool _contextStale = false;
+	uint8_t _generation = 0;
+	uint16_t _baseSeq = 0;
+	uint32_t _baseTimestamp = 0;
+	uint16_t _stride = 0;
+
+};
+
+} // namespace tgcalls
+
+#endif
@@ -3,8 +3,14 @@
 
 #include "rtc_base/thread.h"
 
+#include <array>
+#include <atomic>
+#include <cstddef>
 #include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 namespace tgcalls {
 
@@ -25,16 +31,23 @@ public:
 
 	~ThreadLocalObject() {
 		_thread->PostTask(RTC_FROM_HERE, [valueHolder = std::move(_valueHolder)](){
+			valueHolder->drain();
 			valueHolder->_value.reset();
 		});
 	}
 
+	// Calls are queued in a lock-free list, only the first call
+	// into an empty list posts a task, which runs all of them.
 	template <typename FunctorT>
 	void perform(FunctorT &&functor) {
-		_thread->PostTask(RTC_FROM_HERE, [valueHolder = _valueHolder.get(), f = std::forward<FunctorT>(functor)]() mutable {
-			assert(valueHolder->_value != nullptr);
-			f(valueHolder->_value.get());
-		});
+		const auto valueHolder = _valueHolder.get();
+		const auto task = valueHolder->acquire();
+		Emplace(task, std::forward<FunctorT>(functor));
+		if (valueHolder->push(task)) {
+			_thread->PostTask(RTC_FROM_HERE, [valueHolder] {
+				valueHolder->drain();
+			});
+		}
 	}
 
 	T *getSyncAssumingSameThread() {
@@ -44,8 +57,121 @@ public:
 	}
 
 private:
+	// Functors up to this size, which covers the lambdas passed here,
+	// are stored in the task itself, larger ones on the heap.
+	static constexpr auto kInlineSize = size_t(96);
+
+	// Tasks are taken from this many preallocated ones while there are
+	// free ones, and allocated when more calls are in flight.
+	static constexpr auto kPoolSize = 32;
+
+	struct Task {
+		Task *next = nullptr;
+		void (*run)(void *storage, T *value) = nullptr;
+		void (*destroy)(void *storage) = nullptr;
+		alignas(std::max_align_t) unsigned char storage[kInlineSize];
+	};
+
+	template <typename FunctorT>
+	using FitsInline = std::integral_constant<
+		bool,
+		(sizeof(FunctorT) <= kInlineSize)
+			&& (alignof(FunctorT) <= alignof(std::max_align_t))>;
+
+	template <typename FunctorT>
+	static void Emplace(Task *task, FunctorT &&functor) {
+		using Functor = std::decay_t<FunctorT>;
+		Emplace<Functor>(task, std::forward<FunctorT>(functor), FitsInline<Functor>());
+	}
+
+	template <typename Functor, typename FunctorT>
+	static void Emplace(Task *task, FunctorT &&functor, std::true_type) {
+		new (task->storage) Functor(std::forward<FunctorT>(functor));
+		task->run = [](void *storage, T *value) {
+			(*static_cast<Functor*>(storage))(value);
+		};
+		task->destroy = [](void *storage) {
+			static_cast<Functor*>(storage)->~Functor();
+		};
+	}
+
+	template <typename Functor, typename FunctorT>
+	static void Emplace(Task *task, FunctorT &&functor, std::false_type) {
+		new (task->storage) Functor*(new Functor(std::forward<FunctorT>(functor)));
+		task->run = [](void *storage, T *value) {
+			(**static_cast<Functor**>(storage))(value);
+		};
+		task->destroy = [](void *storage) {
+			delete *static_cast<Functor**>(storage);
+		};
+	}
+
 	struct ValueHolder {
+		~ValueHolder() {
+			auto task = _tasks.load(std::memory_order_acquire);
+			while (task) {
+				release(std::exchange(task, task->next));
+			}
+		}
+
+		// Pool tasks are claimed with a flag each, so that any thread may
+		// take one and only the owner thread gives them back.
+		Task *acquire() {
+			const auto start = _poolHint.fetch_add(1, std::memory_order_relaxed);
+			for (auto i = 0; i != kPoolSize; ++i) {
+				const auto index = (start + i) % kPoolSize;
+				if (!_poolUsed[index].exchange(true, std::memory_order_acquire)) {
+					return &_pool[index];
+				}
+			}
+			return new Task();
+		}
+
+		void release(Task *task) {
+			task->destroy(task->storage);
+			const auto less = std::less<const Task*>();
+			if (!less(task, _pool.data()) && less(task, _pool.data() + kPoolSize)) {
+				_poolUsed[task - _pool.data()].store(false, std::memory_order_release);
+			} else {
+				delete task;
+			}
+		}
+
+		// Returns true if the list was empty.
+		bool push(Task *task) {
+			auto head = _tasks.load(std::memory_order_relaxed);
+			do {
+				task->next = head;
+			} while (!_tasks.compare_exchange_weak(
+				head,
+				task,
+				std::memory_order_release,
+				std::memory_order_relaxed));
+			return (head == nullptr);
+		}
+
+		void drain() {
+			// The list is in reverse order of pushing.
+			auto task = _tasks.exchange(nullptr, std::memory_order_acquire);
+			auto ordered = (Task*)nullptr;
+			while (task) {
+				const auto next = task->next;
+				task->next = ordered;
+				ordered = task;
+				task = next;
+			}
+			while (ordered) {
+				assert(_value != nullptr);
+				ordered->run(ordered->storage, _value.get());
+				release(std::exchange(ordered, ordered->next));
+			}
+		}
+
 		std::shared_ptr<T> _value;
+		std::atomic<Task*> _tasks = { nullptr };
+		std::array<Task, kPoolSize> _pool;
+		std::array<std::atomic<bool>, kPoolSize> _poolUsed = {};
+		std::atomic<unsigned> _poolHint = { 0 };
 	};
 
 	rtc::Thread *_thread = nullptr;
@@ -0,0 +1,149 @@
+#include "ThreadShards.h"
+
+#include "Instance.h"
+
+#include "rtc_base/thread.h"
+#include "rtc_base/physical_socket_server.h"
+#include "rtc_base/logging.h"
+
+#ifdef WEBRTC_LINUX
+#include <sched.h>
+#endif // WEBRTC_LINUX
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+std::atomic<int> ShardsCount = { 1 };
+std::atomic<bool> ShardsPinned = { false };
+std::atomic<bool> ShardsCreated = { false };
+
+void PinCurrentThread(int cpu) {
+#ifdef WEBRTC_LINUX
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		RTC_LOG(LS_WARNING) << "Could not pin thread to CPU " << cpu << ", error: " << errno;
+	}
+#endif // WEBRTC_LINUX
+}
+
+std::unique_ptr<rtc::Thread> StartThread(
+		std::unique_ptr<rtc::Thread> thread,
+		const char *name,
+		int index,
+		int cpu) {
+	const auto fullName = index
+		? (std::string(name) + "-" + std::to_string(index))
+		: std::string(name);
+	thread->SetName(fullName, nullptr);
+	thread->Start();
+	if (cpu >= 0) {
+		thread->PostTask(RTC_FROM_HERE, [cpu] {
+			PinCurrentThread(cpu);
+		});
+	}
+	return thread;
+}
+
+std::unique_ptr<ThreadShardPool> MakeShards() {
+	ShardsCreated = true;
+
+	return std::make_unique<ThreadShardPool>(
+		ShardsCount.load(),
+		ShardsPinned.load());
+}
+
+ThreadShardPool &Shards() {
+	static const auto value = MakeShards();
+	return *value;
+}
+
+} // namespace
+
+struct ThreadShardPool::Shard {
+	ThreadShard threads;
+	std::unique_ptr<rtc::Thread> manager;
+	std::unique_ptr<rtc::PhysicalSocketServer> networkSocketServer;
+	std::unique_ptr<rtc::Thread> network;
+	std::unique_ptr<rtc::Thread> media;
+	std::atomic<int> calls = { 0 };
+};
+
+ThreadShardPool::ThreadShardPool(int count, bool pinToCores) {
+	const auto cores = int(std::thread::hardware_concurrency());
+	const auto pinned = pinToCores && (cores > 0);
+	for (auto index = 0; index != std::max(count, 1); ++index) {
+		// Only the network thread, which does the packet work, gets a core
+		// of its own. Manager and media threads are left to the scheduler,
+		// so that they don't compete with it for the same core.
+		const auto networkCpu = pinned ? (index % cores) : -1;
+		auto shard = std::make_unique<Shard>();
+		shard->manager = StartThread(rtc::Thread::Create(), "WebRTC-Manager", index, -1);
+		shard->networkSocketServer = std::make_unique<rtc::PhysicalSocketServer>();
+		shard->network = StartThread(
+			std::make_unique<rtc::Thread>(shard->networkSocketServer.get()),
+			"WebRTC-Network",
+			index,
+			networkCpu);
+		shard->media = StartThread(rtc::Thread::Create(), "WebRTC-Media", index, -1);
+		shard->threads.index = index;
+		shard->threads.manager = shard->manager.get();
+		shard->threads.network = shard->network.get();
+		shard->threads.networkSocketServer = shard->networkSocketServer.get();
+		shard->threads.media = shard->media.get();
+		_shards.push_back(std::move(shard));
+	}
+}
+
+ThreadShardPool::~ThreadShardPool() = default;
+
+const ThreadShard &ThreadShardPool::front() const {
+	return _shards.front()->threads;
+}
+
+const ThreadShard &ThreadShardPool::acquire() {
+	auto best = _shards.front().get();
+	for (const auto &shard : _shards) {
+		if (shard->calls.load() < best->calls.load()) {
+			best = shard.get();
+		}
+	}
+	++best->calls;
+	return best->threads;
+}
+
+void ThreadShardPool::release(const ThreadShard &shard) {
+	--_shards[shard.index]->calls;
+}
+
+const ThreadShard &DefaultThreadShard() {
+	return Shards().front();
+}
+
+const ThreadShard &AcquireThreadShard() {
+	return Shards().acquire();
+}
+
+void ReleaseThreadShard(const ThreadShard &shard) {
+	Shards().release(shard);
+}
+
+void SetThreadShardsCount(int count, bool pinToCores) {
+	if (ShardsCreated) {
+		RTC_LOG(LS_WARNING) << "Thread shards are already created.";
+		return;
+	}
+	ShardsCount = std::max(count, 1);
+	ShardsPinned = pinToCores;
+}
+
+} // namespace tgcalls
@@ -0,0 +1,52 @@
+#ifndef TGCALLS_THREAD_SHARDS_H
+#define TGCALLS_THREAD_SHARDS_H
+
+#include <memory>
+#include <vector>
+
+namespace rtc {
+class Thread;
+class PhysicalSocketServer;
+} // namespace rtc
+
+namespace tgcalls {
+
+// Threads all objects of one call run on.
+struct ThreadShard {
+	int index = 0;
+	rtc::Thread *manager = nullptr;
+	rtc::Thread *network = nullptr;
+	rtc::PhysicalSocketServer *networkSocketServer = nullptr;
+	rtc::Thread *media = nullptr;
+};
+
+// Started threads of 'count' shards. Calls use the one set up by
+// SetThreadShardsCount, others are made by benchmarks.
+class ThreadShardPool {
+public:
+	ThreadShardPool(int count, bool pinToCores);
+	~ThreadShardPool();
+
+	const ThreadShard &front() const;
+
+	// Picks the shard running the fewest calls.
+	const ThreadShard &acquire();
+	void release(const ThreadShard &shard);
+
+private:
+	struct Shard;
+
+	std::vector<std::unique_ptr<Shard>> _shards;
+
+};
+
+// Video capture objects live on the default shard, calls
+// on other shards reach them through ThreadLocalObject::perform.
+const ThreadShard &DefaultThreadShard();
+
+const ThreadShard &AcquireThreadShard();
+void ReleaseThreadShard(const ThreadShard &shard);
+
+} // namespace tgcalls
+
+#endif
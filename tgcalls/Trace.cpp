@@ -0,0 +1,176 @@
+#include "Trace.h"
+
+#ifndef TGCALLS_DISABLE_TRACE
+
+#include "rtc_base/time_utils.h"
+
+#include <atomic>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+namespace tgcalls {
+namespace {
+
+// Per call, so keep it small: many calls may run in one process.
+constexpr auto kRingSize = uint64_t(2048);
+constexpr auto kRingMask = kRingSize - 1;
+
+static_assert((kRingSize & kRingMask) == 0, "Ring size must be a power of two.");
+
+struct Record {
+	int64_t time = 0;
+	uint32_t counter = 0;
+	uint32_t value = 0;
+	TraceEvent event = TraceEvent();
+	uint8_t type = 0;
+	bool transport = false;
+};
+
+void WriteRecord(std::ostringstream &stream, const Record &record) {
+	const auto type = int(record.type);
+	const auto counter = record.counter;
+	const auto value = record.value;
+	stream << (record.transport ? "(transport) " : "(signaling) ");
+	switch (record.event) {
+		case TraceEvent::SendEnqueue:
+			stream << "Enqueue SEND:type" << type << "#" << counter;
+			break;
+		case TraceEvent::SendAdd:
+			stream << "Add SEND:type" << type << "#" << counter;
+			break;
+		case TraceEvent::SendEmpty:
+			stream << "SEND:empty#" << counter;
+			break;
+		case TraceEvent::AckAdd:
+			stream << "Add ACK#" << counter;
+			if (value) {
+				stream << " and " << value << " more";
+			}
+			break;
+		case TraceEvent::AckSkip:
+			stream << "Skip " << value << " ACKs from #" << counter << " (no space)";
+			break;
+		case TraceEvent::ResendAdd:
+			stream << "Add RESEND:type" << type << "#" << counter;
+			break;
+		case TraceEvent::ResendWait:
+			stream << "Skip RESEND:type" << type << "#" << counter << " (wait " << value << "ms)";
+			break;
+		case TraceEvent::ResendNoSpace:
+			stream << "Skip RESEND:type" << type << "#" << counter << " (no space, length: " << value << ")";
+			break;
+		case TraceEvent::ReceiveEmpty:
+			stream << "Got RECV:empty#" << counter;
+			break;
+		case TraceEvent::Receive:
+			stream << "Got RECV:type" << type << "#" << counter;
+			break;
+		case TraceEvent::ReceiveRepeated:
+			stream << "Repeated RECV:type" << type << "#" << counter;
+			break;
+		case TraceEvent::AckReceived:
+			stream << "Got ACK:type" << type << "#" << counter;
+			break;
+		case TraceEvent::AckRepeated:
+			stream << "Repeated ACK#" << counter;
+			break;
+		default:
+			stream << "Unknown event " << int(record.event);
+			break;
+	}
+}
+
+} // namespace
+
+// Every field is atomic so that a reader racing with a writer
+// only sees a torn record, which it detects by the sequence.
+struct TraceSlot {
+	std::atomic<uint64_t> sequence{ 0 }; // Index + 1 of a complete record.
+	std::atomic<int64_t> time{ 0 };
+	std::atomic<uint64_t> values{ 0 }; // counter | (value << 32)
+	std::atomic<uint32_t> header{ 0 }; // event | (type << 8) | (transport << 16)
+};
+
+namespace {
+
+bool ReadRecord(const TraceSlot &slot, uint64_t index, Record &record) {
+	const auto sequence = slot.sequence.load(std::memory_order_acquire);
+	if (sequence != index + 1) {
+		return false;
+	}
+	const auto time = slot.time.load(std::memory_order_relaxed);
+	const auto values = slot.values.load(std::memory_order_relaxed);
+	const auto header = slot.header.load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+		return false;
+	}
+	record.time = time;
+	record.counter = uint32_t(values & 0xFFFFFFFFU);
+	record.value = uint32_t(values >> 32);
+	record.event = TraceEvent(header & 0xFFU);
+	record.type = uint8_t((header >> 8) & 0xFFU);
+	record.transport = ((header >> 16) & 0x01U) != 0;
+	return true;
+}
+
+} // namespace
+
+TraceRecorder::TraceRecorder() : _ring(std::make_unique<TraceSlot[]>(kRingSize)) {
+}
+
+TraceRecorder::~TraceRecorder() = default;
+
+void TraceRecorder::add(
+		TraceEvent event,
+		bool transport,
+		uint8_t type,
+		uint32_t counter,
+		uint32_t value) {
+	const auto index = _next.fetch_add(1, std::memory_order_relaxed);
+	auto &slot = _ring[index & kRingMask];
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.time.store(rtc::TimeMicros(), std::memory_order_relaxed);
+	slot.values.store(
+		uint64_t(counter) | (uint64_t(value) << 32),
+		std::memory_order_relaxed);
+	slot.header.store(
+		uint32_t(event) | (uint32_t(type) << 8) | (uint32_t(transport ? 1 : 0) << 16),
+		std::memory_order_relaxed);
+	slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+std::string TraceRecorder::toString() const {
+	const auto till = _next.load(std::memory_order_acquire);
+	const auto from = (till > kRingSize) ? (till - kRingSize) : uint64_t(0);
+
+	std::ostringstream stream;
+	if (from > 0) {
+		stream << "Trace: " << from << " events overwritten.\n";
+	}
+	auto start = int64_t(0);
+	auto record = Record();
+	for (auto index = from; index != till; ++index) {
+		if (!ReadRecord(_ring[index & kRingMask], index, record)) {
+			continue;
+		}
+		if (!start) {
+			start = record.time;
+		}
+		// Writers on different threads may finish slightly out of order.
+		const auto elapsed = std::max(record.time - start, int64_t(0));
+		stream
+			<< "[+" << (elapsed / 1000) << "."
+			<< std::setw(3) << std::setfill('0') << (elapsed % 1000)
+			<< "] ";
+		WriteRecord(stream, record);
+		stream << "\n";
+	}
+	return stream.str();
+}
+
+} // namespace tgcalls
+
+#endif // TGCALLS_DISABLE_TRACE
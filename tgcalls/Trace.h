@@ -0,0 +1,72 @@
+#ifndef TGCALLS_TRACE_H
+#define TGCALLS_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace tgcalls {
+
+// Hot path events, recorded in binary form and decoded to text only on dump.
+enum class TraceEvent : uint8_t {
+	SendEnqueue,
+	SendAdd,
+	SendEmpty,
+	AckAdd,
+	AckSkip,
+	ResendAdd,
+	ResendWait,
+	ResendNoSpace,
+	ReceiveEmpty,
+	Receive,
+	ReceiveRepeated,
+	AckReceived,
+	AckRepeated,
+};
+
+#ifndef TGCALLS_DISABLE_TRACE
+
+struct TraceSlot;
+
+// Events of one call, shared by its connections.
+// The oldest events are overwritten when the ring is full.
+class TraceRecorder final {
+public:
+	TraceRecorder();
+	~TraceRecorder();
+
+	// Lock-free, may be called from any thread.
+	void add(
+		TraceEvent event,
+		bool transport,
+		uint8_t type,
+		uint32_t counter,
+		uint32_t value = 0);
+
+	std::string toString() const;
+
+private:
+	std::unique_ptr<TraceSlot[]> _ring;
+	std::atomic<uint64_t> _next = { 0 };
+
+};
+
+#else // TGCALLS_DISABLE_TRACE
+
+class TraceRecorder final {
+public:
+	void add(TraceEvent, bool, uint8_t, uint32_t, uint32_t = 0) {
+	}
+
+	std::string toString() const {
+		return std::string();
+	}
+
+};
+
+#endif // TGCALLS_DISABLE_TRACE
+
+} // namespace tgcalls
+
+#endif
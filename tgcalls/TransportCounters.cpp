@@ -0,0 +1,52 @@
+#include "TransportCounters.h"
+
+#include <sstream>
+
+namespace tgcalls {
+
+auto TransportCounters::snapshot() const -> Snapshot {
+	auto result = Snapshot();
+	result.traffic = trafficStats();
+	result.packetsSent = _packetsSent.load(std::memory_order_relaxed);
+	result.packetsReceived = _packetsReceived.load(std::memory_order_relaxed);
+	result.messagesResent = _messagesResent.load(std::memory_order_relaxed);
+	result.messagesRepeated = _messagesRepeated.load(std::memory_order_relaxed);
+	result.packetsRepeated = _packetsRepeated.load(std::memory_order_relaxed);
+	result.packetsRejected = _packetsRejected.load(std::memory_order_relaxed);
+	result.rttMs = _rttMs.load(std::memory_order_relaxed);
+	result.notAckedCount = _notAckedCount.load(std::memory_order_relaxed);
+	result.notAckedLength = _notAckedLength.load(std::memory_order_relaxed);
+	return result;
+}
+
+TrafficStats TransportCounters::trafficStats() const {
+	auto result = TrafficStats();
+	result.bytesSentWifi = _bytesSent[kNetworkWifi].load(std::memory_order_relaxed);
+	result.bytesReceivedWifi = _bytesReceived[kNetworkWifi].load(std::memory_order_relaxed);
+	result.bytesSentMobile = _bytesSent[kNetworkMobile].load(std::memory_order_relaxed);
+	result.bytesReceivedMobile = _bytesReceived[kNetworkMobile].load(std::memory_order_relaxed);
+	return result;
+}
+
+std::string TransportCounters::debugInfo() const {
+	const auto values = snapshot();
+	std::ostringstream stream;
+	stream
+		<< "{\"bytes_sent_wifi\":" << values.traffic.bytesSentWifi
+		<< ",\"bytes_recvd_wifi\":" << values.traffic.bytesReceivedWifi
+		<< ",\"bytes_sent_mobile\":" << values.traffic.bytesSentMobile
+		<< ",\"bytes_recvd_mobile\":" << values.traffic.bytesReceivedMobile
+		<< ",\"packets_sent\":" << values.packetsSent
+		<< ",\"packets_recvd\":" << values.packetsReceived
+		<< ",\"messages_resent\":" << values.messagesResent
+		<< ",\"messages_repeated\":" << values.messagesRepeated
+		<< ",\"packets_repeated\":" << values.packetsRepeated
+		<< ",\"packets_rejected\":" << values.packetsRejected
+		<< ",\"rtt\":" << values.rttMs
+		<< ",\"not_acked_count\":" << values.notAckedCount
+		<< ",\"not_acked_length\":" << values.notAckedLength
+		<< "}";
+	return stream.str();
+}
+
+} // namespace tgcalls
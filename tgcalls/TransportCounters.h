@@ -0,0 +1,97 @@
+#ifndef TGCALLS_TRANSPORT_COUNTERS_H
+#define TGCALLS_TRANSPORT_COUNTERS_H
+
+#include "Instance.h"
+
+#include <atomic>
+#include <string>
+
+namespace tgcalls {
+
+// Written only on the network thread, read from any thread.
+class TransportCounters final {
+public:
+	struct Snapshot {
+		TrafficStats traffic;
+		uint64_t packetsSent = 0;
+		uint64_t packetsReceived = 0;
+		uint64_t messagesResent = 0;
+		uint64_t messagesRepeated = 0;
+		uint64_t packetsRepeated = 0;
+		uint64_t packetsRejected = 0;
+		int rttMs = 0;
+		int notAckedCount = 0;
+		int notAckedLength = 0;
+	};
+
+	void setNetworkIsMobile(bool mobile) {
+		_network.store(
+			mobile ? kNetworkMobile : kNetworkWifi,
+			std::memory_order_relaxed);
+	}
+
+	void packetSent(size_t size) {
+		add(_bytesSent[_network.load(std::memory_order_relaxed)], size);
+		add(_packetsSent, 1);
+	}
+	void packetReceived(size_t size) {
+		add(_bytesReceived[_network.load(std::memory_order_relaxed)], size);
+		add(_packetsReceived, 1);
+	}
+	void messageResent() {
+		add(_messagesResent, 1);
+	}
+	void messageRepeated() {
+		add(_messagesRepeated, 1);
+	}
+	void packetRepeated() {
+		add(_packetsRepeated, 1);
+	}
+	void packetRejected() {
+		add(_packetsRejected, 1);
+	}
+	void setRtt(int ms) {
+		_rttMs.store(ms, std::memory_order_relaxed);
+	}
+	void setNotAcked(int count, int length) {
+		_notAckedCount.store(count, std::memory_order_relaxed);
+		_notAckedLength.store(length, std::memory_order_relaxed);
+	}
+
+	// Each value is consistent, but they are read one by one.
+	Snapshot snapshot() const;
+	TrafficStats trafficStats() const;
+	std::string debugInfo() const;
+
+private:
+	enum Network {
+		kNetworkWifi,
+		kNetworkMobile,
+		kNetworkCount,
+	};
+
+	// Single writer, so no read-modify-write instruction is needed.
+	static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+		counter.store(
+			counter.load(std::memory_order_relaxed) + value,
+			std::memory_order_relaxed);
+	}
+
+	std::atomic<int> _network{ kNetworkWifi };
+	std::atomic<uint64_t> _bytesSent[kNetworkCount] = {};
+	std::atomic<uint64_t> _bytesReceived[kNetworkCount] = {};
+	std::atomic<uint64_t> _packetsSent{ 0 };
+	std::atomic<uint64_t> _packetsReceived{ 0 };
+	std::atomic<uint64_t> _messagesResent{ 0 };
+	std::atomic<uint64_t> _messagesRepeated{ 0 };
+	std::atomic<uint64_t> _packetsRepeated{ 0 };
+	std::atomic<uint64_t> _packetsRejected{ 0 };
+	std::atomic<int> _rttMs{ 0 };
+	std::atomic<int> _notAckedCount{ 0 };
+	std::atomic<int> _notAckedLength{ 0 };
+
+};
+
+} // namespace tgcalls
+
+#endif
@@ -0,0 +1,206 @@
+#include "UdpBatch.h"
+
+#ifdef WEBRTC_LINUX
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace tgcalls {
+namespace {
+
+// Largest UDP payload of an IPv4 datagram, the kernel refuses to
+// segment more than that at once.
+constexpr auto kMaxSegmentedSize = size_t(65507);
+
+union SegmentControl {
+	char buffer[CMSG_SPACE(sizeof(uint16_t))];
+	cmsghdr aligned;
+};
+
+} // namespace
+
+UdpSendBatch::UdpSendBatch(bool segmentation)
+: _buffers(kUdpBatchSize * kUdpMaxDatagramSize)
+, _segmentation(segmentation) {
+}
+
+int UdpSendBatch::push(
+		const void *data,
+		size_t size,
+		const sockaddr_storage &address,
+		socklen_t addressLength) {
+	if (full() || size > kUdpMaxDatagramSize) {
+		return -1;
+	}
+	const auto index = (_first + _count) % kUdpBatchSize;
+	auto &slot = _slots[index];
+	std::memcpy(_buffers.data() + index * kUdpMaxDatagramSize, data, size);
+	slot.size = size;
+	slot.address = address;
+	slot.addressLength = addressLength;
+	++_count;
+	return index;
+}
+
+bool UdpSendBatch::segmentationSupported(int descriptor) {
+	if (!_segmentation) {
+		return false;
+	} else if (_segmentationDescriptor != descriptor) {
+		// Kernels without UDP_SEGMENT (before 4.18) don't know the option.
+		auto value = 0;
+		auto length = socklen_t(sizeof(value));
+		_segmentationDescriptor = descriptor;
+		_segmentationSupported = (::getsockopt(descriptor, SOL_UDP, UDP_SEGMENT, &value, &length) == 0);
+	}
+	return _segmentationSupported;
+}
+
+bool UdpSendBatch::canSegment(const Slot &first, const Slot &next, size_t size) const {
+	return (first.size > 0)
+		&& (next.size == first.size)
+		&& (next.addressLength == first.addressLength)
+		&& (size + next.size <= kMaxSegmentedSize)
+		&& !std::memcmp(&next.address, &first.address, first.addressLength);
+}
+
+UdpSendBatch::FlushResult UdpSendBatch::flush(int descriptor) {
+	auto result = FlushResult();
+	if (empty()) {
+		return result;
+	}
+	mmsghdr messages[kUdpBatchSize];
+	iovec parts[kUdpBatchSize];
+	SegmentControl controls[kUdpBatchSize];
+	int segments[kUdpBatchSize];
+	auto segmentation = segmentationSupported(descriptor);
+
+	// Slots before this one are sent one datagram per message.
+	auto unsegmentedTill = 0;
+
+	// Fills messages for the slots starting from 'from', returns their count.
+	const auto prepare = [&](int from) {
+		auto count = 0;
+		for (auto i = from; i != _count; ++count) {
+			const auto &first = _slots[(_first + i) % kUdpBatchSize];
+			auto &message = messages[count];
+			message = mmsghdr();
+			message.msg_hdr.msg_name = const_cast<sockaddr_storage*>(&first.address);
+			message.msg_hdr.msg_namelen = first.addressLength;
+			message.msg_hdr.msg_iov = &parts[i];
+			const auto segmented = segmentation && (i >= unsegmentedTill);
+			auto size = size_t(0);
+			auto &segmentsCount = segments[count];
+			segmentsCount = 0;
+			do {
+				const auto index = (_first + i) % kUdpBatchSize;
+				parts[i].iov_base = _buffers.data() + index * kUdpMaxDatagramSize;
+				parts[i].iov_len = _slots[index].size;
+				size += _slots[index].size;
+				++segmentsCount;
+				++i;
+			} while (segmented
+				&& i != _count
+				&& canSegment(first, _slots[(_first + i) % kUdpBatchSize], size));
+			message.msg_hdr.msg_iovlen = size_t(segmentsCount);
+			if (segmentsCount > 1) {
+				auto &control = controls[count];
+				message.msg_hdr.msg_control = control.buffer;
+				message.msg_hdr.msg_controllen = sizeof(control.buffer);
+				const auto header = CMSG_FIRSTHDR(&message.msg_hdr);
+				header->cmsg_level = SOL_UDP;
+				header->cmsg_type = UDP_SEGMENT;
+				header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				const auto segmentSize = uint16_t(first.size);
+				std::memcpy(CMSG_DATA(header), &segmentSize, sizeof(segmentSize));
+			}
+		}
+		return count;
+	};
+
+	auto processed = 0;
+	while (processed < _count) {
+		const auto prepared = prepare(processed);
+		const auto sent = ::sendmmsg(descriptor, messages, unsigned(prepared), 0);
+		if (sent > 0) {
+			for (auto i = 0; i != sent; ++i) {
+				for (auto j = 0; j != segments[i]; ++j) {
+					result.delivered[result.deliveredCount++] = (_first + processed++) % kUdpBatchSize;
+				}
+			}
+		} else if (sent < 0 && errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			// The socket buffer is full, keep the rest until it drains.
+			result.blocked = true;
+			break;
+		} else if (segments[0] > 1 && (errno == EIO || errno == EINVAL)) {
+			// The device can't checksum segmented datagrams (EIO), or they
+			// exceed the route MTU and need fragmenting (EINVAL), so these
+			// go one by one.
+			if (errno == EIO) {
+				segmentation = _segmentationSupported = false;
+			}
+			unsegmentedTill = processed + segments[0];
+		} else {
+			// These datagrams failed by themselves (unreachable destination,
+			// wrong address family, too large), send the rest anyway.
+			result.lastError = errno;
+			result.failedCount += segments[0];
+			processed += segments[0];
+		}
+	}
+	_first = (_first + processed) % kUdpBatchSize;
+	_count -= processed;
+	return result;
+}
+
+void UdpSendBatch::clear() {
+	_first = _count = 0;
+}
+
+UdpReceiveBatch::UdpReceiveBatch()
+: _buffers(kUdpBatchSize * kUdpMaxDatagramSize) {
+	for (auto i = 0; i != kUdpBatchSize; ++i) {
+		_parts[i].iov_base = _buffers.data() + i * kUdpMaxDatagramSize;
+		_parts[i].iov_len = kUdpMaxDatagramSize;
+	}
+}
+
+int UdpReceiveBatch::receive(int descriptor) {
+	for (auto i = 0; i != kUdpBatchSize; ++i) {
+		_messages[i] = mmsghdr();
+		_messages[i].msg_hdr.msg_name = &_addresses[i];
+		_messages[i].msg_hdr.msg_namelen = sizeof(_addresses[i]);
+		_messages[i].msg_hdr.msg_iov = &_parts[i];
+		_messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	const auto received = ::recvmmsg(descriptor, _messages.data(), kUdpBatchSize, MSG_DONTWAIT, nullptr);
+	if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return received;
+}
+
+const uint8_t *UdpReceiveBatch::data(int index) const {
+	return static_cast<const uint8_t*>(_parts[index].iov_base);
+}
+
+size_t UdpReceiveBatch::size(int index) const {
+	return _messages[index].msg_len;
+}
+
+const sockaddr_storage &UdpReceiveBatch::address(int index) const {
+	return _addresses[index];
+}
+
+bool UdpReceiveBatch::truncated(int index) const {
+	return (_messages[index].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+}
+
+} // namespace tgcalls
+
+#endif // WEBRTC_LINUX
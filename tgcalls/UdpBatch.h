@@ -0,0 +1,101 @@
+#ifndef TGCALLS_UDP_BATCH_H
+#define TGCALLS_UDP_BATCH_H
+
+#ifdef WEBRTC_LINUX
+
+#include <sys/socket.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tgcalls {
+
+constexpr auto kUdpBatchSize = 32;
+constexpr auto kUdpMaxDatagramSize = 2048;
+
+// Datagrams queued during one thread loop turn and sent with a single
+// sendmmsg. They are copied into preallocated slots, so queueing a
+// datagram doesn't allocate. Consecutive datagrams of the same size to
+// the same address go as one message with UDP_SEGMENT, so that the
+// kernel splits them instead of routing each one, when it supports it.
+class UdpSendBatch {
+public:
+	explicit UdpSendBatch(bool segmentation = true);
+
+	struct FlushResult {
+		// Slots that were sent, valid until the next push().
+		std::array<int, kUdpBatchSize> delivered = { { 0 } };
+		int deliveredCount = 0;
+		int failedCount = 0;
+		int lastError = 0;
+		bool blocked = false;
+	};
+
+	bool empty() const {
+		return !_count;
+	}
+	bool full() const {
+		return _count == kUdpBatchSize;
+	}
+
+	// Returns the slot index, or -1 if the batch is full.
+	// The datagram must be at most kUdpMaxDatagramSize bytes.
+	int push(
+		const void *data,
+		size_t size,
+		const sockaddr_storage &address,
+		socklen_t addressLength);
+
+	// Sends as much as the socket accepts and removes it from the batch.
+	FlushResult flush(int descriptor);
+	void clear();
+
+private:
+	struct Slot {
+		size_t size = 0;
+		sockaddr_storage address;
+		socklen_t addressLength = 0;
+	};
+
+	bool segmentationSupported(int descriptor);
+	bool canSegment(const Slot &first, const Slot &next, size_t size) const;
+
+	std::vector<uint8_t> _buffers;
+	std::array<Slot, kUdpBatchSize> _slots;
+	int _first = 0;
+	int _count = 0;
+	bool _segmentation = false;
+	int _segmentationDescriptor = -1;
+	bool _segmentationSupported = false;
+
+};
+
+// Datagrams read with a single recvmmsg into preallocated buffers.
+class UdpReceiveBatch {
+public:
+	UdpReceiveBatch();
+
+	// Returns the count of datagrams read, 0 if there was nothing to read
+	// and -1 with errno set on error. They are valid until the next call.
+	int receive(int descriptor);
+
+	const uint8_t *data(int index) const;
+	size_t size(int index) const;
+	const sockaddr_storage &address(int index) const;
+	bool truncated(int index) const;
+
+private:
+	std::vector<uint8_t> _buffers;
+	std::array<mmsghdr, kUdpBatchSize> _messages;
+	std::array<iovec, kUdpBatchSize> _parts;
+	std::array<sockaddr_storage, kUdpBatchSize> _addresses;
+
+};
+
+} // namespace tgcalls
+
+#endif // WEBRTC_LINUX
+
+#endif
@@ -0,0 +1,224 @@
+// Google Benchmark suite for EncryptedConnection and its parts.
+
+#include "EncryptedConnection.h"
+#include "test/Fixtures.h"
+
+#include "benchmark/benchmark.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+// Two ends of one call, optionally with all the optional formats.
+struct Connections {
+	explicit Connections(bool capabilities)
+	: key(test::MakeKey())
+	, outgoing(EncryptedConnection::Type::Transport, EncryptionKey(key, true), [](int, int) {})
+	, incoming(EncryptedConnection::Type::Transport, EncryptionKey(key, false), [](int, int) {}) {
+		if (capabilities) {
+			outgoing.setPeerCapabilities(kSupportedCapabilities);
+			incoming.setPeerCapabilities(kSupportedCapabilities);
+		}
+	}
+
+	std::shared_ptr<std::array<uint8_t, EncryptionKey::kSize>> key;
+	EncryptedConnection outgoing;
+	EncryptedConnection incoming;
+};
+
+// One exchange with a lost message requiring ack. The next one is sent
+// as an empty message followed by both queued messages, the reply
+// carries an audio frame with the acks appended.
+// Returns the size of the multi-message packet or 0 on failure.
+size_t ExchangeWithResend(Connections &connections) {
+	const auto lost = connections.outgoing.prepareForSending(
+		Message{ RemoteVideoIsActiveMessage{ true } });
+	const auto packet = connections.outgoing.prepareForSending(
+		Message{ RemoteVideoIsActiveMessage{ false } });
+	if (!lost || !packet) {
+		return 0;
+	}
+	const auto received = connections.incoming.handleIncomingPacket(
+		packet->bytes.cdata<char>(),
+		packet->bytes.size());
+	if (!received
+		|| !absl::get_if<RemoteVideoIsActiveMessage>(&received->main.message.data)
+		|| received->additional.size() != 1) {
+		return 0;
+	}
+	const auto reply = connections.incoming.prepareForSending(
+		Message{ AudioDataMessage{ test::Payload(test::kOpusHighBytes) } });
+	if (!reply) {
+		return 0;
+	}
+	const auto acked = connections.outgoing.handleIncomingPacket(
+		reply->bytes.cdata<char>(),
+		reply->bytes.size());
+	if (!acked || !absl::get_if<AudioDataMessage>(&acked->main.message.data)) {
+		return 0;
+	}
+	return packet->bytes.size();
+}
+
+void BM_ExchangeWithResend(benchmark::State &state) {
+	Connections connections(state.range(0) != 0);
+	auto bytes = size_t(0);
+	for (auto _ : state) {
+		const auto size = ExchangeWithResend(connections);
+		if (!size) {
+			state.SkipWithError("Could not exchange the packets.");
+			break;
+		}
+		bytes = size;
+	}
+	state.counters["bytes"] = double(bytes);
+}
+BENCHMARK(BM_ExchangeWithResend)->ArgName("capabilities")->Arg(0)->Arg(1);
+
+// Six seconds of 6 kbps Opus in 120 ms frames, as sent with data saving.
+constexpr auto kAudioFrameBytes = test::kOpusLowBytes * 6;
+constexpr auto kAudioFrames = 50;
+constexpr auto kAudioSeconds = 6;
+
+// IPv4 and UDP headers, added to every packet on the wire.
+constexpr auto kUdpIpOverhead = 28;
+
+// Bytes per second on the wire for a call's audio, sent as one packet per
+// frame or bundled in pairs the way NetworkManager does with data saving.
+void BM_AudioBytesPerSecond(benchmark::State &state) {
+	const auto bundled = (state.range(0) != 0);
+	Connections connections(true);
+	const auto frame = test::Payload(kAudioFrameBytes);
+	auto bytes = int64_t(0);
+	auto packets = int64_t(0);
+	const auto receive = [&](const EncryptedConnection::EncryptedPacket &packet) {
+		const auto received = connections.incoming.handleIncomingPacket(
+			packet.bytes.cdata<char>(),
+			packet.bytes.size());
+		if (!received) {
+			return false;
+		}
+		bytes += int64_t(packet.bytes.size()) + kUdpIpOverhead;
+		++packets;
+		return true;
+	};
+	for (auto _ : state) {
+		bytes = packets = 0;
+		auto bundle = std::vector<Message>();
+		for (auto i = 0; i != kAudioFrames; ++i) {
+			bundle.push_back(Message{ AudioDataMessage{ frame } });
+			if (bundled && bundle.size() < 2) {
+				continue;
+			}
+			const auto packet = bundled
+				? connections.outgoing.prepareForSendingBundle(bundle)
+				: connections.outgoing.prepareForSending(bundle.front());
+			if (!packet || !receive(*packet) || (bundled && !bundle.empty())) {
+				state.SkipWithError("Could not exchange the packets.");
+				return;
+			}
+			bundle.clear();
+		}
+	}
+	state.counters["bytes_per_second"] = double(bytes) / kAudioSeconds;
+	state.counters["packets_per_second"] = double(packets) / kAudioSeconds;
+}
+BENCHMARK(BM_AudioBytesPerSecond)->ArgName("bundled")->Arg(0)->Arg(1);
+
+// The sorted list of the last 64 counters the window replaced.
+class LegacyIncomingCounters {
+public:
+	bool registerCounter(uint32_t incomingCounter) {
+		constexpr auto kKeepIncomingCountersCount = 64;
+		auto &list = _largestIncomingCounters;
+
+		const auto position = std::lower_bound(list.begin(), list.end(), incomingCounter);
+		const auto largest = list.empty() ? 0 : list.back();
+		if (position != list.end() && *position == incomingCounter) {
+			return false;
+		} else if (incomingCounter + kKeepIncomingCountersCount <= largest) {
+			return false;
+		}
+		const auto eraseTill = std::find_if(list.begin(), list.end(), [&](uint32_t counter) {
+			return (counter + kKeepIncomingCountersCount > incomingCounter);
+		});
+		const auto eraseCount = eraseTill - list.begin();
+		const auto positionIndex = (position - list.begin()) - eraseCount;
+		list.erase(list.begin(), eraseTill);
+		list.insert(list.begin() + positionIndex, incomingCounter);
+		return true;
+	}
+
+private:
+	std::vector<uint32_t> _largestIncomingCounters;
+
+};
+
+enum class Arrival {
+	InOrder,
+	Reordered,
+	Duplicated,
+};
+
+// Offsets of 1024 consecutive counters in the order they arrive.
+std::vector<uint32_t> Arrivals(Arrival arrival) {
+	constexpr auto kCount = uint32_t(1024);
+	auto result = std::vector<uint32_t>();
+	for (auto i = uint32_t(); i != kCount; ++i) {
+		result.push_back(i);
+	}
+	if (arrival == Arrival::Reordered) {
+		// Each counter is delayed by up to 16 places.
+		auto seed = uint32_t(1);
+		for (auto i = uint32_t(); i + 16 <= kCount; i += 16) {
+			for (auto j = uint32_t(15); j != 0; --j) {
+				seed = seed * 1103515245U + 12345U;
+				std::swap(result[i + j], result[i + (seed >> 8) % (j + 1)]);
+			}
+		}
+	} else if (arrival == Arrival::Duplicated) {
+		// Every packet arrives twice, the copy a few packets later.
+		auto duplicated = std::vector<uint32_t>();
+		for (auto i = uint32_t(); i != kCount; ++i) {
+			duplicated.push_back(i);
+			if (i >= 4) {
+				duplicated.push_back(i - 4);
+			}
+		}
+		result = std::move(duplicated);
+	}
+	return result;
+}
+
+template <typename Counters>
+void BM_RegisterIncomingCounters(benchmark::State &state) {
+	const auto arrivals = Arrivals(Arrival(state.range(0)));
+	auto counters = Counters();
+	auto base = uint32_t(1);
+	auto accepted = int64_t(0);
+	for (auto _ : state) {
+		for (const auto offset : arrivals) {
+			accepted += counters.registerCounter(base + offset) ? 1 : 0;
+		}
+		base += 1024;
+	}
+	benchmark::DoNotOptimize(accepted);
+	state.SetItemsProcessed(int64_t(state.iterations() * arrivals.size()));
+}
+
+void ArrivalArguments(benchmark::internal::Benchmark *benchmark) {
+	benchmark->ArgName("arrival");
+	benchmark->Arg(int(Arrival::InOrder));
+	benchmark->Arg(int(Arrival::Reordered));
+	benchmark->Arg(int(Arrival::Duplicated));
+}
+
+BENCHMARK_TEMPLATE(BM_RegisterIncomingCounters, IncomingCountersWindow)->Apply(ArrivalArguments);
+BENCHMARK_TEMPLATE(BM_RegisterIncomingCounters, LegacyIncomingCounters)->Apply(ArrivalArguments);
+
+} // namespace
+} // namespace tgcalls
+
+BENCHMARK_MAIN();
@@ -0,0 +1,198 @@
+// Google Benchmark suite for message serialization.
+//
+// It needs no devices or network, so it runs on a headless box.
+// Compare runs with --benchmark_out=<file>.json and benchmark's compare.py.
+
+#include "Message.h"
+#include "EncryptedConnection.h"
+#include "test/Fixtures.h"
+
+#include "benchmark/benchmark.h"
+
+#include <string>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+// Some application blob.
+constexpr auto kUnstructuredBytes = 256;
+
+cricket::Candidate MakeCandidate(int index, const std::string &type) {
+	auto result = cricket::Candidate();
+	result.set_component(1);
+	result.set_protocol("udp");
+	result.set_address(rtc::SocketAddress("192.168.1." + std::to_string(10 + index), 50000 + index));
+	result.set_priority(2122260223 - index);
+	result.set_username("u4Kd");
+	result.set_password("uQ1pBjn3cZfx5wBaQ2dq9zS6");
+	result.set_type(type);
+	result.set_generation(0);
+	result.set_foundation(std::to_string(1000 + index));
+	result.set_network_id(index);
+	result.set_network_cost(10);
+	return result;
+}
+
+Message MakeCandidates(bool compact) {
+	auto message = CandidatesListMessage();
+	message.candidates.push_back(MakeCandidate(0, cricket::LOCAL_PORT_TYPE));
+	message.candidates.push_back(MakeCandidate(1, cricket::LOCAL_PORT_TYPE));
+	message.candidates.push_back(MakeCandidate(2, cricket::STUN_PORT_TYPE));
+	message.compact = compact;
+	return { std::move(message) };
+}
+
+Message MakeVideoFormats() {
+	auto message = VideoFormatsMessage();
+	message.formats.emplace_back("VP8");
+	message.formats.emplace_back("VP9", webrtc::SdpVideoFormat::Parameters{
+		{ "profile-id", "0" },
+	});
+	message.formats.emplace_back("H264", webrtc::SdpVideoFormat::Parameters{
+		{ "level-asymmetry-allowed", "1" },
+		{ "packetization-mode", "1" },
+		{ "profile-level-id", "42e01f" },
+	});
+	message.encodersCount = 3;
+	return { std::move(message) };
+}
+
+struct Sample {
+	const char *name = nullptr;
+	Message (*make)() = nullptr;
+};
+
+const Sample kSamples[] = {
+	{ "Candidates", [] { return MakeCandidates(false); } },
+	{ "CandidatesCompact", [] { return MakeCandidates(true); } },
+	{ "VideoFormats", [] { return MakeVideoFormats(); } },
+	{ "RequestVideo", [] { return Message{ RequestVideoMessage() }; } },
+	{ "RemoteVideoIsActive", [] { return Message{ RemoteVideoIsActiveMessage{ true } }; } },
+	{ "AudioOpus6k", [] { return Message{ AudioDataMessage{ test::Payload(test::kOpusLowBytes) } }; } },
+	{ "AudioOpus32k", [] { return Message{ AudioDataMessage{ test::Payload(test::kOpusHighBytes) } }; } },
+	{ "VideoMtu", [] { return Message{ VideoDataMessage{ test::Payload(test::kVideoBytes) } }; } },
+	{ "Unstructured", [] { return Message{ UnstructuredDataMessage{ test::Payload(kUnstructuredBytes) } }; } },
+	{ "Capabilities", [] { return Message{ CapabilitiesMessage{ kSupportedCapabilities } }; } },
+	{ "PathMtuProbe", [] { return Message{ PathMtuProbeMessage{ 1452 } }; } },
+};
+
+void SampleArguments(benchmark::internal::Benchmark *benchmark) {
+	benchmark->ArgNames({ "type", "single" });
+	for (auto i = 0; i != int(sizeof(kSamples) / sizeof(kSamples[0])); ++i) {
+		benchmark->Args({ i, 0 });
+		benchmark->Args({ i, 1 });
+	}
+}
+
+void BM_SerializeMessageWithSeq(benchmark::State &state) {
+	const auto &sample = kSamples[state.range(0)];
+	const auto singleMessagePacket = (state.range(1) != 0);
+	const auto message = sample.make();
+	auto seq = uint32_t(0);
+	auto bytes = size_t(0);
+	for (auto _ : state) {
+		const auto serialized = SerializeMessageWithSeq(message, ++seq, singleMessagePacket);
+		bytes += serialized.size();
+		benchmark::DoNotOptimize(serialized.cdata());
+	}
+	state.SetLabel(sample.name);
+	state.SetBytesProcessed(int64_t(bytes));
+	state.counters["bytes"] = double(SerializeMessageWithSeq(message, 1, singleMessagePacket).size());
+}
+BENCHMARK(BM_SerializeMessageWithSeq)->Apply(SampleArguments);
+
+void BM_DeserializeMessage(benchmark::State &state) {
+	const auto &sample = kSamples[state.range(0)];
+	const auto singleMessagePacket = (state.range(1) != 0);
+	const auto serialized = SerializeMessageWithSeq(sample.make(), 1, singleMessagePacket);
+	for (auto _ : state) {
+		rtc::ByteBufferReader reader(
+			serialized.cdata<char>() + 4, // Skip seq.
+			serialized.size() - 4);
+		auto message = DeserializeMessage(reader, singleMessagePacket, &serialized);
+		if (!message) {
+			state.SkipWithError("Could not deserialize the message.");
+			break;
+		}
+		benchmark::DoNotOptimize(message);
+	}
+	state.SetLabel(sample.name);
+	state.SetBytesProcessed(int64_t(state.iterations() * serialized.size()));
+	state.counters["bytes"] = double(serialized.size());
+}
+BENCHMARK(BM_DeserializeMessage)->Apply(SampleArguments);
+
+// A bundle of Opus frames with a control message requiring ack,
+// laid out the way the connection assembles a transport packet.
+std::vector<Message> PacketMessages() {
+	auto result = std::vector<Message>();
+	result.push_back({ RemoteVideoIsActiveMessage{ true } });
+	for (auto i = 0; i != 4; ++i) {
+		result.push_back({ AudioDataMessage{ test::Payload(test::kOpusHighBytes) } });
+	}
+	result.push_back({ CapabilitiesMessage{ kSupportedCapabilities } });
+	return result;
+}
+
+void SerializePacket(
+		rtc::CopyOnWriteBuffer &to,
+		const std::vector<Message> &messages,
+		uint32_t &counter) {
+	for (const auto &message : messages) {
+		const auto requiresAck = absl::visit([](const auto &data) {
+			return std::decay_t<decltype(data)>::kRequiresAck;
+		}, message.data);
+		const auto seq = ++counter | (requiresAck ? kMessageRequiresAckSeqBit : 0);
+		SerializeMessageWithSeq(to, message, seq, false);
+	}
+}
+
+size_t DeserializePacket(const rtc::CopyOnWriteBuffer &packet) {
+	rtc::ByteBufferReader reader(packet.cdata<char>(), packet.size());
+	auto result = size_t(0);
+	auto seq = uint32_t();
+	while (reader.ReadUInt32(&seq)) {
+		const auto message = DeserializeMessage(reader, false, &packet);
+		if (!message) {
+			return 0;
+		}
+		++result;
+	}
+	return result;
+}
+
+void BM_SerializePacket(benchmark::State &state) {
+	const auto messages = PacketMessages();
+	auto counter = uint32_t(0);
+	auto bytes = size_t(0);
+	for (auto _ : state) {
+		auto packet = rtc::CopyOnWriteBuffer(0, 1500);
+		SerializePacket(packet, messages, counter);
+		bytes += packet.size();
+		benchmark::DoNotOptimize(packet.cdata());
+	}
+	state.SetBytesProcessed(int64_t(bytes));
+}
+BENCHMARK(BM_SerializePacket);
+
+void BM_DeserializePacket(benchmark::State &state) {
+	const auto messages = PacketMessages();
+	auto counter = uint32_t(0);
+	auto packet = rtc::CopyOnWriteBuffer();
+	SerializePacket(packet, messages, counter);
+	for (auto _ : state) {
+		if (DeserializePacket(packet) != messages.size()) {
+			state.SkipWithError("Could not deserialize the packet.");
+			break;
+		}
+	}
+	state.SetBytesProcessed(int64_t(state.iterations() * packet.size()));
+	state.counters["bytes"] = double(packet.size());
+}
+BENCHMARK(BM_DeserializePacket);
+
+} // namespace
+} // namespace tgcalls
+
+BENCHMARK_MAIN();
@@ -0,0 +1,154 @@
+// Google Benchmark suite measuring the cost of one network thread wakeup
+// against the number of open calls, one UDP socket each, over loopback.
+// Every iteration a datagram arrives for one of the sockets and the
+// thread waits, finds the socket and reads it:
+//   0 - poll() over all sockets, as a server that walks every dispatcher,
+//   1 - level-triggered epoll of all sockets with a recvfrom per event,
+//       as PhysicalSocketServer with its sockets does on Linux.
+// Runs without WebRTC.
+
+#include "UdpBatch.h"
+
+#include "benchmark/benchmark.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+enum class Mode {
+	Poll,
+	Epoll,
+};
+
+int OpenLoopback(sockaddr_in *address) {
+	const auto descriptor = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	*address = sockaddr_in();
+	address->sin_family = AF_INET;
+	address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (descriptor < 0
+		|| ::bind(descriptor, reinterpret_cast<sockaddr*>(address), sizeof(*address)) != 0) {
+		return -1;
+	}
+	auto length = socklen_t(sizeof(*address));
+	::getsockname(descriptor, reinterpret_cast<sockaddr*>(address), &length);
+	return descriptor;
+}
+
+void RaiseDescriptorsLimit() {
+	auto limit = rlimit();
+	if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		::setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+struct Socket {
+	int descriptor = -1;
+	sockaddr_in address = sockaddr_in();
+};
+
+void BM_Wakeup(benchmark::State &state) {
+	const auto mode = Mode(state.range(0));
+	const auto calls = int(state.range(1));
+
+	RaiseDescriptorsLimit();
+	auto senderAddress = sockaddr_in();
+	const auto sender = OpenLoopback(&senderAddress);
+	auto received = int64_t(0);
+	auto sockets = std::vector<std::unique_ptr<Socket>>();
+	for (auto i = 0; i != calls; ++i) {
+		auto socket = std::make_unique<Socket>();
+		socket->descriptor = OpenLoopback(&socket->address);
+		if (socket->descriptor < 0) {
+			state.SkipWithError("Could not create the sockets.");
+			return;
+		}
+		sockets.push_back(std::move(socket));
+	}
+
+	const auto epoll = ::epoll_create1(EPOLL_CLOEXEC);
+	auto pollDescriptors = std::vector<pollfd>();
+	for (const auto &socket : sockets) {
+		if (mode == Mode::Poll) {
+			pollDescriptors.push_back({ socket->descriptor, POLLIN, 0 });
+		} else {
+			auto event = epoll_event();
+			event.events = EPOLLIN;
+			event.data.ptr = socket.get();
+			::epoll_ctl(epoll, EPOLL_CTL_ADD, socket->descriptor, &event);
+		}
+	}
+
+	const char payload[100] = { 0 };
+	char buffer[kUdpMaxDatagramSize];
+	epoll_event events[128];
+	auto index = 0;
+	for (auto _ : state) {
+		const auto &target = sockets[index];
+		index = (index + 1) % calls;
+		::sendto(
+			sender,
+			payload,
+			sizeof(payload),
+			0,
+			reinterpret_cast<const sockaddr*>(&target->address),
+			sizeof(target->address));
+
+		const auto expected = received + 1;
+		while (received < expected) {
+			switch (mode) {
+			case Mode::Poll: {
+				::poll(pollDescriptors.data(), pollDescriptors.size(), -1);
+				for (auto &descriptor : pollDescriptors) {
+					if (descriptor.revents & POLLIN) {
+						if (::recvfrom(descriptor.fd, buffer, sizeof(buffer), 0, nullptr, nullptr) > 0) {
+							++received;
+						}
+					}
+				}
+			} break;
+			case Mode::Epoll: {
+				const auto count = ::epoll_wait(epoll, events, 128, -1);
+				for (auto i = 0; i < count; ++i) {
+					const auto socket = static_cast<Socket*>(events[i].data.ptr);
+					if (::recvfrom(socket->descriptor, buffer, sizeof(buffer), 0, nullptr, nullptr) > 0) {
+						++received;
+					}
+				}
+			} break;
+			}
+		}
+	}
+
+	for (const auto &socket : sockets) {
+		::close(socket->descriptor);
+	}
+	::close(epoll);
+	::close(sender);
+	state.SetItemsProcessed(received);
+}
+
+void WakeupArguments(benchmark::internal::Benchmark *benchmark) {
+	benchmark->ArgNames({ "mode", "calls" });
+	for (const auto mode : { Mode::Poll, Mode::Epoll }) {
+		for (const auto calls : { 1, 10, 100, 1000 }) {
+			benchmark->Args({ int(mode), calls });
+		}
+	}
+}
+
+BENCHMARK(BM_Wakeup)->Apply(WakeupArguments);
+
+} // namespace
+} // namespace tgcalls
+
+BENCHMARK_MAIN();
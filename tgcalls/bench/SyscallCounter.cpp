@@ -0,0 +1,62 @@
+#include "bench/SyscallCounter.h"
+
+#include <sys/socket.h>
+
+#include <atomic>
+
+namespace {
+
+std::atomic<int64_t> Calls{ 0 };
+
+} // namespace
+
+extern "C" {
+
+ssize_t __real_sendto(int fd, const void *data, size_t size, int flags, const sockaddr *address, socklen_t length);
+ssize_t __real_sendmsg(int fd, const msghdr *message, int flags);
+int __real_sendmmsg(int fd, mmsghdr *messages, unsigned int count, int flags);
+ssize_t __real_recvfrom(int fd, void *data, size_t size, int flags, sockaddr *address, socklen_t *length);
+ssize_t __real_recvmsg(int fd, msghdr *message, int flags);
+int __real_recvmmsg(int fd, mmsghdr *messages, unsigned int count, int flags, timespec *timeout);
+
+ssize_t __wrap_sendto(int fd, const void *data, size_t size, int flags, const sockaddr *address, socklen_t length) {
+	++Calls;
+	return __real_sendto(fd, data, size, flags, address, length);
+}
+
+ssize_t __wrap_sendmsg(int fd, const msghdr *message, int flags) {
+	++Calls;
+	return __real_sendmsg(fd, message, flags);
+}
+
+int __wrap_sendmmsg(int fd, mmsghdr *messages, unsigned int count, int flags) {
+	++Calls;
+	return __real_sendmmsg(fd, messages, count, flags);
+}
+
+ssize_t __wrap_recvfrom(int fd, void *data, size_t size, int flags, sockaddr *address, socklen_t *length) {
+	++Calls;
+	return __real_recvfrom(fd, data, size, flags, address, length);
+}
+
+ssize_t __wrap_recvmsg(int fd, msghdr *message, int flags) {
+	++Calls;
+	return __real_recvmsg(fd, message, flags);
+}
+
+int __wrap_recvmmsg(int fd, mmsghdr *messages, unsigned int count, int flags, timespec *timeout) {
+	++Calls;
+	return __real_recvmmsg(fd, messages, count, flags, timeout);
+}
+
+} // extern "C"
+
+namespace tgcalls {
+namespace bench {
+
+int64_t SocketCalls() {
+	return Calls.load();
+}
+
+} // namespace bench
+} // namespace tgcalls
@@ -0,0 +1,16 @@
+#ifndef TGCALLS_BENCH_SYSCALL_COUNTER_H
+#define TGCALLS_BENCH_SYSCALL_COUNTER_H
+
+#include <cstdint>
+
+namespace tgcalls {
+namespace bench {
+
+// Count of socket send and receive calls made by the process. They are
+// wrapped at link time by tgcalls_count_socket_calls() in CMakeLists.txt.
+int64_t SocketCalls();
+
+} // namespace bench
+} // namespace tgcalls
+
+#endif
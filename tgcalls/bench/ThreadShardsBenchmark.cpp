@@ -0,0 +1,128 @@
+// Google Benchmark suite measuring the packet work of many calls against
+// the number of thread shards, with the network threads pinned to cores
+// or not. Each call is a pair of EncryptedConnection-s living on the
+// network thread of the shard it got, and every iteration each call
+// encrypts and decrypts one second of 32 kbps audio there.
+// The "calls" counter is how many such calls the process keeps up with
+// in real time. Needs WebRTC.
+
+#include "ThreadShards.h"
+#include "EncryptedConnection.h"
+#include "test/Fixtures.h"
+
+#include "rtc_base/event.h"
+#include "rtc_base/thread.h"
+
+#include "benchmark/benchmark.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+// Opus frames of 20 ms.
+constexpr auto kPacketsPerSecond = 50;
+
+// Both ends of one call, used only on the shard's network thread.
+struct Call {
+	explicit Call(const ThreadShard &shard)
+	: shard(shard)
+	, key(test::MakeKey())
+	, outgoing(EncryptedConnection::Type::Transport, EncryptionKey(key, true), [](int, int) {})
+	, incoming(EncryptedConnection::Type::Transport, EncryptionKey(key, false), [](int, int) {})
+	, payload(test::Payload(test::kOpusHighBytes)) {
+	}
+
+	// Returns false if some packet didn't get through.
+	bool exchangeSecond() {
+		for (auto i = 0; i != kPacketsPerSecond; ++i) {
+			const auto packet = outgoing.prepareForSending(
+				Message{ AudioDataMessage{ payload } });
+			if (!packet) {
+				return false;
+			}
+			const auto received = incoming.handleIncomingPacket(
+				packet->bytes.cdata<char>(),
+				packet->bytes.size());
+			if (!received || !absl::get_if<AudioDataMessage>(&received->main.message.data)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	const ThreadShard &shard;
+	std::shared_ptr<std::array<uint8_t, EncryptionKey::kSize>> key;
+	EncryptedConnection outgoing;
+	EncryptedConnection incoming;
+	rtc::CopyOnWriteBuffer payload;
+};
+
+void BM_CallsThroughput(benchmark::State &state) {
+	const auto shardsCount = int(state.range(0));
+	const auto callsCount = int(state.range(1));
+	const auto pinned = (state.range(2) != 0);
+
+	ThreadShardPool shards(shardsCount, pinned);
+	auto calls = std::vector<std::unique_ptr<Call>>();
+	for (auto i = 0; i != callsCount; ++i) {
+		const auto &shard = shards.acquire();
+		shard.network->Invoke<void>(RTC_FROM_HERE, [&] {
+			calls.push_back(std::make_unique<Call>(shard));
+		});
+	}
+
+	auto failed = std::atomic<bool>{ false };
+	for (auto _ : state) {
+		auto remaining = std::atomic<int>{ callsCount };
+		rtc::Event done;
+		for (const auto &call : calls) {
+			call->shard.network->PostTask(RTC_FROM_HERE, [&, call = call.get()] {
+				if (!call->exchangeSecond()) {
+					failed = true;
+				}
+				if (--remaining == 0) {
+					done.Set();
+				}
+			});
+		}
+		done.Wait(rtc::Event::kForever);
+	}
+
+	for (auto &call : calls) {
+		const auto &shard = call->shard;
+		shard.network->Invoke<void>(RTC_FROM_HERE, [&] {
+			call = nullptr;
+		});
+		shards.release(shard);
+	}
+	if (failed) {
+		state.SkipWithError("Could not exchange the packets.");
+		return;
+	}
+	state.SetItemsProcessed(state.iterations() * callsCount * kPacketsPerSecond);
+	state.counters["calls"] = benchmark::Counter(
+		double(state.iterations() * callsCount),
+		benchmark::Counter::kIsRate);
+}
+
+void ThroughputArguments(benchmark::internal::Benchmark *benchmark) {
+	benchmark->ArgNames({ "shards", "calls", "pinned" });
+	for (const auto shards : { 1, 2, 4, 8 }) {
+		for (const auto calls : { 1, 16, 256 }) {
+			for (const auto pinned : { 0, 1 }) {
+				benchmark->Args({ shards, calls, pinned });
+			}
+		}
+	}
+}
+
+// The work runs on the shard threads, the benchmark thread only waits.
+BENCHMARK(BM_CallsThroughput)->Apply(ThroughputArguments)->UseRealTime();
+
+} // namespace
+} // namespace tgcalls
+
+BENCHMARK_MAIN();
@@ -0,0 +1,110 @@
+// Google Benchmark suite comparing the batched UDP sockets with the basic
+// WebRTC ones over loopback, reporting socket syscalls per packet and
+// process CPU time per sent Mbit. Needs WebRTC, UdpBatchBenchmark.cpp
+// measures the same without it.
+
+#include "BatchedPacketSocketFactory.h"
+#include "bench/SyscallCounter.h"
+
+#include "rtc_base/async_packet_socket.h"
+#include "rtc_base/physical_socket_server.h"
+#include "rtc_base/thread.h"
+#include "rtc_base/third_party/sigslot/sigslot.h"
+
+#include "benchmark/benchmark.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <ctime>
+#include <memory>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+class Receiver final : public sigslot::has_slots<> {
+public:
+	void onReadPacket(
+			rtc::AsyncPacketSocket *socket,
+			const char *data,
+			size_t size,
+			const rtc::SocketAddress &address,
+			const int64_t &timestamp) {
+		++packets;
+	}
+
+	int64_t packets = 0;
+
+};
+
+// Sends 'burst' datagrams per thread loop turn, as the network thread
+// does with a paced bundle, and lets the same turn read them back.
+void BM_UdpLoopback(benchmark::State &state) {
+	const auto batched = (state.range(0) != 0);
+	const auto size = size_t(state.range(1));
+	const auto burst = int(state.range(2));
+
+	rtc::PhysicalSocketServer server;
+	rtc::AutoSocketServerThread thread(&server);
+	auto factory = std::unique_ptr<rtc::BasicPacketSocketFactory>();
+	if (batched) {
+		factory = std::make_unique<BatchedPacketSocketFactory>(&thread, &server);
+	} else {
+		factory = std::make_unique<rtc::BasicPacketSocketFactory>(&thread);
+	}
+	const auto loopback = rtc::SocketAddress(rtc::IPAddress(INADDR_LOOPBACK), 0);
+	const auto sender = std::unique_ptr<rtc::AsyncPacketSocket>(
+		factory->CreateUdpSocket(loopback, 0, 0));
+	const auto receiver = std::unique_ptr<rtc::AsyncPacketSocket>(
+		factory->CreateUdpSocket(loopback, 0, 0));
+	if (!sender || !receiver) {
+		state.SkipWithError("Could not create the sockets.");
+		return;
+	}
+	Receiver counter;
+	receiver->SignalReadPacket.connect(&counter, &Receiver::onReadPacket);
+
+	const auto payload = std::vector<char>(size, 'x');
+	const auto to = receiver->GetLocalAddress();
+	const auto options = rtc::PacketOptions();
+	auto sent = int64_t(0);
+	const auto callsBefore = bench::SocketCalls();
+	const auto cpuBefore = std::clock();
+	for (auto _ : state) {
+		for (auto i = 0; i != burst; ++i) {
+			if (sender->SendTo(payload.data(), size, to, options) == int(size)) {
+				++sent;
+			}
+		}
+		thread.ProcessMessages(0);
+	}
+	const auto cpu = double(std::clock() - cpuBefore) / CLOCKS_PER_SEC;
+	const auto calls = double(bench::SocketCalls() - callsBefore);
+	const auto megabits = double(sent) * size * 8 / 1e6;
+
+	state.SetItemsProcessed(sent);
+	state.SetBytesProcessed(int64_t(sent * size));
+	state.counters["syscalls_per_packet"] = sent ? (calls / sent) : 0.;
+	state.counters["cpu_us_per_mbit"] = megabits ? (cpu * 1e6 / megabits) : 0.;
+	state.counters["received"] = sent ? (double(counter.packets) / sent) : 0.;
+}
+
+void LoopbackArguments(benchmark::internal::Benchmark *benchmark) {
+	benchmark->ArgNames({ "batched", "size", "burst" });
+	for (const auto batched : { 0, 1 }) {
+		// Opus frames, bundled audio and MTU-sized video.
+		for (const auto size : { 100, 400, 1200 }) {
+			for (const auto burst : { 1, 4, 16 }) {
+				benchmark->Args({ batched, size, burst });
+			}
+		}
+	}
+}
+
+BENCHMARK(BM_UdpLoopback)->Apply(LoopbackArguments)->UseRealTime();
+
+} // namespace
+} // namespace tgcalls
+
+BENCHMARK_MAIN();
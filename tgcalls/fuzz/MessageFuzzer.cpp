@@ -0,0 +1,53 @@
+// libFuzzer entry point for the message parser.
+//
+// Run it as ./message_fuzzer [corpus directory].
+
+#include "Message.h"
+#include "EncryptedConnection.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+// Walks the decrypted packet layout: seq, message, then seq and message
+// for each additional message, the way the connection parses it.
+void ParsePacket(const rtc::CopyOnWriteBuffer &source, bool slice) {
+	rtc::ByteBufferReader reader(source.cdata<char>(), source.size());
+	auto seq = uint32_t();
+	if (!reader.ReadUInt32(&seq)) {
+		return;
+	}
+	auto additional = false;
+	while (true) {
+		const auto singleMessagePacket = (seq & tgcalls::kSingleMessagePacketSeqBit) != 0;
+		if (singleMessagePacket && additional) {
+			return;
+		}
+		const auto message = tgcalls::DeserializeMessage(
+			reader,
+			singleMessagePacket,
+			slice ? &source : nullptr);
+		if (!message) {
+			return;
+		}
+		tgcalls::MessageTypeId(*message);
+		if (!reader.Length() || singleMessagePacket || reader.Length() < 5) {
+			return;
+		}
+		reader.ReadUInt32(&seq);
+		additional = true;
+	}
+}
+
+} // namespace
+
+// The input is the packet contents after decryption, starting with seq.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	const auto source = rtc::CopyOnWriteBuffer(data, size);
+
+	// Parse both ways: data messages are sliced from the source if given.
+	ParsePacket(source, false);
+	ParsePacket(source, true);
+	return 0;
+}
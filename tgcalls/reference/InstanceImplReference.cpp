@@ -633,7 +633,7 @@ private:
     
     void sendPendingServiceMessages(int cause) {
         if (const auto prepared = _signalingConnection->prepareForSendingService(cause)) {
-            _signalingDataEmitted(prepared->bytes);
+            _signalingDataEmitted(ToBytes(prepared->bytes));
         }
     }
     
@@ -642,7 +642,7 @@ private:
         packet.SetData(buffer.Data(), buffer.Length());
         
         if (const auto prepared = _signalingConnection->prepareForSending(Message{ UnstructuredDataMessage{ packet } })) {
-            _signalingDataEmitted(prepared->bytes);
+            _signalingDataEmitted(ToBytes(prepared->bytes));
         }
     }
     
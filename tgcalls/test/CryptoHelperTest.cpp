@@ -0,0 +1,119 @@
+// GoogleTest checks of CryptoHelper.
+
+#include "CryptoHelper.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+// Around the AES block size, a full transport packet and more.
+const size_t kSizes[] = {
+	0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 255, 256, 257, 1452, 4096, 65537,
+};
+
+// Low 32 bits of the initial counter block, the last ones wrap into
+// the higher bytes within the first few blocks.
+const uint32_t kCounters[] = {
+	0x00000000U, 0x12345678U, 0xFFFFFFFEU, 0xFFFFFFFFU,
+};
+
+// Misaligned input and output.
+const size_t kOffsets[] = { 0, 1, 3, 8, 15 };
+
+AesKeyIv MakeKeyIv(int seed, uint32_t counter, bool wrapHigh) {
+	auto result = AesKeyIv();
+	for (auto i = size_t(); i != result.key.size(); ++i) {
+		result.key[i] = uint8_t(seed * 73 + i * 29 + 1);
+	}
+	for (auto i = size_t(); i != result.iv.size(); ++i) {
+		result.iv[i] = wrapHigh ? uint8_t(0xFF) : uint8_t(seed * 11 + i * 7 + 5);
+	}
+	result.iv[12] = uint8_t(counter >> 24);
+	result.iv[13] = uint8_t(counter >> 16);
+	result.iv[14] = uint8_t(counter >> 8);
+	result.iv[15] = uint8_t(counter);
+	return result;
+}
+
+std::vector<uint8_t> MakeInput(size_t size) {
+	auto result = std::vector<uint8_t>(size);
+	for (auto i = size_t(); i != size; ++i) {
+		result[i] = uint8_t(i * 131 + 17);
+	}
+	return result;
+}
+
+void CheckSameAsLegacy(const AesKeyIv &keyIv, size_t size, size_t offset) {
+	SCOPED_TRACE(::testing::Message() << "size " << size << ", offset " << offset);
+
+	const auto input = MakeInput(size);
+	auto source = std::vector<uint8_t>(offset + size);
+	std::copy(input.begin(), input.end(), source.begin() + offset);
+
+	auto legacy = std::vector<uint8_t>(offset + size);
+	auto legacyKeyIv = keyIv;
+	AesProcessCtrLegacy(
+		MemorySpan{ source.data() + offset, size },
+		legacy.data() + offset,
+		std::move(legacyKeyIv));
+
+	auto evp = std::vector<uint8_t>(offset + size);
+	ASSERT_TRUE(AesProcessCtrEvp(
+		MemorySpan{ source.data() + offset, size },
+		evp.data() + offset,
+		keyIv));
+	EXPECT_EQ(legacy, evp);
+
+	auto inPlace = source;
+	auto inPlaceKeyIv = keyIv;
+	ASSERT_TRUE(AesProcessCtr(
+		MemorySpan{ inPlace.data() + offset, size },
+		inPlace.data() + offset,
+		std::move(inPlaceKeyIv)));
+	EXPECT_EQ(legacy, inPlace);
+
+	// CTR is its own inverse.
+	auto decrypted = std::vector<uint8_t>(size);
+	ASSERT_TRUE(AesProcessCtrEvp(
+		MemorySpan{ evp.data() + offset, size },
+		decrypted.data(),
+		keyIv));
+	EXPECT_EQ(input, decrypted);
+}
+
+TEST(AesProcessCtrTest, EvpMatchesLegacy) {
+	auto seed = 0;
+	for (const auto counter : kCounters) {
+		for (const auto wrapHigh : { false, true }) {
+			const auto keyIv = MakeKeyIv(++seed, counter, wrapHigh);
+			for (const auto size : kSizes) {
+				for (const auto offset : kOffsets) {
+					CheckSameAsLegacy(keyIv, size, offset);
+				}
+			}
+		}
+	}
+}
+
+TEST(AesProcessCtrTest, EvpMatchesLegacyForPacketKeys) {
+	auto key = std::array<uint8_t, 256>();
+	for (auto i = size_t(); i != key.size(); ++i) {
+		key[i] = uint8_t(i * 97 + 13);
+	}
+	for (auto i = 0; i != 64; ++i) {
+		auto msgKey = std::array<uint8_t, 16>();
+		for (auto j = size_t(); j != msgKey.size(); ++j) {
+			msgKey[j] = uint8_t(i * 37 + j * 3);
+		}
+		const auto x = (i % 2 ? 0 : 8) + (i % 4 < 2 ? 0 : 128);
+		const auto keyIv = PrepareAesKeyIv(key.data(), msgKey.data(), x);
+		CheckSameAsLegacy(keyIv, 20 + i * 23, size_t(i % 16));
+	}
+}
+
+} // namespace
+} // namespace tgcalls
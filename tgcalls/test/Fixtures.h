@@ -0,0 +1,39 @@
+#ifndef TGCALLS_TEST_FIXTURES_H
+#define TGCALLS_TEST_FIXTURES_H
+
+#include "Instance.h"
+
+#include "rtc_base/copy_on_write_buffer.h"
+
+#include <array>
+#include <memory>
+
+namespace tgcalls {
+namespace test {
+
+// Opus 20 ms frames at 6 and 32 kbps, a full video packet.
+constexpr auto kOpusLowBytes = 15;
+constexpr auto kOpusHighBytes = 80;
+constexpr auto kVideoBytes = 1200;
+
+// Not all zeroes, so that it isn't mistaken for padding.
+inline rtc::CopyOnWriteBuffer Payload(size_t size) {
+	auto result = rtc::CopyOnWriteBuffer(size);
+	for (auto i = size_t(); i != size; ++i) {
+		result.data()[i] = uint8_t(i * 31 + 7);
+	}
+	return result;
+}
+
+inline std::shared_ptr<std::array<uint8_t, EncryptionKey::kSize>> MakeKey() {
+	auto result = std::make_shared<std::array<uint8_t, EncryptionKey::kSize>>();
+	for (auto i = 0; i != EncryptionKey::kSize; ++i) {
+		(*result)[i] = uint8_t(i * 17 + 3);
+	}
+	return result;
+}
+
+} // namespace test
+} // namespace tgcalls
+
+#endif
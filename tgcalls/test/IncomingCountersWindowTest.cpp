@@ -0,0 +1,146 @@
+// GoogleTest checks of the incoming packet counters replay window.
+
+#include "EncryptedConnection.h"
+
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <set>
+
+namespace tgcalls {
+namespace {
+
+constexpr auto kSize = IncomingCountersWindow::kSize;
+constexpr auto kRing = IncomingCountersWindow::kBlocks * 64;
+
+// What the window should answer: counters not seen yet and not older
+// than kSize below the largest one seen.
+class Model {
+public:
+	bool registerCounter(uint32_t counter) {
+		if (uint64_t(counter) + kSize <= _largest || !_seen.insert(counter).second) {
+			return false;
+		}
+		_largest = std::max(_largest, counter);
+		return true;
+	}
+
+private:
+	std::set<uint32_t> _seen;
+	uint32_t _largest = 0;
+
+};
+
+TEST(IncomingCountersWindowTest, AcceptsInOrderOnce) {
+	auto window = IncomingCountersWindow();
+	for (auto counter = uint32_t(1); counter != 1000; ++counter) {
+		EXPECT_TRUE(window.registerCounter(counter));
+		EXPECT_FALSE(window.registerCounter(counter));
+	}
+}
+
+TEST(IncomingCountersWindowTest, SlidesOverTheLastSize) {
+	auto window = IncomingCountersWindow();
+	EXPECT_TRUE(window.registerCounter(1000));
+
+	// Only the counters in (largest - kSize, largest] are kept.
+	EXPECT_FALSE(window.registerCounter(1000 - kSize));
+	EXPECT_TRUE(window.registerCounter(1000 - kSize + 1));
+	EXPECT_FALSE(window.registerCounter(1000 - kSize + 1));
+	EXPECT_TRUE(window.registerCounter(999));
+
+	// Moving by one drops the oldest one.
+	EXPECT_TRUE(window.registerCounter(1001));
+	EXPECT_FALSE(window.registerCounter(1001 - kSize));
+	EXPECT_TRUE(window.registerCounter(1001 - kSize + 1));
+	EXPECT_FALSE(window.registerCounter(999));
+}
+
+TEST(IncomingCountersWindowTest, RejectsTooOld) {
+	auto window = IncomingCountersWindow();
+	EXPECT_TRUE(window.registerCounter(5000));
+	for (auto counter = uint32_t(0); counter <= 5000 - kSize; counter += 7) {
+		EXPECT_FALSE(window.registerCounter(counter));
+	}
+	EXPECT_FALSE(window.registerCounter(0));
+}
+
+TEST(IncomingCountersWindowTest, WrapsAtBlockBoundary) {
+	auto window = IncomingCountersWindow();
+	EXPECT_TRUE(window.registerCounter(63));
+	EXPECT_TRUE(window.registerCounter(64));
+	EXPECT_TRUE(window.registerCounter(127));
+	EXPECT_TRUE(window.registerCounter(128));
+	EXPECT_FALSE(window.registerCounter(127));
+	EXPECT_FALSE(window.registerCounter(128));
+	EXPECT_TRUE(window.registerCounter(65));
+	EXPECT_FALSE(window.registerCounter(64));
+
+	// The same ring slot and bit as an old counter, but a fresh one.
+	EXPECT_TRUE(window.registerCounter(64 + kRing));
+	EXPECT_TRUE(window.registerCounter(128 + kRing));
+	EXPECT_TRUE(window.registerCounter(127 + kRing));
+	EXPECT_FALSE(window.registerCounter(128));
+}
+
+TEST(IncomingCountersWindowTest, ClearsAllBlocksOnLargeJump) {
+	auto window = IncomingCountersWindow();
+	for (auto counter = uint32_t(1); counter != 200; ++counter) {
+		EXPECT_TRUE(window.registerCounter(counter));
+	}
+	const auto jump = uint32_t(199 + 10 * kRing);
+	EXPECT_TRUE(window.registerCounter(jump));
+
+	// Every counter still in the window is new, whatever its slot.
+	for (auto counter = jump - kSize + 1; counter != jump; ++counter) {
+		EXPECT_TRUE(window.registerCounter(counter));
+	}
+	EXPECT_FALSE(window.registerCounter(jump - kSize));
+	EXPECT_FALSE(window.registerCounter(199));
+}
+
+TEST(IncomingCountersWindowTest, HandlesLargeCounters) {
+	auto window = IncomingCountersWindow();
+	const auto large = (uint32_t(1) << 30) - 1;
+	EXPECT_TRUE(window.registerCounter(large - 1));
+	EXPECT_TRUE(window.registerCounter(large));
+	EXPECT_FALSE(window.registerCounter(large - 1));
+	EXPECT_TRUE(window.registerCounter(large - kSize + 1));
+	EXPECT_FALSE(window.registerCounter(large - kSize));
+}
+
+TEST(IncomingCountersWindowTest, MatchesModelOnRandomArrivals) {
+	auto seed = uint32_t(12345);
+	const auto random = [&] {
+		seed = seed * 1103515245U + 12345U;
+		return seed >> 8;
+	};
+	for (auto run = 0; run != 50; ++run) {
+		auto window = IncomingCountersWindow();
+		auto model = Model();
+		auto next = uint32_t(1);
+		for (auto i = 0; i != 5000; ++i) {
+			const auto kind = random() % 100;
+			auto counter = next;
+			if (kind < 60) {
+				counter = next++;
+			} else if (kind < 85) {
+				// Reordered or repeated recent one.
+				counter = next - std::min(next, random() % (2 * kSize));
+			} else if (kind < 95) {
+				// A gap, the skipped ones may arrive later.
+				next += random() % (kSize / 2);
+				counter = next++;
+			} else {
+				// Far ahead, over the whole ring.
+				next += random() % (4 * kRing);
+				counter = next++;
+			}
+			ASSERT_EQ(model.registerCounter(counter), window.registerCounter(counter))
+				<< "run " << run << ", counter " << counter;
+		}
+	}
+}
+
+} // namespace
+} // namespace tgcalls
@@ -0,0 +1,202 @@
+// GoogleTest check that the steady-state receive path doesn't allocate:
+// decrypting a packet in EncryptedConnection, then handing each media
+// message to the media thread through ThreadLocalObject::perform, as
+// Manager does with what NetworkManager delivers. NetworkManager itself
+// needs a live transport channel, so its routing of the messages (a type
+// switch and a std::function call) is not run here. The task posted by
+// perform into an empty list allocates inside rtc::Thread, so the media
+// thread is held while counting and that post happens before.
+// It replaces the global operator new, so it is a binary of its own.
+
+#include "EncryptedConnection.h"
+#include "ThreadLocalObject.h"
+#include "test/Fixtures.h"
+
+#include "rtc_base/event.h"
+#include "rtc_base/thread.h"
+
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace {
+
+std::atomic<bool> CountAllocations{ false };
+std::atomic<int64_t> Allocations{ 0 };
+
+} // namespace
+
+void *operator new(size_t size) {
+	if (CountAllocations) {
+		++Allocations;
+	}
+	if (const auto result = std::malloc(size ? size : 1)) {
+		return result;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+namespace tgcalls {
+namespace {
+
+constexpr auto kWarmUpPackets = 100;
+constexpr auto kCountedPackets = 300;
+
+// Packets in flight to the media thread at once, fewer messages than
+// ThreadLocalObject keeps preallocated tasks.
+constexpr auto kHandoffPackets = 10;
+
+struct Connections {
+	explicit Connections(bool capabilities)
+	: key(test::MakeKey())
+	, outgoing(EncryptedConnection::Type::Transport, EncryptionKey(key, true), [](int, int) {})
+	, incoming(EncryptedConnection::Type::Transport, EncryptionKey(key, false), [](int, int) {}) {
+		if (capabilities) {
+			outgoing.setPeerCapabilities(kSupportedCapabilities);
+			incoming.setPeerCapabilities(kSupportedCapabilities);
+		}
+	}
+
+	std::shared_ptr<std::array<uint8_t, EncryptionKey::kSize>> key;
+	EncryptedConnection outgoing;
+	EncryptedConnection incoming;
+};
+
+// Bundles of three audio frames, as sent when saving data.
+std::vector<rtc::CopyOnWriteBuffer> PrepareBundles(EncryptedConnection &outgoing, int count) {
+	auto result = std::vector<rtc::CopyOnWriteBuffer>();
+	for (auto i = 0; i != count; ++i) {
+		auto bundle = std::vector<Message>();
+		for (auto j = 0; j != 3; ++j) {
+			bundle.push_back({ AudioDataMessage{ test::Payload(test::kOpusHighBytes) } });
+		}
+		const auto packet = outgoing.prepareForSendingBundle(bundle);
+		if (!packet) {
+			return {};
+		}
+		result.push_back(packet->bytes);
+	}
+	return result;
+}
+
+void CheckReceiveDoesNotAllocate(bool capabilities) {
+	Connections connections(capabilities);
+	const auto packets = PrepareBundles(
+		connections.outgoing,
+		kWarmUpPackets + kCountedPackets);
+	ASSERT_FALSE(packets.empty());
+
+	auto received = 0;
+	for (auto i = 0; i != int(packets.size()); ++i) {
+		if (i == kWarmUpPackets) {
+			Allocations = 0;
+			CountAllocations = true;
+		}
+		const auto &packet = packets[i];
+		if (const auto decrypted = connections.incoming.handleIncomingPacket(
+				packet.cdata<char>(),
+				packet.size())) {
+			received += 1 + int(decrypted->additional.size());
+		}
+	}
+	CountAllocations = false;
+
+	EXPECT_EQ(received, 3 * int(packets.size()));
+	EXPECT_EQ(Allocations.load(), 0);
+}
+
+// Stands for MediaManager on the media thread.
+struct MediaSink {
+	void receiveMessage(DecryptedMessage &&message) {
+		if (absl::get_if<AudioDataMessage>(&message.message.data)) {
+			++received;
+		}
+	}
+
+	int received = 0;
+};
+
+void CheckMediaHandoffDoesNotAllocate(bool capabilities) {
+	Connections connections(capabilities);
+	const auto packets = PrepareBundles(
+		connections.outgoing,
+		kWarmUpPackets + kCountedPackets);
+	ASSERT_FALSE(packets.empty());
+
+	const auto mediaThread = rtc::Thread::Create();
+	mediaThread->Start();
+	auto sink = std::make_unique<ThreadLocalObject<MediaSink>>(
+		mediaThread.get(),
+		[] { return new MediaSink(); });
+	const auto handoff = [&](DecryptedMessage &&message) {
+		sink->perform([message = std::move(message)](MediaSink *media) mutable {
+			media->receiveMessage(std::move(message));
+		});
+	};
+
+	Allocations = 0;
+	auto index = 0;
+	while (index != int(packets.size())) {
+		// Hold the media thread and post the drain task first.
+		rtc::Event release;
+		mediaThread->PostTask(RTC_FROM_HERE, [&] {
+			release.Wait(rtc::Event::kForever);
+		});
+		sink->perform([](MediaSink *) {});
+
+		if (index >= kWarmUpPackets) {
+			CountAllocations = true;
+		}
+		for (auto i = 0; i != kHandoffPackets; ++i, ++index) {
+			const auto &packet = packets[index];
+			if (auto decrypted = connections.incoming.handleIncomingPacket(
+					packet.cdata<char>(),
+					packet.size())) {
+				handoff(std::move(decrypted->main));
+				for (auto &message : decrypted->additional) {
+					handoff(std::move(message));
+				}
+			}
+		}
+		CountAllocations = false;
+
+		release.Set();
+		mediaThread->Invoke<void>(RTC_FROM_HERE, [] {});
+	}
+
+	auto received = 0;
+	mediaThread->Invoke<void>(RTC_FROM_HERE, [&] {
+		received = sink->getSyncAssumingSameThread()->received;
+	});
+	sink = nullptr;
+	mediaThread->Invoke<void>(RTC_FROM_HERE, [] {});
+
+	EXPECT_EQ(received, 3 * int(packets.size()));
+	EXPECT_EQ(Allocations.load(), 0);
+}
+
+TEST(ReceiveAllocationTest, LegacyPacketsDoNotAllocate) {
+	CheckReceiveDoesNotAllocate(false);
+}
+
+TEST(ReceiveAllocationTest, AeadPacketsDoNotAllocate) {
+	CheckReceiveDoesNotAllocate(true);
+}
+
+TEST(ReceiveAllocationTest, MediaHandoffDoesNotAllocate) {
+	CheckMediaHandoffDoesNotAllocate(true);
+}
+
+} // namespace
+} // namespace tgcalls
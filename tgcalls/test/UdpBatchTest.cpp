@@ -0,0 +1,198 @@
+// GoogleTest checks of the sendmmsg and recvmmsg batches over loopback.
+
+#include "UdpBatch.h"
+
+#include "gtest/gtest.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+namespace tgcalls {
+namespace {
+
+class Loopback {
+public:
+	Loopback() {
+		_descriptor = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		auto address = sockaddr_in();
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		::bind(_descriptor, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+		_addressLength = sizeof(_address);
+		::getsockname(_descriptor, reinterpret_cast<sockaddr*>(&_address), &_addressLength);
+	}
+	~Loopback() {
+		::close(_descriptor);
+	}
+
+	int descriptor() const {
+		return _descriptor;
+	}
+	const sockaddr_storage &address() const {
+		return _address;
+	}
+	socklen_t addressLength() const {
+		return _addressLength;
+	}
+
+private:
+	int _descriptor = -1;
+	sockaddr_storage _address = sockaddr_storage();
+	socklen_t _addressLength = 0;
+
+};
+
+std::vector<uint8_t> Datagram(int index, size_t size) {
+	auto result = std::vector<uint8_t>(size);
+	for (auto i = size_t(); i != size; ++i) {
+		result[i] = uint8_t(index * 13 + i);
+	}
+	return result;
+}
+
+TEST(UdpBatchTest, SendsQueuedDatagramsInOrder) {
+	Loopback sender, receiver;
+	auto batch = UdpSendBatch();
+	auto receiveBatch = UdpReceiveBatch();
+
+	// Leave some queued, so that the next rounds wrap around the slots.
+	for (auto round = 0; round != 3; ++round) {
+		const auto count = 20;
+		for (auto i = 0; i != count; ++i) {
+			const auto datagram = Datagram(round * count + i, 100 + i);
+			ASSERT_GE(batch.push(datagram.data(), datagram.size(), receiver.address(), receiver.addressLength()), 0);
+		}
+		const auto result = batch.flush(sender.descriptor());
+		EXPECT_EQ(result.deliveredCount, count);
+		EXPECT_EQ(result.failedCount, 0);
+		EXPECT_FALSE(result.blocked);
+		EXPECT_TRUE(batch.empty());
+
+		auto received = 0;
+		while (received < count) {
+			const auto read = receiveBatch.receive(receiver.descriptor());
+			ASSERT_GT(read, 0);
+			for (auto i = 0; i != read; ++i, ++received) {
+				const auto expected = Datagram(round * count + received, 100 + received);
+				ASSERT_FALSE(receiveBatch.truncated(i));
+				ASSERT_EQ(receiveBatch.size(i), expected.size());
+				EXPECT_EQ(std::memcmp(receiveBatch.data(i), expected.data(), expected.size()), 0);
+			}
+		}
+	}
+	EXPECT_EQ(receiveBatch.receive(receiver.descriptor()), 0);
+}
+
+// Reads datagrams until all the expected ones came, in the same order.
+void ExpectReceived(const Loopback &receiver, const std::vector<std::vector<uint8_t>> &expected) {
+	auto receiveBatch = UdpReceiveBatch();
+	auto received = size_t(0);
+	while (received < expected.size()) {
+		const auto read = receiveBatch.receive(receiver.descriptor());
+		ASSERT_GT(read, 0);
+		ASSERT_LE(received + read, expected.size());
+		for (auto i = 0; i != read; ++i, ++received) {
+			ASSERT_FALSE(receiveBatch.truncated(i));
+			ASSERT_EQ(receiveBatch.size(i), expected[received].size());
+			EXPECT_EQ(std::memcmp(receiveBatch.data(i), expected[received].data(), expected[received].size()), 0);
+		}
+	}
+}
+
+TEST(UdpBatchTest, SegmentsRunsOfSameSizeAndAddress) {
+	for (const auto segmentation : { true, false }) {
+		Loopback sender, first, second;
+		auto batch = UdpSendBatch(segmentation);
+		auto toFirst = std::vector<std::vector<uint8_t>>();
+		auto toSecond = std::vector<std::vector<uint8_t>>();
+		const auto push = [&](const Loopback &to, int index, size_t size) {
+			auto datagram = Datagram(index, size);
+			batch.push(datagram.data(), datagram.size(), to.address(), to.addressLength());
+			(&to == &first ? toFirst : toSecond).push_back(std::move(datagram));
+		};
+
+		// Leave the next flush wrapping around the slots.
+		for (auto i = 0; i != 20; ++i) {
+			push(first, i, 1200);
+		}
+		ASSERT_EQ(batch.flush(sender.descriptor()).deliveredCount, 20);
+		ExpectReceived(first, toFirst);
+		toFirst.clear();
+
+		// Two runs to the first address split by a shorter datagram,
+		// then a run to the second one.
+		for (auto i = 0; i != 10; ++i) {
+			push(first, i, 1200);
+		}
+		push(first, 100, 300);
+		for (auto i = 0; i != 10; ++i) {
+			push(first, 10 + i, 1200);
+		}
+		for (auto i = 0; i != 8; ++i) {
+			push(second, i, 1200);
+		}
+		const auto result = batch.flush(sender.descriptor());
+		EXPECT_EQ(result.deliveredCount, 29);
+		EXPECT_EQ(result.failedCount, 0);
+		EXPECT_FALSE(result.blocked);
+		for (auto i = 0; i != result.deliveredCount; ++i) {
+			EXPECT_EQ(result.delivered[i], (20 + i) % kUdpBatchSize);
+		}
+		ExpectReceived(first, toFirst);
+		ExpectReceived(second, toSecond);
+	}
+}
+
+TEST(UdpBatchTest, RefusesWhenFullOrTooLarge) {
+	Loopback receiver;
+	auto batch = UdpSendBatch();
+	const auto datagram = Datagram(0, kUdpMaxDatagramSize + 1);
+	EXPECT_EQ(batch.push(datagram.data(), datagram.size(), receiver.address(), receiver.addressLength()), -1);
+	for (auto i = 0; i != kUdpBatchSize; ++i) {
+		EXPECT_EQ(batch.push(datagram.data(), 10, receiver.address(), receiver.addressLength()), i);
+	}
+	EXPECT_TRUE(batch.full());
+	EXPECT_EQ(batch.push(datagram.data(), 10, receiver.address(), receiver.addressLength()), -1);
+	batch.clear();
+	EXPECT_TRUE(batch.empty());
+}
+
+TEST(UdpBatchTest, SkipsFailedDatagram) {
+	Loopback sender, receiver;
+	auto batch = UdpSendBatch();
+	auto wrongFamily = sockaddr_storage();
+	wrongFamily.ss_family = AF_INET6;
+	const auto datagram = Datagram(0, 100);
+	batch.push(datagram.data(), datagram.size(), receiver.address(), receiver.addressLength());
+	batch.push(datagram.data(), datagram.size(), wrongFamily, sizeof(sockaddr_in6));
+	batch.push(datagram.data(), datagram.size(), receiver.address(), receiver.addressLength());
+
+	const auto result = batch.flush(sender.descriptor());
+	EXPECT_EQ(result.deliveredCount, 2);
+	EXPECT_EQ(result.failedCount, 1);
+	EXPECT_EQ(result.delivered[0], 0);
+	EXPECT_EQ(result.delivered[1], 2);
+	EXPECT_TRUE(batch.empty());
+}
+
+TEST(UdpBatchTest, DropsTruncatedDatagram) {
+	Loopback sender, receiver;
+	const auto datagram = Datagram(0, kUdpMaxDatagramSize + 100);
+	::sendto(
+		sender.descriptor(),
+		datagram.data(),
+		datagram.size(),
+		0,
+		reinterpret_cast<const sockaddr*>(&receiver.address()),
+		receiver.addressLength());
+	auto receiveBatch = UdpReceiveBatch();
+	ASSERT_EQ(receiveBatch.receive(receiver.descriptor()), 1);
+	EXPECT_TRUE(receiveBatch.truncated(0));
+}
+
+} // namespace
+} // namespace tgcalls